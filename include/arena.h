@@ -0,0 +1,56 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/** \file arena.h
+ *  \brief Арены: память для структур с общим временем жизни.
+ *
+ * Память арены выделяется сдвигом указателя в блоке, блоки берутся у
+ * malloc() по мере надобности, а отдельные объекты не освобождаются:
+ * все блоки освобождаются сразу в arena_release(). Арена не защищена
+ * блокировками и используется одним потоком за раз.
+ *
+ * Письмо со своими получателями и именем файла живет в своей арене
+ * (maildir.c), домены, сессии и элементы очередей доменов потока
+ * доставки - в арене потока (protocol.c).
+ *
+ * Счетчики освобожденных арен всех потоков складываются, их возвращает
+ * arena_get_stats().
+ */
+
+#define ARENA_BLOCK_SIZE	4096	// default size of block with its header
+#define ARENA_ALIGN			16
+
+struct arena_block;
+
+/**
+ * \brief Арена и ее счетчики
+ */
+struct arena {
+	struct arena_block *blocks;		// current block is the first one
+	size_t block_size;
+	unsigned long allocs;
+	unsigned long bytes;			// bytes of allocations
+	unsigned long block_count;
+};
+
+/**
+ * \brief Счетчики всех освобожденных арен
+ */
+struct arena_stats {
+	unsigned long arenas;
+	unsigned long allocs;
+	unsigned long bytes;
+	unsigned long blocks;
+};
+
+void	arena_init(struct arena *a, size_t block_size);
+void*	arena_alloc(struct arena *a, size_t size);
+char*	arena_strdup(struct arena *a, const char *s);
+char*	arena_strndup(struct arena *a, const char *s, size_t length);
+void	arena_release(struct arena *a);
+
+struct arena_stats	arena_get_stats();
+
+#endif
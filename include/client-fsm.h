@@ -54,13 +54,15 @@
  *  Count of non-terminal states.  The generated states INVALID and DONE
  *  are terminal, but INIT is not  :-).
  */
-#define SMTP_CLIENT_FSM_STATE_CT  7
+#define SMTP_CLIENT_FSM_STATE_CT  12
 typedef enum {
-    SMTP_CLIENT_FSM_ST_INIT,     SMTP_CLIENT_FSM_ST_HELO,
+    SMTP_CLIENT_FSM_ST_INIT,     SMTP_CLIENT_FSM_ST_EHLO,
+    SMTP_CLIENT_FSM_ST_HELO,     SMTP_CLIENT_FSM_ST_ENVELOPE,
     SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_ST_RCPTTO,
     SMTP_CLIENT_FSM_ST_DATA,     SMTP_CLIENT_FSM_ST_DATASTR,
-    SMTP_CLIENT_FSM_ST_QUIT,     SMTP_CLIENT_FSM_ST_INVALID,
-    SMTP_CLIENT_FSM_ST_DONE
+    SMTP_CLIENT_FSM_ST_BDAT,     SMTP_CLIENT_FSM_ST_IDLE,
+    SMTP_CLIENT_FSM_ST_RSET,     SMTP_CLIENT_FSM_ST_QUIT,
+    SMTP_CLIENT_FSM_ST_INVALID,  SMTP_CLIENT_FSM_ST_DONE
 } te_smtp_client_fsm_state;
 
 /**
@@ -68,12 +70,15 @@ typedef enum {
  *
  *  Count of the valid transition events
  */
-#define SMTP_CLIENT_FSM_EVENT_CT 7
+#define SMTP_CLIENT_FSM_EVENT_CT 12
 typedef enum {
-    SMTP_CLIENT_FSM_EV_R220,    SMTP_CLIENT_FSM_EV_R250,
-    SMTP_CLIENT_FSM_EV_R354,    SMTP_CLIENT_FSM_EV_R221,
-    SMTP_CLIENT_FSM_EV_NO_RCPT, SMTP_CLIENT_FSM_EV_NO_MAIL,
-    SMTP_CLIENT_FSM_EV_TIMEOUT, SMTP_CLIENT_FSM_EV_INVALID
+    SMTP_CLIENT_FSM_EV_R220,       SMTP_CLIENT_FSM_EV_R250,
+    SMTP_CLIENT_FSM_EV_R354,       SMTP_CLIENT_FSM_EV_R221,
+    SMTP_CLIENT_FSM_EV_R5XX,       SMTP_CLIENT_FSM_EV_PIPELINING,
+    SMTP_CLIENT_FSM_EV_CHUNKING,   SMTP_CLIENT_FSM_EV_NO_RCPT,
+    SMTP_CLIENT_FSM_EV_NO_MAIL,    SMTP_CLIENT_FSM_EV_NEW_MAIL,
+    SMTP_CLIENT_FSM_EV_EXPIRE,     SMTP_CLIENT_FSM_EV_TIMEOUT,
+    SMTP_CLIENT_FSM_EV_INVALID
 } te_smtp_client_fsm_event;
 
 /**
@@ -0,0 +1,43 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <dns.h>
+
+/** \file dns-cache.h
+ *  \brief Кэш ответов DNS.
+ *
+ * Хранит записи MX, A и AAAA до истечения их TTL, а также отрицательные
+ * ответы (NXDOMAIN и отсутствие записей) - на TTL из SOA (RFC 2308) или
+ * DNS_CACHE_NEGATIVE_TTL, если SOA в ответе не было. Ошибки и таймауты не
+ * кэшируются.
+ *
+ * Если задан файл, кэш загружается из него в dns_cache_init() и
+ * сохраняется в dns_cache_final(), чтобы после перезапуска клиент не
+ * запрашивал заново все домены разом.
+ *
+ * У каждого потока доставки свой кэш (записи его доменов); файл общий, и
+ * при сохранении записи потока объединяются с уже сохраненными другими.
+ */
+
+#define DNS_CACHE_BUCKETS		4096
+#define DNS_CACHE_MAX_ENTRIES	65536
+#define DNS_CACHE_MAX_TTL		86400	// seconds, longer TTLs are cut
+#define DNS_CACHE_NEGATIVE_TTL	60		// seconds, for negative replies without SOA
+
+struct dns_cache_stats {
+	unsigned long hits;
+	unsigned long negative_hits;	// part of hits
+	unsigned long misses;
+	int entries;
+};
+
+int		dns_cache_init(const char *file);
+void	dns_cache_final();
+int		dns_cache_lookup(const char *name, int type, struct dns_result *res);
+void	dns_cache_store(const char *name, int type, const struct dns_result *res);
+int		dns_cache_load(const char *file);
+int		dns_cache_save(const char *file);
+
+struct dns_cache_stats	dns_cache_get_stats();
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <netinet/in.h>
+
+/** \file dns.h
+ *  \brief Асинхронный DNS-клиент.
+ *
+ * Запросы MX, A и AAAA отправляются по UDP на DNS-сервер из
+ * /etc/resolv.conf (или заданный в dns_init()); если ответ обрезан (TC),
+ * запрос повторяется по TCP. Ответы разбираются прямо из формата RFC 1035.
+ *
+ * Дескрипторы DNS-клиента регистрируются в event loop с данными
+ * dns_event_data(); при событии на них нужно вызвать dns_process(), а
+ * время от времени (не позже dns_next_timeout()) - dns_check_timeouts().
+ * Результат каждого запроса передается в callback, указанный в
+ * dns_resolve(), ровно один раз (кроме запросов, отмененных dns_final()).
+ * Ответы берутся из кэша (dns-cache.h), пока не истек их TTL; в этом
+ * случае callback вызывается прямо из dns_resolve().
+ */
+
+#define DNS_PORT			53
+#define DNS_PACKET_SIZE		512		// max size of UDP message without EDNS
+#define DNS_NAME_SIZE		256
+#define DNS_MAX_RECORDS		16
+#define DNS_RETRY_TIME		1000	// ms before query is sent again
+#define DNS_TRIES			3
+
+#define DNS_T_A		1
+#define DNS_T_MX	15
+#define DNS_T_AAAA	28
+
+typedef enum {
+	DNS_OK,
+	DNS_NXDOMAIN,	// domain does not exist
+	DNS_NODATA,		// domain exists, but has no records of this type
+	DNS_ERROR,		// server failure, malformed reply etc.
+	DNS_TIMEOUT
+} dns_status;
+
+struct dns_mx {
+	int pref;
+	char host[DNS_NAME_SIZE];
+};
+
+struct dns_addr {
+	int family;		// AF_INET or AF_INET6
+	union {
+		struct in_addr v4;
+		struct in6_addr v6;
+	};
+};
+
+/**
+ * \brief Результат запроса: записи одного типа и их минимальный TTL (для
+ * отрицательных ответов - TTL из SOA, RFC 2308)
+ */
+struct dns_result {
+	dns_status status;
+	int type;
+	int count;
+	unsigned int ttl;
+	union {
+		struct dns_mx mx[DNS_MAX_RECORDS];
+		struct dns_addr addr[DNS_MAX_RECORDS];
+	};
+};
+
+typedef void (*dns_callback)(void *arg, const char *name, const struct dns_result *res);
+
+int		dns_init(const char *server, int port);
+void	dns_final();
+void*	dns_event_data();
+int		dns_resolve(const char *name, int type, dns_callback cb, void *arg);
+void	dns_process();
+void	dns_check_timeouts();
+int		dns_next_timeout();
+int		dns_pending();
+
+// Wire format
+int		dns_build_query(unsigned char *buf, unsigned short id, const char *name, int type);
+int		dns_parse_reply(const unsigned char *buf, int length, int type, struct dns_result *res);
+
+#endif
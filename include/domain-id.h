@@ -0,0 +1,27 @@
+#ifndef DOMAIN_ID_H
+#define DOMAIN_ID_H
+
+/** \file domain-id.h
+ *  \brief Номера доменов получателей.
+ *
+ * Каждое имя домена хранится один раз, в нижнем регистре, и получает
+ * номер (от 1), так что получатели хранят номер домена, а домены
+ * сравниваются как числа. Таблица общая для всех потоков: новые имена
+ * добавляются под блокировкой, а недавно встреченные имена поток находит
+ * в своем кэше без нее. Имена не перемещаются и не удаляются до
+ * domain_id_final(), поэтому domain_id_name() работает без блокировки.
+ * Если таблица заполнена, domain_id() возвращает -1 для нового имени:
+ * такое письмо не испорчено, его можно будет прочитать позже.
+ */
+
+#define DOMAIN_NAME_SIZE	256		// limit of domain name with '\0'
+#define DOMAIN_ID_PAGE		1024	// names in one page of table
+#define DOMAIN_ID_PAGES		1024	// so there may be up to 1M domains
+#define DOMAIN_ID_CACHE		256		// domains remembered by every thread, power of 2
+
+int			domain_id(const char *name, int length);
+const char*	domain_id_name(int id);
+int			domain_id_count();
+void		domain_id_final();
+
+#endif
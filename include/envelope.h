@@ -0,0 +1,49 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+/** \file envelope.h
+ *  \brief Разбор строк конверта письма без регулярных выражений.
+ *
+ * Строки MAIL FROM, RCPT TO и DATA в начале файла письма распознаются
+ * без учета регистра по тем же правилам, что и регулярками RE_mail_from,
+ * RE_rcpt_to, RE_rcpt_domain и RE_data (regexp.h), но без PCRE и без
+ * копирования: для получателя возвращается положение адреса и домена в
+ * строке.
+ *
+ * Конец строки и символы '@' ищутся за один проход векторными командами
+ * (AVX2 или SSE2, что поддерживает процессор) с побайтным разбором
+ * остатка строки; '<', '>' и CRLF адреса стоят на известных местах
+ * относительно них. Реализация выбирается в envelope_init(), для
+ * тестов ее можно задать через envelope_select().
+ */
+
+typedef enum {
+	ENVELOPE_INVALID,
+	ENVELOPE_MAIL_FROM,
+	ENVELOPE_RCPT_TO,
+	ENVELOPE_DATA
+} envelope_type;
+
+typedef enum {
+	ENVELOPE_SCALAR,
+	ENVELOPE_SSE2,
+	ENVELOPE_AVX2,
+	envelope_impl_count
+} envelope_impl;
+
+/**
+ * \brief Строка конверта: ее тип, длина вместе с '\n' и положение адреса
+ * получателя и его домена относительно начала строки
+ */
+struct envelope_line {
+	envelope_type type;
+	int length;
+	int name, name_length;		// address between '<' and '>' of RCPT TO
+	int domain, domain_length;	// part of address after its last '@'
+};
+
+int		envelope_init();
+int		envelope_select(envelope_impl impl);
+int		envelope_scan(const char *buf, int length, struct envelope_line *l);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/** \file event.h
+ *  \brief Ожидание событий на множестве дескрипторов.
+ *
+ * Дескриптор регистрируется один раз вместе с указателем на свои данные
+ * (например, на struct mx_conn), и event_wait() возвращает этот указатель
+ * для каждого готового дескриптора, так что искать соединение по сокету
+ * не нужно.
+ *
+ * Есть три механизма: poll(), epoll() и io_uring. Механизм выбирается при
+ * вызове event_init() ("poll", "epoll" или "io_uring"); если USE_EPOLL или
+ * USE_IO_URING не определен, то соответствующий механизм не компилируется.
+ * USE_IO_URING определяется при сборке (см. Makefile), только если заголовки
+ * ядра содержат все, что нужно uring.c. Если io_uring недоступен в ядре,
+ * используется epoll().
+ *
+ * С io_uring, кроме ожидания готовности, можно отправить ядру сами операции
+ * чтения и записи сокета (event_recv() и event_send()): они накапливаются и
+ * отправляются одним системным вызовом в следующем event_wait(), который
+ * вернет их результаты вместе с готовыми дескрипторами.
+ */
+
+// if not defined only poll() backend will be available
+#define USE_EPOLL
+
+// USE_IO_URING is defined by Makefile, when kernel headers support io_uring
+// well enough; if not defined io_uring backend is not available
+
+#define EVENT_READ	1
+#define EVENT_WRITE	2
+#define EVENT_ERROR	4
+#define EVENT_RECV	8	// event_recv() has completed, result is in recv_res
+#define EVENT_SEND	16	// event_send() has completed, result is in send_res
+
+typedef enum {
+	EVENT_BACKEND_POLL,
+	EVENT_BACKEND_EPOLL,
+	EVENT_BACKEND_IO_URING
+} event_backend;
+
+/**
+ * \brief Готовый дескриптор: данные, переданные в event_add(), и события;
+ * для завершенных операций - их результат (число байт или -errno)
+ */
+struct event {
+	void *data;
+	int events;
+	int recv_res;
+	int send_res;
+};
+
+/**
+ * \brief Счетчики для замеров: число вызовов event_wait(), вернувших
+ * события, число готовых дескрипторов и число обработанных ответов
+ */
+struct event_stats {
+	unsigned long wakeups;
+	unsigned long events;
+	unsigned long handled;
+};
+
+int		event_init(const char *backend);
+void	event_final();
+int		event_add(int fd, int events, void *data);
+int		event_mod(int fd, int events, void *data);
+int		event_del(int fd);
+int		event_wait(struct event *evs, int max, int ms);
+event_backend	event_current_backend();
+
+// Asynchronous operations, available with io_uring only
+int		event_async();
+int		event_recv(int fd, void *buf, int length);
+int		event_send(int fd, const void *buf, int length);
+
+void				event_count_handled(int handled);
+struct event_stats	event_get_stats();
+
+#endif
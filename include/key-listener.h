@@ -14,6 +14,7 @@
 int keyboard_listener_fork();
 int keyboard_listener_final();
 int quit_key_pressed();
+int keyboard_listener_fd();
 
 
 #endif
@@ -5,17 +5,29 @@
 #ifndef MAILDIR_H
 #define MAILDIR_H
 
+#include <sys/types.h>
 #include <queue.h>
+#include <arena.h>
+#include <domain-id.h>
 #include <stdio.h>
 
 
 //~ #define MY_DOMAIN "quint.com"
+
+#define MAILDIR_BATCH_SIZE 64	// operations with files submitted at once
+#define MAIL_READ_SIZE 4096		// mail files up to this size are read at once, larger ones are mapped
+#define MAIL_LINE_SIZE 500		// limit of envelope line
+#define MAIL_NAME_SIZE 256		// limit of address of recipient with '\0' (RFC 5321)
+#define MAILDIR_READ_BATCH 4096	// parsed mails given to delivery at once
+#define MAIL_ARENA_SIZE 1024	// block of arena of mail, fits mail with about ten recipients
 /**
  * \brief Структура для хранения имени и домена получателя
+ *
+ * Имя лежит в арене письма, домен - номер из domain-id.h.
  */
 struct rcpt {
-	char name[200];
-	char domain[100];
+	char *name;
+	int domain;
 	TAILQ_ENTRY(rcpt) entry;
 };
 TAILQ_HEAD(rcpt_list, rcpt);
@@ -24,15 +36,26 @@ TAILQ_HEAD(rcpt_list, rcpt);
  * \brief Структура для хранения писем
  */
 struct mail {
-	char from[200];
+	char *from;			// MAIL FROM line, in arena
 	struct rcpt_list rcpts;
-	char *msg;
+	off_t data_offset;	// message body is sent straight from mail file,
+	off_t data_length;	// these are its offset and length with final dot
 	int was_sent;
+	int pending;	// count of domains which have not finished with mail
 	char *filename;
+	struct arena arena;	// memory of mail itself, its recipients and file name
 	TAILQ_ENTRY(mail) entry;
 };
 TAILQ_HEAD(mail_list, mail);
 
+// Results of parsing of mail file
+typedef enum {
+	MAIL_PARSED,
+	MAIL_GONE,		// file can't be opened
+	MAIL_BROKEN,	// file can't be read or has incorrect syntax
+	MAIL_DEFERRED	// file is correct, but can't be handled now; it stays in NEW
+} mail_status;
+
 typedef enum {
 	DIR_ROOT,
 	DIR_NEW,
@@ -49,17 +72,30 @@ void	free_mail(struct mail *m);
 void	free_mail_list(struct mail_list *ml);
 
 // Disk operations
+int		maildir_watch_init();
+int		maildir_watch_final();
+int		maildir_watch_fd();
+int		wait_for_new_mail(int ms, const int *wake_fds, int wake_count);
 int		new_mail_exist();
+int		spool_add(const char *name, ino_t ino);
+void	spool_forget(const char *name);
 void	move_mail(const char *filename, maildir_dir from_dir, maildir_dir to_dir);
 void	copy_mail(const char *filename, maildir_dir from_dir, maildir_dir to_dir);
 void	delete_mail(const char *filename, maildir_dir dir);
+void	maildir_batch_begin();
+void	maildir_batch_end();
 
 // Allocations and operations with maildir structures
 int				filter_my_mail(struct mail_list *ml);
 int				read_all_mail(struct mail_list *ml);
 struct mail*	read_mail_file(const char *filename);
-int				read_mail_from(FILE *f, struct mail *m);
-int				read_mail_to  (FILE *f, struct mail *m);
-int				read_mail_data(FILE *f, struct mail *m);
+struct mail*	parse_mail_file(const char *filename, mail_status *status);
+void			mail_file_failed(const char *filename, mail_status status);
+int				read_mail(const char *buf, off_t length, struct mail *m);
+int				read_mail_from(const char *buf, off_t length, struct mail *m);
+int				read_mail_to  (const char *buf, off_t length, struct mail *m);
+int				read_mail_data(const char *buf, off_t length, off_t offset, struct mail *m);
+int				open_mail_data(struct mail *m);
+int				find_stuffed_dots(struct mail *m, int fd, off_t **dots);
 
 #endif
@@ -6,7 +6,20 @@ int opts_final();
 
 int opts_mx_port();
 int opts_connection_timeout();
+int opts_smtp_timeout(const char *command);
+int opts_rescan_interval();
+int opts_min_sessions();
+int opts_max_sessions();
+int opts_mails_per_session();
+int opts_idle_timeout();
+int opts_pipelining();
+int opts_chunking();
+int opts_workers();
+int opts_parser_threads();
 const char *opts_maildir_root();
 const char *opts_my_domain();
+const char *opts_event_backend();
+const char *opts_dns_server();
+const char *opts_dns_cache();
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <pthread.h>
+#include <maildir.h>
+
+/** \file parser.h
+ *  \brief Потоки разбора файлов писем из MAILDIR/NEW.
+ *
+ * Главный поток отдает пулу сразу все файлы, найденные сканером (пакет),
+ * и забирает разобранные письма в порядке появления файлов: пакет - это
+ * очередь, которую потоки пула заполняют кусками по PARSER_CHUNK_SIZE
+ * файлов, а главный поток читает с начала, дожидаясь только следующего
+ * по порядку письма. Поэтому доставка первых писем начинается, пока
+ * остальные файлы большой очереди еще разбираются.
+ *
+ * Потоки пула только читают файлы; сломанные файлы переносит, а
+ * исчезнувшие забывает главный поток, которому принадлежит состояние
+ * сканера.
+ */
+
+#define PARSER_MAX			64
+#define PARSER_CHUNK_SIZE	64		// files taken by parser thread at once
+
+/**
+ * \brief Файл пакета и результат его разбора
+ */
+struct parser_job {
+	char *name;
+	struct mail *mail;
+	mail_status status;	// valid when file is parsed
+	int done;
+};
+
+int		parser_start(int count);
+void	parser_stop();
+int		parser_count();
+int		parser_submit(char **names, int count);
+int		parser_pending();
+int		parser_next(struct parser_job *job);
+
+#endif
@@ -7,6 +7,8 @@
 
 #include <queue.h>
 #include <time.h>
+#include <dns.h>
+#include <timer.h>
 
 #include <client-fsm.h>
 #include <maildir.h>
@@ -16,19 +18,132 @@
 
 //~ #define CONN_TIMEOUT (12)
 
+#define REPLY_BUF_SIZE 4096
+
+/**
+ * \brief Буфер принятых от MX данных; ответы разбираются прямо в нем,
+ * data[start..end) -- еще не разобранные данные
+ */
+struct reply_buf {
+	char data[REPLY_BUF_SIZE];
+	int start, end;
+};
+
+/**
+ * \brief Открытый файл письма, общий для всех частей вывода из него;
+ * закрывается, когда отправлена последняя из них
+ */
+struct out_file {
+	int fd;
+	int refs;
+};
+
+/**
+ * \brief Часть данных, ожидающих отправки на MX: в памяти или в файле
+ * (тело письма отправляется через sendfile(), минуя память процесса)
+ */
+struct out_chunk {
+	char *data;
+	int length, offset;
+	int owned;				// 1 if data was copied and should be freed
+	struct out_file *file;	// file of data or 0; it is released when chunk is sent
+	off_t file_offset;		// where data starts in file
+	TAILQ_ENTRY(out_chunk) entry;
+};
+TAILQ_HEAD(out_queue, out_chunk);
+
+// Задержка перед попыткой соединения со следующим адресом MX, пока
+// предыдущие еще не завершились, мс (Happy Eyeballs, RFC 8305)
+#define CONNECT_ATTEMPT_DELAY 250
+
+// Расширения ESMTP, объявленные сервером в ответе на EHLO
+#define SMTP_CAP_PIPELINING	1
+#define SMTP_CAP_CHUNKING	2
+
+// Размер куска тела письма в команде BDAT при конвейерной отправке (RFC 3030)
+#define BDAT_CHUNK_SIZE (64 * 1024)
+
+// Адресов на один MX: A и AAAA записи
+#define MX_MAX_ADDRS (2 * DNS_MAX_RECORDS)
+
+// Размер блока арены потока доставки: домены, сессии, очереди доменов
+#define CONN_ARENA_SIZE (64 * 1024)
+
+// Состояние разрешения MX домена
+typedef enum {
+	DOMAIN_DNS_NONE,
+	DOMAIN_DNS_MX,		// waiting for MX records
+	DOMAIN_DNS_ADDR,	// waiting for A and AAAA records of MX
+	DOMAIN_DNS_READY,
+	DOMAIN_DNS_FAILED
+} domain_dns_state;
+
 struct mx_conn {
 	int sock;
+	int connecting;				// 1 while non-blocking connect is in progress
+	int attempts[MX_MAX_ADDRS];	// sockets of connect attempts racing each other
+	int attempt_count;
+	struct timer attempt_timer;	// starts next connect attempt
+	struct timer timeout;		// timeout of current state, rearmed on every reply
+	struct dns_addr addrs[MX_MAX_ADDRS];	// addresses of MX, families interleaved
+	int addr_count;
+	int addr_next;				// next address to try
+	int port;
+	struct reply_buf in;
+	struct out_queue out;
+	int out_bytes;
+	int out_error;
+	int sending;				// 1 while first chunk of output is sent by event_send()
 	te_smtp_client_fsm_state state;
+	int caps;		// SMTP_CAP_* flags from EHLO reply
+	int replies;	// count of replies expected for pipelined envelope or BDAT
 	struct mail *m;
 	struct rcpt *r;
 	struct domain *dom;
-	time_t time_of_last_response;
+	char mx[DNS_NAME_SIZE];	// host name of MX, idle sessions are reused by it
+	int greeted;	// 1 if server has sent its 220 greeting
+	int reused;		// 1 if idle session was woken up and RSET is not confirmed yet
 	TAILQ_ENTRY(mx_conn) entry;
+	TAILQ_ENTRY(mx_conn) dom_entry;
 };
 TAILQ_HEAD(mx_conn_list, mx_conn);
 
+/**
+ * \brief Один из MX домена и его адреса
+ */
+struct domain_mx {
+	char host[DNS_NAME_SIZE];
+	int pref;
+	struct dns_addr addrs[MX_MAX_ADDRS];	// IPv6 first
+	int addr_count;
+	int pending;		// address queries in flight
+	int failed;			// 1 if MX has no addresses, can't be connected or refused to greet
+	struct domain *dom;
+};
+
+struct queued_mail {
+	struct mail *m;
+	TAILQ_ENTRY(queued_mail) entry;
+};
+TAILQ_HEAD(mail_queue, queued_mail);
+
+/**
+ * \brief Домен назначения: очередь писем и пул сессий с его MX
+ */
 struct domain {
-	char name[100];
+	int id;							// number from domain-id.h
+	const char *name;				// its interned name
+	struct mail_queue queue;
+	int queued;						// length of queue
+	struct mx_conn_list conns;		// sessions with MX of domain
+	int conn_count;
+	int max_conns;					// limit of sessions, lowered if MX refuses extra ones
+	domain_dns_state dns_state;
+	int dns_pending;				// DNS queries in flight for domain
+	time_t dns_expires;				// when MX and its addresses should be resolved again
+	struct domain_mx mxs[DNS_MAX_RECORDS];	// MX by preference, equal ones shuffled
+	int mx_count;
+	int mx_next;					// next MX of best ones to get a session
 	TAILQ_ENTRY(domain) entry;
 };
 TAILQ_HEAD(domain_set, domain);
@@ -37,28 +152,70 @@ TAILQ_HEAD(domain_set, domain);
 // Main functions
 int		smtp_client_loop();
 int		conn_init();
+int		conn_enqueue_mail(struct mail *m);
+void	conn_start();
 void	conn_loop();
+void	conn_finish_mail();
 int		conn_final();
 
 // Domain related functions
-void	domain_add(struct domain_set *domains, char *new_domain_name);
-int		rcpt_is_from_domain(struct rcpt *r, struct domain *d);
-int		mail_has_rcpts_from_domain(struct mail *m, struct domain *d);
+struct domain*	domain_add(struct domain_set *domains, int new_domain);
+int				free_domain(struct domain_set *domains, struct domain *d);
+void			domain_enqueue_mail(struct domain *d, struct mail *m);
+struct mail*	domain_next_mail(struct domain *d);
+void			domain_requeue_mail(struct domain *d, struct mail *m);
+int				domain_session_target(struct domain *d);
+void			domain_fail(struct domain *d);
+void			domain_resolve(struct domain *d);
+void			domain_mx_resolved(void *arg, const char *name, const struct dns_result *res);
+void			domain_addr_resolved(void *arg, const char *name, const struct dns_result *res);
+struct domain_mx*	domain_pick_mx(struct domain *d);
+struct domain_mx*	domain_find_mx(struct domain *d, const char *host);
+int				domain_mx_alive(struct domain *d);
+int				rcpt_is_from_domain(struct rcpt *r, struct domain *d);
+int				mail_has_rcpts_from_domain(struct mail *m, struct domain *d);
+void			mail_release(struct mail *m);
+int				conn_next_mail(struct mx_conn *conn);
+void			mail_finish(struct mail *m);
 
 // Connection related stuff
-int				check_dns(char *d, char *output_address);
-struct mx_conn*	create_connection(struct domain *dom);
-struct mx_conn*	get_conn_by_socket(struct mx_conn_list *cl, int sock);
+struct mx_conn*	create_connection(struct domain *dom, struct domain_mx *mx);
+struct mx_conn*	find_idle_connection(const char *mx_address);
+void			conn_attach(struct mx_conn *conn);
+int				conn_connect_next(struct mx_conn *conn);
+void			conn_connected(struct mx_conn *conn);
+void			conn_close_attempts(struct mx_conn *conn, int except);
+void			conn_setup_timers(struct mx_conn *conn);
+void			conn_rearm(struct mx_conn *conn);
+void			conn_wakeup(struct mx_conn *conn);
 int				wait_for_response();
+int				read_response(struct mx_conn *conn);
+int				conn_recv(struct mx_conn *conn);
+int				conn_received(struct mx_conn *conn, int res);
+int				reply_frame(const char *buf, int length, int *last_line);
 int				parse_response(struct mx_conn *conn, char *str, int length);
+int				ehlo_capabilities(const char *str, int length);
 void			invalidate_connection(struct mx_conn *conn);
 
+// Output queue
+int		conn_write(struct mx_conn *conn, const char *data, int length, int copy);
+int		conn_write_file(struct mx_conn *conn, struct out_file *f, off_t offset, int length);
+struct out_file*	out_file_open(int fd);
+void				out_file_release(struct out_file *f);
+int		conn_flush(struct mx_conn *conn);
+int		conn_sent(struct mx_conn *conn, int res);
+void	conn_clear_output(struct mx_conn *conn);
+
 // Protocol realted stuff
+int send_ehlo(struct mx_conn *conn);
 int send_hello(struct mx_conn *conn);
+int send_envelope(struct mx_conn *conn);
+int send_rset(struct mx_conn *conn);
 int send_mailfrom(struct mx_conn *conn);
 int send_rcptto(struct mx_conn *conn);
 int send_data(struct mx_conn *conn);
 int send_datastr(struct mx_conn *conn);
+int send_bdat(struct mx_conn *conn);
 int send_quit(struct mx_conn *conn);
 
 #endif
@@ -24,24 +24,22 @@
 #define RE_CMD_221 "^221(?:\\s+.+)?\\r\n"
 #define RE_CMD_250 "^250(?:\\s+.+)?\\r\n"
 #define RE_CMD_354 "^354(?:\\s+.+)?\\r\n"
+#define RE_CMD_5XX "^5\\d\\d(?:\\s+.+)?\\r\n"
 #define RE_CMD_DATA "^DATA\\r\n"
 #define RE_CMD_MAIL_FROM "^MAIL FROM:\\s*<.+>\\r\n"
 #define RE_CMD_RCPT_TO "^RCPT TO:\\s*<(.+@.+)>\\r\n"
 #define RE_CMD_RCPT_TO_DOMAIN "^RCPT TO:\\s*<.+@(.+)>\\r\n"
-#define RE_CMD_MX_DNS "MX\\s+\\d+\\s*(.+)\.$"
-#define RE_CMD_MX_DNS_PRIO "MX\\s+(\\d+)\\s*.+\.$"
 
 typedef enum {
 	r220,
 	r221,
 	r250,
 	r354,
+	r5xx,
 	RE_data,
 	RE_mail_from,
 	RE_rcpt_to,
 	RE_rcpt_domain,
-	RE_mx_dns,
-	RE_mx_dns_prio,
 	smtp_re_count
 } smtp_re_name;
 
@@ -0,0 +1,44 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <queue.h>
+
+/** \file timer.h
+ *  \brief Иерархическое колесо таймеров с точностью до миллисекунды.
+ *
+ * Таймер встраивается в структуру владельца (например, в struct mx_conn)
+ * и взводится заново за O(1) при каждом ответе сервера. Время - значения
+ * time_ms(). Event loop ждет событий не дольше timer_next_timeout(), а
+ * после ожидания вызывает timer_run(), которая вызывает callback каждого
+ * истекшего таймера.
+ *
+ * Уровень l колеса хранит таймеры, до срабатывания которых осталось
+ * меньше 64^(l+1) мс; при переходе через границу слота уровня l его
+ * таймеры переносятся на нижние уровни.
+ */
+
+#define TIMER_LEVELS	4		// 64^4 ms is about 4.6 hours; later timers are clamped
+#define TIMER_SLOT_BITS	6
+#define TIMER_SLOTS		(1 << TIMER_SLOT_BITS)
+
+struct timer;
+typedef void (*timer_callback)(struct timer *t, void *arg);
+TAILQ_HEAD(timer_list, timer);
+
+struct timer {
+	long expires;
+	timer_callback cb;
+	void *arg;
+	struct timer_list *slot;	// slot of wheel, 0 if timer is not pending
+	TAILQ_ENTRY(timer) entry;
+};
+
+void	timer_init(long now);
+void	timer_setup(struct timer *t, timer_callback cb, void *arg);
+void	timer_set(struct timer *t, long expires);
+void	timer_cancel(struct timer *t);
+int		timer_run(long now);
+int		timer_next_timeout(long now);
+int		timer_count();
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/** \file uring.h
+ *  \brief Минимальная обертка над io_uring без liburing.
+ *
+ * Кольца отображаются в память напрямую, запросы (SQE) накапливаются и
+ * отправляются ядру одним вызовом io_uring_enter() вместе с ожиданием
+ * результатов (CQE). Используется механизмом событий (event.c) и
+ * пакетными операциями с файлами писем (maildir.c). Подключается и
+ * компилируется, только если определен USE_IO_URING.
+ */
+
+/**
+ * \brief Кольца io_uring одного потока
+ */
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned features;
+
+	// Submission queue
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending;	// filled entries, which were not submitted yet
+
+	// Completion queue
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int		uring_init(struct uring *r, unsigned entries);
+void	uring_final(struct uring *r);
+int		uring_supports(struct uring *r, int op);
+
+struct io_uring_sqe*	uring_get_sqe(struct uring *r);
+int						uring_submit(struct uring *r, int wait, int ms);
+struct io_uring_cqe*	uring_peek_cqe(struct uring *r);
+void					uring_cqe_seen(struct uring *r);
+
+#endif
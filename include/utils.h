@@ -16,5 +16,6 @@
 
 char *str_without_new_line(char *str, int length);
 char getch();
+long time_ms();
 
 #endif
@@ -0,0 +1,82 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <maildir.h>
+
+/** \file worker.h
+ *  \brief Потоки доставки, каждый со своим event loop и своей долей доменов.
+ *
+ * Домен назначения закреплен за одним потоком по хэшу имени, поэтому
+ * очередь домена, пул его сессий и записи DNS кэша для него живут в одном
+ * потоке, и блокировки для них не нужны.
+ *
+ * Главный поток сканирует MAILDIR/NEW и раздает письма потокам через
+ * lock-free очереди с одним писателем и одним читателем. Письмо попадает
+ * в каждый поток, которому принадлежит хотя бы один домен его получателей.
+ * Письма, с которыми закончили все домены, возвращаются главному потоку
+ * через такие же очереди: удаляет и переносит файлы писем только он.
+ * Возвращая письма, потоки будят главный поток через eventfd
+ * (workers_done_fd()), так что без работы он спит без таймаута.
+ */
+
+#define WORKER_MAX			256
+#define WORKER_RING_SIZE	4096	// power of 2
+#define CACHE_LINE_SIZE		64
+
+/**
+ * \brief Очередь писем с одним писателем и одним читателем; индексы
+ * писателя и читателя лежат в разных линиях кэша
+ */
+struct mail_ring {
+	struct mail *items[WORKER_RING_SIZE];
+	unsigned head;		// next item to take, written by reader only
+	char pad1[CACHE_LINE_SIZE - sizeof(unsigned)];
+	unsigned tail;		// next free item, written by writer only
+	char pad2[CACHE_LINE_SIZE - sizeof(unsigned)];
+};
+
+/**
+ * \brief Счетчики потока доставки
+ */
+struct worker_stats {
+	unsigned long mails;		// mails received from scanner
+	unsigned long finished;		// mails returned to scanner
+	unsigned long sessions;		// sessions opened
+	unsigned long wakeups;
+	unsigned long handled;		// replies handled
+	unsigned long dns_hits;
+	unsigned long dns_misses;
+};
+
+struct worker {
+	int id;
+	pthread_t thread;
+	int wake_fd;				// eventfd, which wakes event loop of worker
+	int stop;
+	struct mail_ring in;		// new mail from scanner
+	struct mail_ring done;		// mail finished by all domains of worker
+	struct worker_stats stats;
+};
+
+// Queue of mail
+int				mail_ring_push(struct mail_ring *r, struct mail *m);
+struct mail*	mail_ring_pop(struct mail_ring *r);
+
+// Functions of main thread
+int		workers_start(int count);
+void	workers_stop();
+int		workers_count();
+int		workers_done_fd();
+int		workers_dispatch_new_mail();
+int		workers_finish_mail();
+
+// Functions of delivery thread
+int						worker_of_domain(const char *name);
+int						worker_owns_domain(const char *name);
+struct worker*			worker_self();
+void					worker_receive_mail();
+int						worker_return_mail(struct mail *m);
+struct worker_stats*	worker_stats();
+
+#endif
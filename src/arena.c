@@ -0,0 +1,125 @@
+/**
+ * \file arena.c
+ * \brief Арены: память для структур с общим временем жизни
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <arena.h>
+
+/**
+ * \brief Блок памяти арены
+ */
+struct arena_block {
+	struct arena_block *next;
+	size_t size;		// size of data
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+// Counters of released arenas of all threads
+static struct arena_stats total;
+
+
+// Prepares empty arena; 0 means default size of blocks. Nothing is
+// allocated until first allocation
+void arena_init(struct arena *a, size_t block_size) {
+	memset(a, 0, sizeof(*a));
+	a->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+}
+
+
+// Returns memory of 'size' bytes at 'align' in current block, or in a new
+// one, if it does not fit there
+static void* arena_take(struct arena *a, size_t size, size_t align) {
+	struct arena_block *b = a->blocks;
+	size_t start = b ? (b->used + align - 1) & ~(align - 1) : 0;
+
+	if (!b || start > b->size || b->size - start < size) {
+		size_t block_size = a->block_size ? a->block_size : ARENA_BLOCK_SIZE;
+		size_t data_size = block_size - sizeof(*b);
+
+		if (data_size < size) data_size = size;
+
+		if (!(b = malloc(sizeof(*b) + data_size))) return 0;
+
+		b->size = data_size;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+		a->block_count++;
+		start = 0;
+	}
+
+	b->used = start + size;
+
+	a->allocs++;
+	a->bytes += size;
+
+	return b->data + start;
+}
+
+
+// Returns zeroed memory of 'size' bytes, which lives until arena is
+// released. Allocation, which does not fit into block, gets a new one
+void* arena_alloc(struct arena *a, size_t size) {
+	void *p = arena_take(a, size, ARENA_ALIGN);
+
+	if (p) memset(p, 0, size);
+
+	return p;
+}
+
+
+// Copies 'length' bytes of string into arena and ends them by '\0';
+// strings are not aligned
+char* arena_strndup(struct arena *a, const char *s, size_t length) {
+	char *copy = arena_take(a, length + 1, 1);
+
+	if (copy) {
+		memcpy(copy, s, length);
+		copy[length] = '\0';
+	}
+
+	return copy;
+}
+
+
+// Copies string into arena
+char* arena_strdup(struct arena *a, const char *s) {
+	return arena_strndup(a, s, strlen(s));
+}
+
+
+// Frees all memory of arena at once and adds its counters to common ones.
+// Arena may be used again after that
+void arena_release(struct arena *a) {
+	struct arena_block *b;
+
+	while ((b = a->blocks)) {
+		a->blocks = b->next;
+		free(b);
+	}
+
+	if (a->allocs) {
+		__atomic_add_fetch(&total.arenas, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&total.allocs, a->allocs, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&total.bytes, a->bytes, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&total.blocks, a->block_count, __ATOMIC_RELAXED);
+	}
+
+	a->allocs = a->bytes = a->block_count = 0;
+}
+
+
+// Returns counters of all released arenas
+struct arena_stats arena_get_stats() {
+	struct arena_stats st;
+
+	st.arenas = __atomic_load_n(&total.arenas, __ATOMIC_RELAXED);
+	st.allocs = __atomic_load_n(&total.allocs, __ATOMIC_RELAXED);
+	st.bytes = __atomic_load_n(&total.bytes, __ATOMIC_RELAXED);
+	st.blocks = __atomic_load_n(&total.blocks, __ATOMIC_RELAXED);
+
+	return st;
+}
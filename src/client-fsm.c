@@ -56,13 +56,29 @@
  *  Some transition types may be common to several transitions.
  */
 typedef enum {
+    SMTP_CLIENT_FSM_TR_BDAT_CHUNKING,
+    SMTP_CLIENT_FSM_TR_BDAT_NO_MAIL,
+    SMTP_CLIENT_FSM_TR_BDAT_R250,
+    SMTP_CLIENT_FSM_TR_BDAT_TIMEOUT,
     SMTP_CLIENT_FSM_TR_DATASTR_NO_MAIL,
+    SMTP_CLIENT_FSM_TR_DATASTR_PIPELINING,
     SMTP_CLIENT_FSM_TR_DATASTR_R250,
     SMTP_CLIENT_FSM_TR_DATASTR_TIMEOUT,
     SMTP_CLIENT_FSM_TR_DATA_R354,
     SMTP_CLIENT_FSM_TR_DATA_TIMEOUT,
+    SMTP_CLIENT_FSM_TR_EHLO_CHUNKING,
+    SMTP_CLIENT_FSM_TR_EHLO_PIPELINING,
+    SMTP_CLIENT_FSM_TR_EHLO_R250,
+    SMTP_CLIENT_FSM_TR_EHLO_R5XX,
+    SMTP_CLIENT_FSM_TR_EHLO_TIMEOUT,
+    SMTP_CLIENT_FSM_TR_ENVELOPE_R250,
+    SMTP_CLIENT_FSM_TR_ENVELOPE_R354,
+    SMTP_CLIENT_FSM_TR_ENVELOPE_TIMEOUT,
     SMTP_CLIENT_FSM_TR_HELO_R250,
     SMTP_CLIENT_FSM_TR_HELO_TIMEOUT,
+    SMTP_CLIENT_FSM_TR_IDLE_EXPIRE,
+    SMTP_CLIENT_FSM_TR_IDLE_NEW_MAIL,
+    SMTP_CLIENT_FSM_TR_IDLE_TIMEOUT,
     SMTP_CLIENT_FSM_TR_INIT_R220,
     SMTP_CLIENT_FSM_TR_INIT_TIMEOUT,
     SMTP_CLIENT_FSM_TR_INVALID,
@@ -70,11 +86,16 @@ typedef enum {
     SMTP_CLIENT_FSM_TR_MAILFROM_TIMEOUT,
     SMTP_CLIENT_FSM_TR_QUIT_R221,
     SMTP_CLIENT_FSM_TR_QUIT_TIMEOUT,
+    SMTP_CLIENT_FSM_TR_RCPTTO_CHUNKING,
     SMTP_CLIENT_FSM_TR_RCPTTO_NO_RCPT,
     SMTP_CLIENT_FSM_TR_RCPTTO_R250,
-    SMTP_CLIENT_FSM_TR_RCPTTO_TIMEOUT
+    SMTP_CLIENT_FSM_TR_RCPTTO_TIMEOUT,
+    SMTP_CLIENT_FSM_TR_RSET_CHUNKING,
+    SMTP_CLIENT_FSM_TR_RSET_PIPELINING,
+    SMTP_CLIENT_FSM_TR_RSET_R250,
+    SMTP_CLIENT_FSM_TR_RSET_TIMEOUT
 } te_smtp_client_fsm_trans;
-#define SMTP_CLIENT_FSM_TRANSITION_CT  17
+#define SMTP_CLIENT_FSM_TRANSITION_CT  38
 
 /**
  *  State transition handling map.  Map the state enumeration and the event
@@ -90,78 +111,193 @@ static const t_smtp_client_fsm_transition
 smtp_client_fsm_trans_table[ SMTP_CLIENT_FSM_STATE_CT ][ SMTP_CLIENT_FSM_EVENT_CT ] = {
 
   /* STATE 0:  SMTP_CLIENT_FSM_ST_INIT */
-  { { SMTP_CLIENT_FSM_ST_HELO, SMTP_CLIENT_FSM_TR_INIT_R220 }, /* EVT:  R220 */
+  { { SMTP_CLIENT_FSM_ST_EHLO, SMTP_CLIENT_FSM_TR_INIT_R220 }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INIT_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 1:  SMTP_CLIENT_FSM_ST_HELO */
+  /* STATE 1:  SMTP_CLIENT_FSM_ST_EHLO */
+  { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
+    { SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_TR_EHLO_R250 }, /* EVT:  R250 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_HELO, SMTP_CLIENT_FSM_TR_EHLO_R5XX }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_ENVELOPE, SMTP_CLIENT_FSM_TR_EHLO_PIPELINING }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_TR_EHLO_CHUNKING }, /* EVT:  CHUNKING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_EHLO_TIMEOUT } /* EVT:  TIMEOUT */
+  },
+
+
+  /* STATE 2:  SMTP_CLIENT_FSM_ST_HELO */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_TR_HELO_R250 }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_HELO_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 2:  SMTP_CLIENT_FSM_ST_MAILFROM */
+  /* STATE 3:  SMTP_CLIENT_FSM_ST_ENVELOPE */
+  { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
+    { SMTP_CLIENT_FSM_ST_ENVELOPE, SMTP_CLIENT_FSM_TR_ENVELOPE_R250 }, /* EVT:  R250 */
+    { SMTP_CLIENT_FSM_ST_DATASTR, SMTP_CLIENT_FSM_TR_ENVELOPE_R354 }, /* EVT:  R354 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_ENVELOPE_TIMEOUT } /* EVT:  TIMEOUT */
+  },
+
+
+  /* STATE 4:  SMTP_CLIENT_FSM_ST_MAILFROM */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_RCPTTO, SMTP_CLIENT_FSM_TR_MAILFROM_R250 }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_MAILFROM_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 3:  SMTP_CLIENT_FSM_ST_RCPTTO */
+  /* STATE 5:  SMTP_CLIENT_FSM_ST_RCPTTO */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_RCPTTO, SMTP_CLIENT_FSM_TR_RCPTTO_R250 }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_TR_RCPTTO_CHUNKING }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_DATA, SMTP_CLIENT_FSM_TR_RCPTTO_NO_RCPT }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_RCPTTO_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 4:  SMTP_CLIENT_FSM_ST_DATA */
+  /* STATE 6:  SMTP_CLIENT_FSM_ST_DATA */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_DATASTR, SMTP_CLIENT_FSM_TR_DATA_R354 }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_DATA_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 5:  SMTP_CLIENT_FSM_ST_DATASTR */
+  /* STATE 7:  SMTP_CLIENT_FSM_ST_DATASTR */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_TR_DATASTR_R250 }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_ENVELOPE, SMTP_CLIENT_FSM_TR_DATASTR_PIPELINING }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
-    { SMTP_CLIENT_FSM_ST_QUIT, SMTP_CLIENT_FSM_TR_DATASTR_NO_MAIL }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_IDLE, SMTP_CLIENT_FSM_TR_DATASTR_NO_MAIL }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_DATASTR_TIMEOUT } /* EVT:  TIMEOUT */
   },
 
 
-  /* STATE 6:  SMTP_CLIENT_FSM_ST_QUIT */
+  /* STATE 8:  SMTP_CLIENT_FSM_ST_BDAT */
+  { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
+    { SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_TR_BDAT_R250 }, /* EVT:  R250 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_TR_BDAT_CHUNKING }, /* EVT:  CHUNKING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
+    { SMTP_CLIENT_FSM_ST_IDLE, SMTP_CLIENT_FSM_TR_BDAT_NO_MAIL }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_BDAT_TIMEOUT } /* EVT:  TIMEOUT */
+  },
+
+
+  /* STATE 9:  SMTP_CLIENT_FSM_ST_IDLE */
+  { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R250 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_RSET, SMTP_CLIENT_FSM_TR_IDLE_NEW_MAIL }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_QUIT, SMTP_CLIENT_FSM_TR_IDLE_EXPIRE }, /* EVT:  EXPIRE */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_IDLE_TIMEOUT } /* EVT:  TIMEOUT */
+  },
+
+
+  /* STATE 10:  SMTP_CLIENT_FSM_ST_RSET */
+  { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
+    { SMTP_CLIENT_FSM_ST_MAILFROM, SMTP_CLIENT_FSM_TR_RSET_R250 }, /* EVT:  R250 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_ENVELOPE, SMTP_CLIENT_FSM_TR_RSET_PIPELINING }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_TR_RSET_CHUNKING }, /* EVT:  CHUNKING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_RSET_TIMEOUT } /* EVT:  TIMEOUT */
+  },
+
+
+  /* STATE 11:  SMTP_CLIENT_FSM_ST_QUIT */
   { { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R220 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R250 */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R354 */
     { SMTP_CLIENT_FSM_ST_DONE, SMTP_CLIENT_FSM_TR_QUIT_R221 }, /* EVT:  R221 */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  R5XX */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  PIPELINING */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  CHUNKING */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_RCPT */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NO_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  NEW_MAIL */
+    { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_INVALID }, /* EVT:  EXPIRE */
     { SMTP_CLIENT_FSM_ST_INVALID, SMTP_CLIENT_FSM_TR_QUIT_TIMEOUT } /* EVT:  TIMEOUT */
   }
 };
@@ -172,36 +308,46 @@ smtp_client_fsm_trans_table[ SMTP_CLIENT_FSM_STATE_CT ][ SMTP_CLIENT_FSM_EVENT_C
 #define Smtp_Client_FsmStInit_off     83
 
 
-static char const zSmtp_Client_FsmStrings[171] =
+static char const zSmtp_Client_FsmStrings[240] =
 /*     0 */ "** OUT-OF-RANGE **\0"
 /*    19 */ "FSM Error:  in state %d (%s), event %d (%s) is invalid\n\0"
 /*    75 */ "invalid\0"
 /*    83 */ "init\0"
-/*    88 */ "helo\0"
-/*    93 */ "mailfrom\0"
-/*   102 */ "rcptto\0"
-/*   109 */ "data\0"
-/*   114 */ "datastr\0"
-/*   122 */ "quit\0"
-/*   127 */ "r220\0"
-/*   132 */ "r250\0"
-/*   137 */ "r354\0"
-/*   142 */ "r221\0"
-/*   147 */ "no_rcpt\0"
-/*   155 */ "no_mail\0"
-/*   163 */ "timeout";
-
-static const size_t aszSmtp_Client_FsmStates[7] = {
-    83,  88,  93,  102, 109, 114, 122 };
-
-static const size_t aszSmtp_Client_FsmEvents[8] = {
-    127, 132, 137, 142, 147, 155, 163, 75 };
-
-
-#define SMTP_CLIENT_FSM_EVT_NAME(t)   ( (((unsigned)(t)) >= 8) \
+/*    88 */ "ehlo\0"
+/*    93 */ "helo\0"
+/*    98 */ "envelope\0"
+/*   107 */ "mailfrom\0"
+/*   116 */ "rcptto\0"
+/*   123 */ "data\0"
+/*   128 */ "datastr\0"
+/*   136 */ "bdat\0"
+/*   141 */ "idle\0"
+/*   146 */ "rset\0"
+/*   151 */ "quit\0"
+/*   156 */ "r220\0"
+/*   161 */ "r250\0"
+/*   166 */ "r354\0"
+/*   171 */ "r221\0"
+/*   176 */ "r5xx\0"
+/*   181 */ "pipelining\0"
+/*   192 */ "chunking\0"
+/*   201 */ "no_rcpt\0"
+/*   209 */ "no_mail\0"
+/*   217 */ "new_mail\0"
+/*   226 */ "expire\0"
+/*   233 */ "timeout";
+
+static const size_t aszSmtp_Client_FsmStates[12] = {
+    83,  88,  93,  98,  107, 116, 123, 128, 136, 141, 146, 151 };
+
+static const size_t aszSmtp_Client_FsmEvents[13] = {
+    156, 161, 166, 171, 176, 181, 192, 201, 209, 217, 226, 233, 75 };
+
+
+#define SMTP_CLIENT_FSM_EVT_NAME(t)   ( (((unsigned)(t)) >= 13) \
     ? zSmtp_Client_FsmStrings : zSmtp_Client_FsmStrings + aszSmtp_Client_FsmEvents[t])
 
-#define SMTP_CLIENT_FSM_STATE_NAME(s) ( (((unsigned)(s)) >= 7) \
+#define SMTP_CLIENT_FSM_STATE_NAME(s) ( (((unsigned)(s)) >= 12) \
     ? zSmtp_Client_FsmStrings : zSmtp_Client_FsmStrings + aszSmtp_Client_FsmStates[s])
 
 #ifndef EXIT_FAILURE
@@ -258,34 +404,74 @@ smtp_client_fsm_step(
 
 
     switch (trans) {
+    case SMTP_CLIENT_FSM_TR_BDAT_CHUNKING:
+        /* START == BDAT_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "There is another mail, sending pipelined envelope with BDAT", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == BDAT_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_BDAT_NO_MAIL:
+        /* START == BDAT_NO_MAIL == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "No other mail to send, keeping session idle", ((struct mx_conn*)conn)->dom->name);
+        /* END   == BDAT_NO_MAIL == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_BDAT_R250:
+        /* START == BDAT_R250 == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Got 250 for BDAT", ((struct mx_conn*)conn)->dom->name);
+
+		// Replies come in order of commands, the last one is for BDAT LAST
+        if (--((struct mx_conn*)conn)->replies > 0) {
+			nxtSt = SMTP_CLIENT_FSM_ST_BDAT;
+		} else if (!conn_next_mail((struct mx_conn*)conn)) {
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_EV_NO_MAIL, conn);
+		} else if (((struct mx_conn*)conn)->caps & SMTP_CAP_PIPELINING) {
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_BDAT, SMTP_CLIENT_FSM_EV_CHUNKING, conn);
+		} else {
+			DLOG(BLUE "[%s] " COLOR_RESET "There is another mail, sending MAIL FROM", ((struct mx_conn*)conn)->dom->name);
+			send_mailfrom((struct mx_conn*)conn);
+		}
+        /* END   == BDAT_R250 == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_BDAT_TIMEOUT:
+        /* START == BDAT_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        //~ nxtSt = HANDLE_BDAT_TIMEOUT();
+        /* END   == BDAT_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     case SMTP_CLIENT_FSM_TR_DATASTR_NO_MAIL:
         /* START == DATASTR_NO_MAIL == DO NOT CHANGE THIS COMMENT */
-        DLOG(BLUE "[%s] " COLOR_RESET "No other mail to send, sending QUIT", ((struct mx_conn*)conn)->dom->name);
-        send_quit((struct mx_conn*)conn);
+        DLOG(BLUE "[%s] " COLOR_RESET "No other mail to send, keeping session idle", ((struct mx_conn*)conn)->dom->name);
         /* END   == DATASTR_NO_MAIL == DO NOT CHANGE THIS COMMENT */
         break;
 
 
+    case SMTP_CLIENT_FSM_TR_DATASTR_PIPELINING:
+        /* START == DATASTR_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "There is another mail, sending pipelined envelope", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == DATASTR_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     case SMTP_CLIENT_FSM_TR_DATASTR_R250:
         /* START == DATASTR_R250 == DO NOT CHANGE THIS COMMENT */
         DLOG(BLUE "[%s] " COLOR_RESET "Got 250, checking if there is another mail...", ((struct mx_conn*)conn)->dom->name);
-        struct mx_conn *c = (struct mx_conn*)conn;
-
-		// We managed to send mail to at least one mailbox
-		c->m->was_sent = 1;
-
-		// Skipping mail that has no recipients from this domain
-        do {
-			c->m = TAILQ_NEXT(c->m, entry);
-		} while (c->m && !mail_has_rcpts_from_domain(c->m, c->dom));
 
 		// If there is no mail, then we should finish connection; otherwise, sending next mail
-        if (!c->m) {
+        if (!conn_next_mail((struct mx_conn*)conn)) {
 			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_DATASTR, SMTP_CLIENT_FSM_EV_NO_MAIL, conn);
+		} else if (((struct mx_conn*)conn)->caps & SMTP_CAP_PIPELINING) {
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_DATASTR, SMTP_CLIENT_FSM_EV_PIPELINING, conn);
 		} else {
 			DLOG(BLUE "[%s] " COLOR_RESET "There is another mail, sending MAIL FROM", ((struct mx_conn*)conn)->dom->name);
-			c->r = TAILQ_FIRST(&c->m->rcpts);
-			send_mailfrom(c);
+			send_mailfrom((struct mx_conn*)conn);
 		}
         /* END   == DATASTR_R250 == DO NOT CHANGE THIS COMMENT */
         break;
@@ -314,6 +500,88 @@ smtp_client_fsm_step(
         break;
 
 
+    case SMTP_CLIENT_FSM_TR_EHLO_CHUNKING:
+        /* START == EHLO_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Sending pipelined envelope with BDAT", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == EHLO_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_EHLO_PIPELINING:
+        /* START == EHLO_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Sending pipelined envelope", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == EHLO_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_EHLO_R250:
+        /* START == EHLO_R250 == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Got 250 for EHLO", ((struct mx_conn*)conn)->dom->name);
+
+		// If server can pipeline commands, whole envelope is sent at once,
+		// and with chunking message body is sent along with it
+        if (((struct mx_conn*)conn)->caps & SMTP_CAP_PIPELINING) {
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_EHLO,
+					((struct mx_conn*)conn)->caps & SMTP_CAP_CHUNKING ? SMTP_CLIENT_FSM_EV_CHUNKING : SMTP_CLIENT_FSM_EV_PIPELINING, conn);
+		} else {
+			DLOG(BLUE "[%s] " COLOR_RESET "Sending MAIL FROM", ((struct mx_conn*)conn)->dom->name);
+			send_mailfrom((struct mx_conn*)conn);
+		}
+        /* END   == EHLO_R250 == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_EHLO_R5XX:
+        /* START == EHLO_R5XX == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "EHLO was rejected, sending HELO", ((struct mx_conn*)conn)->dom->name);
+        send_hello((struct mx_conn*)conn);
+        /* END   == EHLO_R5XX == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_EHLO_TIMEOUT:
+        /* START == EHLO_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        //~ nxtSt = HANDLE_EHLO_TIMEOUT();
+        /* END   == EHLO_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_ENVELOPE_R250:
+        /* START == ENVELOPE_R250 == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Got 250 for pipelined command", ((struct mx_conn*)conn)->dom->name);
+
+		// Replies come in order of commands, so there must be one for DATA left
+        if (--((struct mx_conn*)conn)->replies < 1) {
+			ELOG(BLUE "[%s] " RED "Too many replies for pipelined envelope", ((struct mx_conn*)conn)->dom->name);
+			nxtSt = SMTP_CLIENT_FSM_ST_INVALID;
+		}
+        /* END   == ENVELOPE_R250 == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_ENVELOPE_R354:
+        /* START == ENVELOPE_R354 == DO NOT CHANGE THIS COMMENT */
+        if (((struct mx_conn*)conn)->replies != 1) {
+			ELOG(BLUE "[%s] " RED "Got 354 before all envelope replies", ((struct mx_conn*)conn)->dom->name);
+			nxtSt = SMTP_CLIENT_FSM_ST_INVALID;
+		} else {
+			DLOG(BLUE "[%s] " COLOR_RESET "Got 354, starting to send message data", ((struct mx_conn*)conn)->dom->name);
+			((struct mx_conn*)conn)->replies = 0;
+			send_datastr((struct mx_conn*)conn);
+		}
+        /* END   == ENVELOPE_R354 == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_ENVELOPE_TIMEOUT:
+        /* START == ENVELOPE_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        //~ nxtSt = HANDLE_ENVELOPE_TIMEOUT();
+        /* END   == ENVELOPE_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     case SMTP_CLIENT_FSM_TR_HELO_R250:
         /* START == HELO_R250 == DO NOT CHANGE THIS COMMENT */
         DLOG(BLUE "[%s] " COLOR_RESET "Got 250, sending MAIL FROM", ((struct mx_conn*)conn)->dom->name);
@@ -329,10 +597,33 @@ smtp_client_fsm_step(
         break;
 
 
+    case SMTP_CLIENT_FSM_TR_IDLE_EXPIRE:
+        /* START == IDLE_EXPIRE == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Session was idle for too long, sending QUIT", ((struct mx_conn*)conn)->dom->name);
+        send_quit((struct mx_conn*)conn);
+        /* END   == IDLE_EXPIRE == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_IDLE_NEW_MAIL:
+        /* START == IDLE_NEW_MAIL == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "New mail for idle session, sending RSET", ((struct mx_conn*)conn)->dom->name);
+        send_rset((struct mx_conn*)conn);
+        /* END   == IDLE_NEW_MAIL == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_IDLE_TIMEOUT:
+        /* START == IDLE_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        //~ nxtSt = HANDLE_IDLE_TIMEOUT();
+        /* END   == IDLE_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     case SMTP_CLIENT_FSM_TR_INIT_R220:
         /* START == INIT_R220 == DO NOT CHANGE THIS COMMENT */
-        DLOG(BLUE "[%s] " COLOR_RESET "Got initial 220, sending HELO", ((struct mx_conn*)conn)->dom->name);
-        send_hello((struct mx_conn*)conn);
+        DLOG(BLUE "[%s] " COLOR_RESET "Got initial 220, sending EHLO", ((struct mx_conn*)conn)->dom->name);
+        send_ehlo((struct mx_conn*)conn);
         /* END   == INIT_R220 == DO NOT CHANGE THIS COMMENT */
         break;
 
@@ -382,6 +673,14 @@ smtp_client_fsm_step(
         break;
 
 
+    case SMTP_CLIENT_FSM_TR_RCPTTO_CHUNKING:
+        /* START == RCPTTO_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "No other recipients, sending BDAT", ((struct mx_conn*)conn)->dom->name);
+        ((struct mx_conn*)conn)->replies = send_bdat((struct mx_conn*)conn);
+        /* END   == RCPTTO_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     case SMTP_CLIENT_FSM_TR_RCPTTO_NO_RCPT:
         /* START == RCPTTO_NO_RCPT == DO NOT CHANGE THIS COMMENT */
         DLOG(BLUE "[%s] " COLOR_RESET "No other recipients, sending DATA", ((struct mx_conn*)conn)->dom->name);
@@ -394,7 +693,8 @@ smtp_client_fsm_step(
         /* START == RCPTTO_R250 == DO NOT CHANGE THIS COMMENT */
         DLOG(BLUE "[%s] " COLOR_RESET "Got 250", ((struct mx_conn*)conn)->dom->name);
         if (!send_rcptto((struct mx_conn*)conn))
-			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_RCPTTO, SMTP_CLIENT_FSM_EV_NO_RCPT, conn);
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_RCPTTO,
+					((struct mx_conn*)conn)->caps & SMTP_CAP_CHUNKING ? SMTP_CLIENT_FSM_EV_CHUNKING : SMTP_CLIENT_FSM_EV_NO_RCPT, conn);
         /* END   == RCPTTO_R250 == DO NOT CHANGE THIS COMMENT */
         break;
 
@@ -405,6 +705,45 @@ smtp_client_fsm_step(
         break;
 
 
+    case SMTP_CLIENT_FSM_TR_RSET_CHUNKING:
+        /* START == RSET_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Sending pipelined envelope with BDAT", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == RSET_CHUNKING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_RSET_PIPELINING:
+        /* START == RSET_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Sending pipelined envelope", ((struct mx_conn*)conn)->dom->name);
+        send_envelope((struct mx_conn*)conn);
+        /* END   == RSET_PIPELINING == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_RSET_R250:
+        /* START == RSET_R250 == DO NOT CHANGE THIS COMMENT */
+        DLOG(BLUE "[%s] " COLOR_RESET "Got 250 for RSET", ((struct mx_conn*)conn)->dom->name);
+        ((struct mx_conn*)conn)->reused = 0;
+
+        if (((struct mx_conn*)conn)->caps & SMTP_CAP_PIPELINING) {
+			nxtSt = smtp_client_fsm_step(SMTP_CLIENT_FSM_ST_RSET,
+					((struct mx_conn*)conn)->caps & SMTP_CAP_CHUNKING ? SMTP_CLIENT_FSM_EV_CHUNKING : SMTP_CLIENT_FSM_EV_PIPELINING, conn);
+		} else {
+			DLOG(BLUE "[%s] " COLOR_RESET "Sending MAIL FROM", ((struct mx_conn*)conn)->dom->name);
+			send_mailfrom((struct mx_conn*)conn);
+		}
+        /* END   == RSET_R250 == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
+    case SMTP_CLIENT_FSM_TR_RSET_TIMEOUT:
+        /* START == RSET_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        //~ nxtSt = HANDLE_RSET_TIMEOUT();
+        /* END   == RSET_TIMEOUT == DO NOT CHANGE THIS COMMENT */
+        break;
+
+
     default:
         /* START == BROKEN MACHINE == DO NOT CHANGE THIS COMMENT */
         //~ smtp_client_fsm_invalid_transition(smtp_client_fsm_state, trans_evt);
@@ -0,0 +1,336 @@
+/**
+ * \file dns-cache.c
+ * \brief Кэш ответов DNS с учетом TTL и его сохранение в файл
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include <queue.h>
+#include <dns-cache.h>
+#include <log.h>
+
+struct cache_entry {
+	char name[DNS_NAME_SIZE];	// lower case, without trailing dot
+	time_t expires;
+	struct dns_result res;
+	TAILQ_ENTRY(cache_entry) entry;
+};
+TAILQ_HEAD(cache_bucket, cache_entry);
+
+// Every delivery thread caches names of its own domains
+static __thread struct cache_bucket buckets[DNS_CACHE_BUCKETS];
+static __thread struct dns_cache_stats stats;
+static __thread const char *cache_file;
+
+// File of cache is shared by all threads
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_entries(const char *file);
+
+
+// Makes cache key of domain name: lower case without trailing dot
+static void cache_key(const char *name, char *key) {
+	int i = 0;
+
+	for (; name[i] && i < DNS_NAME_SIZE - 1; ++i) {
+		key[i] = tolower((unsigned char)name[i]);
+	}
+
+	if (i && key[i - 1] == '.') i--;
+	key[i] = '\0';
+}
+
+
+static unsigned int cache_hash(const char *key, int type) {
+	unsigned int hash = 5381 + type;
+
+	for (; *key; ++key) {
+		hash = hash * 33 + (unsigned char)*key;
+	}
+
+	return hash % DNS_CACHE_BUCKETS;
+}
+
+
+static void remove_entry(struct cache_bucket *bucket, struct cache_entry *e) {
+	TAILQ_REMOVE(bucket, e, entry);
+	free(e);
+	stats.entries--;
+}
+
+
+// Finds entry of name and type; expired entries of bucket are removed
+static struct cache_entry* find_entry(const char *key, int type, time_t now) {
+	struct cache_bucket *bucket = &buckets[cache_hash(key, type)];
+	struct cache_entry *e, *tmp;
+
+	TAILQ_FOREACH_SAFE(e, bucket, entry, tmp) {
+		if (e->expires <= now) {
+			remove_entry(bucket, e);
+		} else if (e->res.type == type && !strcmp(e->name, key)) {
+			return e;
+		}
+	}
+
+	return 0;
+}
+
+
+// Removes all expired entries
+static void purge_expired(time_t now) {
+	struct cache_entry *e, *tmp;
+
+	for (int i = 0; i < DNS_CACHE_BUCKETS; ++i) {
+		TAILQ_FOREACH_SAFE(e, &buckets[i], entry, tmp) {
+			if (e->expires <= now) remove_entry(&buckets[i], e);
+		}
+	}
+}
+
+
+// Initializes cache and loads it from file, if it is specified
+int dns_cache_init(const char *file) {
+	for (int i = 0; i < DNS_CACHE_BUCKETS; ++i) {
+		TAILQ_INIT(&buckets[i]);
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	cache_file = file && *file ? file : 0;
+
+	if (cache_file) dns_cache_load(cache_file);
+
+	return 1;
+}
+
+
+// Saves cache to file, if it is specified, and frees all entries. Entries,
+// which other threads have saved already, are merged with own ones
+void dns_cache_final() {
+	struct cache_entry *e;
+
+	if (cache_file) {
+		pthread_mutex_lock(&file_lock);
+		load_entries(cache_file);
+		dns_cache_save(cache_file);
+		pthread_mutex_unlock(&file_lock);
+	}
+
+	for (int i = 0; i < DNS_CACHE_BUCKETS; ++i) {
+		while ((e = TAILQ_FIRST(&buckets[i]))) {
+			remove_entry(&buckets[i], e);
+		}
+	}
+
+	cache_file = 0;
+}
+
+
+// Fills result from cache; its TTL is what is left of cached TTL. Returns
+// 1 if name was found
+int dns_cache_lookup(const char *name, int type, struct dns_result *res) {
+	char key[DNS_NAME_SIZE];
+	time_t now = time(0);
+
+	cache_key(name, key);
+	struct cache_entry *e = find_entry(key, type, now);
+
+	if (!e) {
+		stats.misses++;
+		return 0;
+	}
+
+	*res = e->res;
+	res->ttl = e->expires - now;
+
+	stats.hits++;
+	if (res->status != DNS_OK) stats.negative_hits++;
+
+	return 1;
+}
+
+
+// Stores result of query, if it may be cached
+void dns_cache_store(const char *name, int type, const struct dns_result *res) {
+	char key[DNS_NAME_SIZE];
+	time_t now = time(0);
+	unsigned int ttl = res->ttl;
+
+	if (res->status == DNS_NXDOMAIN || res->status == DNS_NODATA) {
+		if (!ttl) ttl = DNS_CACHE_NEGATIVE_TTL;
+	} else if (res->status != DNS_OK) {
+		return;
+	}
+
+	if (!ttl) return;
+	if (ttl > DNS_CACHE_MAX_TTL) ttl = DNS_CACHE_MAX_TTL;
+
+	cache_key(name, key);
+	struct cache_entry *e = find_entry(key, type, now);
+
+	if (!e) {
+		if (stats.entries >= DNS_CACHE_MAX_ENTRIES) purge_expired(now);
+		if (stats.entries >= DNS_CACHE_MAX_ENTRIES) return;
+
+		e = calloc(1, sizeof(*e));
+		strcpy(e->name, key);
+		TAILQ_INSERT_HEAD(&buckets[cache_hash(key, type)], e, entry);
+		stats.entries++;
+	}
+
+	e->res = *res;
+	e->res.type = type;
+	e->expires = now + ttl;
+}
+
+
+// Returns counters of cache
+struct dns_cache_stats dns_cache_get_stats() {
+	return stats;
+}
+
+
+/*
+ * File of cache has one entry per line:
+ *
+ *     <expires> <type> <status> <name> <count> <records>...
+ *
+ * where records are "<pref> <host>" pairs for MX, and addresses for A and
+ * AAAA. Expiration time is absolute, so entries, which expired while
+ * client was stopped, are skipped on loading.
+ */
+
+// Writes all live entries to file; returns 1 on success
+int dns_cache_save(const char *file) {
+	char tmp_file[1024], addr[INET6_ADDRSTRLEN];
+	struct cache_entry *e;
+	time_t now = time(0);
+
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", file);
+	FILE *f = fopen(tmp_file, "w");
+
+	if (!f) {
+		ELOG("Can't save DNS cache to '%s'.", file);
+		return 0;
+	}
+
+	for (int i = 0; i < DNS_CACHE_BUCKETS; ++i) {
+		TAILQ_FOREACH(e, &buckets[i], entry) {
+			if (e->expires <= now) continue;
+
+			fprintf(f, "%ld %d %d %s %d", (long)e->expires, e->res.type, e->res.status, e->name, e->res.count);
+
+			for (int j = 0; j < e->res.count; ++j) {
+				if (e->res.type == DNS_T_MX) {
+					fprintf(f, " %d %s", e->res.mx[j].pref, e->res.mx[j].host);
+				} else {
+					inet_ntop(e->res.addr[j].family, &e->res.addr[j].v6, addr, sizeof(addr));
+					fprintf(f, " %s", addr);
+				}
+			}
+
+			fprintf(f, "\n");
+		}
+	}
+
+	// Cache file is replaced at once, so it is never left half written
+	if (fclose(f) != 0 || rename(tmp_file, file) != 0) {
+		ELOG("Can't save DNS cache to '%s'.", file);
+		remove(tmp_file);
+		return 0;
+	}
+
+	DLOG("DNS cache with %d entries was saved to '%s'.", stats.entries, file);
+	return 1;
+}
+
+
+// Parses one line of cache file into entry; returns 1 on success
+static int parse_entry(char *line, struct cache_entry *e) {
+	char *save, *token;
+	long expires;
+	int status;
+
+	memset(e, 0, sizeof(*e));
+
+	if (!(token = strtok_r(line, " \n", &save)) || sscanf(token, "%ld", &expires) != 1) return 0;
+	if (!(token = strtok_r(0, " \n", &save)) || sscanf(token, "%d", &e->res.type) != 1) return 0;
+	if (!(token = strtok_r(0, " \n", &save)) || sscanf(token, "%d", &status) != 1) return 0;
+	if (!(token = strtok_r(0, " \n", &save)) || strlen(token) >= DNS_NAME_SIZE) return 0;
+	strcpy(e->name, token);
+	if (!(token = strtok_r(0, " \n", &save)) || sscanf(token, "%d", &e->res.count) != 1) return 0;
+
+	if (status < DNS_OK || status > DNS_NODATA || e->res.count < 0 || e->res.count > DNS_MAX_RECORDS) return 0;
+	if (e->res.type != DNS_T_MX && e->res.type != DNS_T_A && e->res.type != DNS_T_AAAA) return 0;
+
+	e->expires = expires;
+	e->res.status = status;
+
+	for (int i = 0; i < e->res.count; ++i) {
+		if (e->res.type == DNS_T_MX) {
+			if (!(token = strtok_r(0, " \n", &save)) || sscanf(token, "%d", &e->res.mx[i].pref) != 1) return 0;
+			if (!(token = strtok_r(0, " \n", &save)) || strlen(token) >= DNS_NAME_SIZE) return 0;
+			strcpy(e->res.mx[i].host, token);
+		} else {
+			struct dns_addr *addr = &e->res.addr[i];
+			addr->family = e->res.type == DNS_T_A ? AF_INET : AF_INET6;
+			if (!(token = strtok_r(0, " \n", &save)) || inet_pton(addr->family, token, &addr->v6) != 1) return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+// Stores live entries of file in cache; returns their count, or -1 if file
+// can't be read
+static int load_entries(const char *file) {
+	char line[DNS_MAX_RECORDS * (DNS_NAME_SIZE + 8) + 2 * DNS_NAME_SIZE];
+	struct cache_entry e;
+	time_t now = time(0);
+	int count = 0;
+
+	FILE *f = fopen(file, "r");
+	if (!f) return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!parse_entry(line, &e)) {
+			ELOG("Broken entry in DNS cache '%s', skipping it.", file);
+			continue;
+		}
+
+		if (e.expires <= now) continue;
+
+		// Own entry, which lives longer, is kept
+		struct cache_entry *own = find_entry(e.name, e.res.type, now);
+		if (own && own->expires >= e.expires) continue;
+
+		// Stored with TTL, which is left of it
+		e.res.ttl = e.expires - now;
+		dns_cache_store(e.name, e.res.type, &e.res);
+		count++;
+	}
+
+	fclose(f);
+
+	return count;
+}
+
+
+// Loads live entries from file; returns count of loaded entries, or -1 if
+// file can't be read
+int dns_cache_load(const char *file) {
+	int count = load_entries(file);
+
+	if (count < 0) {
+		DLOG("There is no DNS cache in '%s' yet.", file);
+		return -1;
+	}
+
+	LOG("Loaded %d entries of DNS cache from '%s'.", count, file);
+	return count;
+}
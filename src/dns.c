@@ -0,0 +1,564 @@
+/**
+ * \file dns.c
+ * \brief Асинхронный DNS-клиент: запросы по UDP/TCP и разбор ответов
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <queue.h>
+#include <dns.h>
+#include <dns-cache.h>
+#include <event.h>
+#include <utils.h>
+#include <log.h>
+
+#define DNS_HEADER_SIZE		12
+#define DNS_MAX_POINTERS	32		// protection from compression loops
+
+struct dns_query {
+	unsigned short id;
+	char name[DNS_NAME_SIZE];
+	int type;
+	dns_callback cb;
+	void *arg;
+	int tries;
+	long deadline;
+	unsigned char packet[DNS_PACKET_SIZE];
+	int length;
+
+	// TCP fallback for truncated replies: 2 bytes of length and message
+	int tcp_sock;
+	int tcp_sent;
+	unsigned char *tcp_buf;
+	int tcp_length, tcp_offset;
+
+	TAILQ_ENTRY(dns_query) entry;
+};
+TAILQ_HEAD(dns_query_list, dns_query);
+
+// Every delivery thread resolves its own domains with its own socket
+static __thread int udp_sock = -1;
+static __thread struct sockaddr_storage server;
+static __thread socklen_t server_len;
+
+static __thread struct dns_query_list queries;
+static __thread int pending;
+
+// All DNS descriptors are registered in event loop with this data
+static char event_tag;
+
+
+// Reads address of first nameserver from /etc/resolv.conf; returns 1 on
+// success
+static int read_resolv_conf(char *addr) {
+	FILE *f = fopen("/etc/resolv.conf", "r");
+	char line[300];
+	int found = 0;
+
+	if (!f) return 0;
+
+	while (!found && fgets(line, sizeof(line), f)) {
+		found = sscanf(line, " nameserver %63s", addr) == 1;
+	}
+
+	fclose(f);
+	return found;
+}
+
+
+// Creates UDP socket for queries to DNS server; if server is not
+// specified, first nameserver from /etc/resolv.conf is used. Event loop
+// must be initialized before. Returns 1 on success
+int dns_init(const char *server_addr, int port) {
+	char addr[64] = "127.0.0.1";
+
+	TAILQ_INIT(&queries);
+
+	if (server_addr && *server_addr) {
+		snprintf(addr, sizeof(addr), "%s", server_addr);
+	} else if (!read_resolv_conf(addr)) {
+		ELOG("Can't read nameserver from /etc/resolv.conf, using '%s'.", addr);
+	}
+
+	memset(&server, 0, sizeof(server));
+	struct sockaddr_in *sa4 = (struct sockaddr_in *)&server;
+	struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&server;
+
+	if (inet_pton(AF_INET, addr, &sa4->sin_addr) == 1) {
+		sa4->sin_family = AF_INET;
+		sa4->sin_port = htons(port ? port : DNS_PORT);
+		server_len = sizeof(*sa4);
+	} else if (inet_pton(AF_INET6, addr, &sa6->sin6_addr) == 1) {
+		sa6->sin6_family = AF_INET6;
+		sa6->sin6_port = htons(port ? port : DNS_PORT);
+		server_len = sizeof(*sa6);
+	} else {
+		ELOG("Invalid address of DNS server: '%s'.", addr);
+		return 0;
+	}
+
+	// Connected socket receives replies only from the server
+	udp_sock = socket(server.ss_family, SOCK_DGRAM, 0);
+	if (udp_sock < 0 || connect(udp_sock, (struct sockaddr *)&server, server_len) < 0) {
+		ELOG("Can't create socket for DNS server '%s'.", addr);
+		if (udp_sock >= 0) close(udp_sock);
+		udp_sock = -1;
+		return 0;
+	}
+
+	fcntl(udp_sock, F_SETFL, O_NONBLOCK);
+	event_add(udp_sock, EVENT_READ, &event_tag);
+
+	srand(time(0) ^ getpid());
+	pending = 0;
+
+	DLOG("Using DNS server '%s'.", addr);
+	return 1;
+}
+
+
+// Frees query and its TCP connection
+static void free_query(struct dns_query *q) {
+	if (q->tcp_sock >= 0) {
+		event_del(q->tcp_sock);
+		close(q->tcp_sock);
+	}
+
+	free(q->tcp_buf);
+	free(q);
+}
+
+
+// Cancels all queries without calling their callbacks and closes socket
+void dns_final() {
+	struct dns_query *q;
+	while ((q = TAILQ_FIRST(&queries))) {
+		TAILQ_REMOVE(&queries, q, entry);
+		free_query(q);
+	}
+
+	pending = 0;
+
+	if (udp_sock >= 0) {
+		event_del(udp_sock);
+		close(udp_sock);
+		udp_sock = -1;
+	}
+}
+
+
+// Returns data, with which DNS descriptors are registered in event loop
+void* dns_event_data() {
+	return &event_tag;
+}
+
+
+// Returns count of queries without result yet
+int dns_pending() {
+	return pending;
+}
+
+
+// Returns milliseconds till closest timeout of queries, or -1 if there
+// are no queries
+int dns_next_timeout() {
+	struct dns_query *q;
+	long now = time_ms(), next = -1;
+
+	TAILQ_FOREACH(q, &queries, entry) {
+		long left = q->deadline > now ? q->deadline - now : 0;
+		if (next < 0 || left < next) next = left;
+	}
+
+	return next;
+}
+
+
+// Removes query and passes result to its callback
+static void finish_query(struct dns_query *q, struct dns_result *res) {
+	TAILQ_REMOVE(&queries, q, entry);
+	pending--;
+
+	dns_cache_store(q->name, q->type, res);
+	q->cb(q->arg, q->name, res);
+
+	free_query(q);
+}
+
+
+// Finishes query with result without records
+static void fail_query(struct dns_query *q, dns_status status) {
+	struct dns_result res;
+	memset(&res, 0, sizeof(res));
+	res.status = status;
+	res.type = q->type;
+
+	finish_query(q, &res);
+}
+
+
+// Sends query to server (again); returns 1 on success
+static int send_query(struct dns_query *q) {
+	q->tries++;
+	q->deadline = time_ms() + DNS_RETRY_TIME;
+
+	if (send(udp_sock, q->packet, q->length, 0) != q->length) {
+		ELOG("Can't send DNS query for '%s'.", q->name);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// Starts resolving records of specified type for name; result is passed to
+// callback, possibly in the same call (e.g. if it is cached). Returns 1 if
+// query was sent or answered from cache
+int dns_resolve(const char *name, int type, dns_callback cb, void *arg) {
+	struct dns_result res;
+
+	if (dns_cache_lookup(name, type, &res)) {
+		cb(arg, name, &res);
+		return 1;
+	}
+
+	struct dns_query *q = calloc(1, sizeof(*q));
+	struct dns_query *other;
+
+	// ID must be unique among queries in flight
+	do {
+		q->id = rand() & 0xffff;
+		TAILQ_FOREACH(other, &queries, entry) {
+			if (other->id == q->id) break;
+		}
+	} while (other);
+
+	snprintf(q->name, sizeof(q->name), "%s", name);
+	q->type = type;
+	q->cb = cb;
+	q->arg = arg;
+	q->tcp_sock = -1;
+	q->length = dns_build_query(q->packet, q->id, name, type);
+
+	TAILQ_INSERT_TAIL(&queries, q, entry);
+	pending++;
+
+	if (!q->length || udp_sock < 0 || !send_query(q)) {
+		fail_query(q, DNS_ERROR);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// Builds query with recursion desired flag; returns its length, or 0 if
+// name is not valid
+int dns_build_query(unsigned char *buf, unsigned short id, const char *name, int type) {
+	unsigned char *p = buf + DNS_HEADER_SIZE;
+
+	memset(buf, 0, DNS_HEADER_SIZE);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		// RD
+	buf[5] = 1;			// QDCOUNT
+
+	while (*name) {
+		const char *dot = strchr(name, '.');
+		int length = dot ? dot - name : (int)strlen(name);
+
+		if (length == 0 || length > 63 || p - buf + length + 6 > DNS_PACKET_SIZE) return 0;
+
+		*p++ = length;
+		memcpy(p, name, length);
+		p += length;
+		name += length + (dot ? 1 : 0);
+	}
+
+	*p++ = 0;
+	*p++ = type >> 8;
+	*p++ = type & 0xff;
+	*p++ = 0;
+	*p++ = 1;			// class IN
+
+	return p - buf;
+}
+
+
+// Reads (possibly compressed) domain name at offset into 'name' without
+// trailing dot; returns offset right after name, or -1 if it is malformed
+static int read_name(const unsigned char *buf, int length, int offset, char *name) {
+	int end = -1, pointers = 0, out = 0;
+
+	while (1) {
+		if (offset >= length) return -1;
+
+		int label = buf[offset];
+
+		if ((label & 0xc0) == 0xc0) {
+			if (offset + 1 >= length || ++pointers > DNS_MAX_POINTERS) return -1;
+			if (end < 0) end = offset + 2;
+			offset = ((label & 0x3f) << 8) | buf[offset + 1];
+			continue;
+		}
+
+		if (label & 0xc0) return -1;
+
+		if (label == 0) {
+			if (end < 0) end = offset + 1;
+			break;
+		}
+
+		if (offset + 1 + label > length || out + label + 1 >= DNS_NAME_SIZE) return -1;
+
+		if (out) name[out++] = '.';
+		memcpy(name + out, buf + offset + 1, label);
+		out += label;
+		offset += 1 + label;
+	}
+
+	name[out] = '\0';
+	return end;
+}
+
+
+static unsigned int get16(const unsigned char *p) {
+	return (p[0] << 8) | p[1];
+}
+
+
+static unsigned int get32(const unsigned char *p) {
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+// Parses reply and fills result with records of specified type from answer
+// section; for negative replies TTL is taken from SOA in authority section.
+// Returns 1 on success, or 0 if reply is malformed
+int dns_parse_reply(const unsigned char *buf, int length, int type, struct dns_result *res) {
+	char name[DNS_NAME_SIZE];
+
+	memset(res, 0, sizeof(*res));
+	res->type = type;
+	res->status = DNS_ERROR;
+
+	if (length < DNS_HEADER_SIZE || !(buf[2] & 0x80)) return 0;
+
+	int rcode = buf[3] & 0x0f;
+	int qdcount = get16(buf + 4), ancount = get16(buf + 6), nscount = get16(buf + 8);
+	int offset = DNS_HEADER_SIZE;
+
+	for (int i = 0; i < qdcount; ++i) {
+		if ((offset = read_name(buf, length, offset, name)) < 0 || offset + 4 > length) return 0;
+		offset += 4;
+	}
+
+	unsigned int ttl = 0xffffffff;
+
+	for (int i = 0; i < ancount + nscount; ++i) {
+		if ((offset = read_name(buf, length, offset, name)) < 0 || offset + 10 > length) return 0;
+
+		int rtype = get16(buf + offset);
+		unsigned int rttl = get32(buf + offset + 4);
+		int rdlength = get16(buf + offset + 8);
+		const unsigned char *rdata = buf + offset + 10;
+
+		offset += 10 + rdlength;
+		if (offset > length) return 0;
+
+		if (i >= ancount) {
+			// Negative caching TTL: minimum of SOA TTL and its MINIMUM field
+			if (rtype == 6 && ancount == 0) {
+				int p = rdata - buf;
+				if ((p = read_name(buf, length, p, name)) < 0) return 0;
+				if ((p = read_name(buf, length, p, name)) < 0 || p + 20 > length) return 0;
+				unsigned int minimum = get32(buf + p + 16);
+				ttl = rttl < minimum ? rttl : minimum;
+			}
+			continue;
+		}
+
+		if (rtype != type || res->count >= DNS_MAX_RECORDS) continue;
+
+		if (type == DNS_T_MX) {
+			struct dns_mx *mx = &res->mx[res->count];
+			if (rdlength < 3) return 0;
+			mx->pref = get16(rdata);
+			if (read_name(buf, length, rdata - buf + 2, mx->host) < 0) return 0;
+		} else if (type == DNS_T_A && rdlength == 4) {
+			res->addr[res->count].family = AF_INET;
+			memcpy(&res->addr[res->count].v4, rdata, 4);
+		} else if (type == DNS_T_AAAA && rdlength == 16) {
+			res->addr[res->count].family = AF_INET6;
+			memcpy(&res->addr[res->count].v6, rdata, 16);
+		} else {
+			return 0;
+		}
+
+		if (rttl < ttl) ttl = rttl;
+		res->count++;
+	}
+
+	res->ttl = ttl == 0xffffffff ? 0 : ttl;
+
+	if (rcode == 3) {
+		res->status = DNS_NXDOMAIN;
+	} else if (rcode != 0) {
+		res->status = DNS_ERROR;
+	} else {
+		res->status = res->count ? DNS_OK : DNS_NODATA;
+	}
+
+	return 1;
+}
+
+
+// Returns 1 if reply is for this query: same ID, name and type
+static int reply_matches(const unsigned char *buf, int length, struct dns_query *q) {
+	char name[DNS_NAME_SIZE];
+
+	if (length < DNS_HEADER_SIZE || get16(buf) != q->id || get16(buf + 4) != 1) return 0;
+
+	int offset = read_name(buf, length, DNS_HEADER_SIZE, name);
+	if (offset < 0 || offset + 4 > length) return 0;
+
+	const char *qname = q->name;
+	int qlength = strlen(qname);
+	if (qlength && qname[qlength - 1] == '.') qlength--;
+
+	return (int)strlen(name) == qlength && !strncasecmp(name, qname, qlength) &&
+			(int)get16(buf + offset) == q->type;
+}
+
+
+// Repeats truncated query over TCP
+static void start_tcp(struct dns_query *q) {
+	q->tcp_sock = socket(server.ss_family, SOCK_STREAM, 0);
+
+	if (q->tcp_sock < 0) {
+		fail_query(q, DNS_ERROR);
+		return;
+	}
+
+	fcntl(q->tcp_sock, F_SETFL, O_NONBLOCK);
+
+	if (connect(q->tcp_sock, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS) {
+		fail_query(q, DNS_ERROR);
+		return;
+	}
+
+	q->tcp_buf = malloc(2 + 65535);
+	q->tcp_buf[0] = q->length >> 8;
+	q->tcp_buf[1] = q->length & 0xff;
+	memcpy(q->tcp_buf + 2, q->packet, q->length);
+	q->tcp_length = 2 + q->length;
+	q->tcp_offset = 0;
+	q->deadline = time_ms() + DNS_RETRY_TIME * DNS_TRIES;
+
+	event_add(q->tcp_sock, EVENT_READ | EVENT_WRITE, &event_tag);
+}
+
+
+// Sends query or reads reply over TCP, as far as socket allows
+static void tcp_progress(struct dns_query *q) {
+	if (!q->tcp_sent) {
+		int sent = send(q->tcp_sock, q->tcp_buf + q->tcp_offset, q->tcp_length - q->tcp_offset, MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN) fail_query(q, DNS_ERROR);
+			return;
+		}
+
+		if ((q->tcp_offset += sent) < q->tcp_length) return;
+
+		q->tcp_sent = 1;
+		q->tcp_offset = 0;
+		event_mod(q->tcp_sock, EVENT_READ, &event_tag);
+	}
+
+	int got = recv(q->tcp_sock, q->tcp_buf + q->tcp_offset, 2 + 65535 - q->tcp_offset, 0);
+
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+	if (got <= 0) {
+		fail_query(q, DNS_ERROR);
+		return;
+	}
+
+	q->tcp_offset += got;
+
+	if (q->tcp_offset < 2 || q->tcp_offset < 2 + (int)get16(q->tcp_buf)) return;
+
+	struct dns_result res;
+	int length = get16(q->tcp_buf);
+
+	if (!reply_matches(q->tcp_buf + 2, length, q) || !dns_parse_reply(q->tcp_buf + 2, length, q->type, &res)) {
+		fail_query(q, DNS_ERROR);
+		return;
+	}
+
+	finish_query(q, &res);
+}
+
+
+// Handles everything received by DNS client: reads all UDP replies and
+// advances queries repeated over TCP
+void dns_process() {
+	unsigned char buf[DNS_PACKET_SIZE];
+	struct dns_query *q, *tmp;
+	int length;
+
+	while ((length = recv(udp_sock, buf, sizeof(buf), 0)) > 0) {
+		TAILQ_FOREACH(q, &queries, entry) {
+			if (q->tcp_sock < 0 && reply_matches(buf, length, q)) break;
+		}
+
+		if (!q) {
+			DLOG("Unexpected DNS reply, ignoring it.");
+			continue;
+		}
+
+		struct dns_result res;
+
+		if (buf[2] & 0x02) {
+			DLOG("DNS reply for '%s' was truncated, repeating query over TCP.", q->name);
+			start_tcp(q);
+		} else if (!dns_parse_reply(buf, length, q->type, &res)) {
+			ELOG("Malformed DNS reply for '%s'.", q->name);
+			fail_query(q, DNS_ERROR);
+		} else {
+			finish_query(q, &res);
+		}
+	}
+
+	TAILQ_FOREACH_SAFE(q, &queries, entry, tmp) {
+		if (q->tcp_sock >= 0) tcp_progress(q);
+	}
+}
+
+
+// Sends again queries without reply, and fails ones which were tried
+// DNS_TRIES times
+void dns_check_timeouts() {
+	struct dns_query *q, *tmp;
+	long now = time_ms();
+
+	TAILQ_FOREACH_SAFE(q, &queries, entry, tmp) {
+		if (q->deadline > now) continue;
+
+		if (q->tcp_sock >= 0 || q->tries >= DNS_TRIES) {
+			ELOG("DNS query for '%s' timed out.", q->name);
+			fail_query(q, DNS_TIMEOUT);
+		} else if (!send_query(q)) {
+			fail_query(q, DNS_ERROR);
+		}
+	}
+}
@@ -0,0 +1,186 @@
+/**
+ * \file domain-id.c
+ * \brief Номера доменов получателей
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <domain-id.h>
+#include <arena.h>
+
+/**
+ * \brief Ячейка хэш-таблицы имен; 0 в id - пустая ячейка
+ */
+struct id_slot {
+	unsigned hash;
+	int id;
+};
+
+// Table is changed under lock only
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct id_slot *table;
+static unsigned table_size;		// power of 2
+static struct arena names;
+
+// Names by their numbers; pages are never moved, so names are read
+// without lock
+static const char **pages[DOMAIN_ID_PAGES];
+static int count;
+
+// Domains met recently by this thread
+static __thread struct id_slot cache[DOMAIN_ID_CACHE];
+
+
+static unsigned hash_name(const char *name, int length) {
+	unsigned hash = 2166136261u;
+
+	for (int i = 0; i < length; ++i) {
+		unsigned char c = name[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		hash ^= c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+// Returns 1 if name is the same as stored one in lower case
+static int same_name(const char *name, int length, const char *stored) {
+	if (!stored) return 0;
+
+	for (int i = 0; i < length; ++i) {
+		unsigned char c = name[i];
+		if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+		if (c != (unsigned char)stored[i]) return 0;
+	}
+
+	return stored[length] == '\0';
+}
+
+
+// Puts number into table, which has free slots
+static void table_put(unsigned hash, int id) {
+	unsigned i = hash & (table_size - 1);
+
+	while (table[i].id) i = (i + 1) & (table_size - 1);
+
+	table[i].hash = hash;
+	table[i].id = id;
+}
+
+
+// Doubles hash table, so that it is at most half full
+static int table_grow() {
+	struct id_slot *old = table;
+	unsigned old_size = table_size;
+	unsigned size = old_size ? old_size * 2 : DOMAIN_ID_PAGE;
+
+	if (!(table = calloc(size, sizeof(*table)))) {
+		table = old;
+		return 0;
+	}
+
+	table_size = size;
+
+	for (unsigned i = 0; i < old_size; ++i) {
+		if (old[i].id) table_put(old[i].hash, old[i].id);
+	}
+
+	free(old);
+	return 1;
+}
+
+
+// Adds name in lower case to table; returns its number, or -1 if table is
+// full or memory is exhausted. Called under lock
+static int add_name(const char *name, int length, unsigned hash) {
+	int page = count / DOMAIN_ID_PAGE;
+
+	if (page == DOMAIN_ID_PAGES) return -1;
+	if ((count + 1) * 2 > table_size && !table_grow()) return -1;
+	if (!pages[page] && !(pages[page] = calloc(DOMAIN_ID_PAGE, sizeof(**pages)))) return -1;
+
+	char *copy = arena_strndup(&names, name, length);
+	if (!copy) return -1;
+
+	for (int i = 0; i < length; ++i) {
+		if (copy[i] >= 'A' && copy[i] <= 'Z') copy[i] += 'a' - 'A';
+	}
+
+	pages[page][count % DOMAIN_ID_PAGE] = copy;
+	__atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+
+	table_put(hash, count);
+	return count;
+}
+
+
+// Returns number of domain, case of letters is ignored; new name is added.
+// Returns 0 if name is empty or too long, and -1 if name can't be added,
+// as table is full
+int domain_id(const char *name, int length) {
+	if (length <= 0 || length >= DOMAIN_NAME_SIZE) return 0;
+
+	unsigned hash = hash_name(name, length);
+	struct id_slot *c = &cache[hash & (DOMAIN_ID_CACHE - 1)];
+
+	if (c->id && c->hash == hash && same_name(name, length, domain_id_name(c->id))) return c->id;
+
+	pthread_mutex_lock(&lock);
+
+	int id = 0;
+
+	for (unsigned i = hash & (table_size - 1); table_size && table[i].id; i = (i + 1) & (table_size - 1)) {
+		if (table[i].hash == hash && same_name(name, length, domain_id_name(table[i].id))) {
+			id = table[i].id;
+			break;
+		}
+	}
+
+	if (!id) id = add_name(name, length, hash);
+
+	pthread_mutex_unlock(&lock);
+
+	if (id > 0) {
+		c->hash = hash;
+		c->id = id;
+	}
+
+	return id;
+}
+
+
+// Returns name of domain in lower case, or 0 if there is no such number
+const char* domain_id_name(int id) {
+	if (id <= 0 || id > __atomic_load_n(&count, __ATOMIC_ACQUIRE)) return 0;
+
+	id--;
+	return pages[id / DOMAIN_ID_PAGE][id % DOMAIN_ID_PAGE];
+}
+
+
+// Returns count of known domains
+int domain_id_count() {
+	return __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+}
+
+
+// Frees all names; their numbers become unknown
+void domain_id_final() {
+	pthread_mutex_lock(&lock);
+
+	for (int i = 0; i < DOMAIN_ID_PAGES && pages[i]; ++i) {
+		free(pages[i]);
+		pages[i] = 0;
+	}
+
+	free(table);
+	table = 0;
+	table_size = 0;
+	count = 0;
+	arena_release(&names);
+
+	pthread_mutex_unlock(&lock);
+}
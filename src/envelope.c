@@ -0,0 +1,208 @@
+/**
+ * \file envelope.c
+ * \brief Разбор строк конверта письма без регулярных выражений
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENVELOPE_X86
+#endif
+
+#include <envelope.h>
+
+// Positions of two last '@' in scanned part of line, or -1
+struct ats {
+	int last, prev;
+};
+
+typedef int (*scan_func)(const char *buf, int pos, int length, struct ats *a);
+
+static int scan_scalar(const char *buf, int pos, int length, struct ats *a);
+
+static scan_func scan = scan_scalar;
+
+
+// Finds end of line byte by byte and remembers its '@'; returns position
+// of '\n', or -1 if there is none
+static int scan_scalar(const char *buf, int pos, int length, struct ats *a) {
+	for (; pos < length; ++pos) {
+		if (buf[pos] == '\n') return pos;
+
+		if (buf[pos] == '@') {
+			a->prev = a->last;
+			a->last = pos;
+		}
+	}
+
+	return -1;
+}
+
+
+#ifdef ENVELOPE_X86
+
+// Remembers two last '@' of mask of block, which starts at 'pos'
+static inline void add_ats(struct ats *a, int pos, unsigned mask) {
+	if (!mask) return;
+
+	int hi = 31 - __builtin_clz(mask);
+	mask &= ~(1u << hi);
+
+	a->prev = mask ? pos + 31 - __builtin_clz(mask) : a->last;
+	a->last = pos + hi;
+}
+
+
+// Same as scan_scalar(), but by 16 bytes; the rest of buffer, which is
+// shorter, is scanned byte by byte, so nothing is read after its end
+__attribute__((target("sse2")))
+static int scan_sse2(const char *buf, int pos, int length, struct ats *a) {
+	const __m128i nl = _mm_set1_epi8('\n'), at = _mm_set1_epi8('@');
+
+	for (; pos + 16 <= length; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+		unsigned nls = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		unsigned ats = _mm_movemask_epi8(_mm_cmpeq_epi8(v, at));
+
+		if (nls) {
+			int end = __builtin_ctz(nls);
+			add_ats(a, pos, ats & ((1u << end) - 1));
+			return pos + end;
+		}
+
+		add_ats(a, pos, ats);
+	}
+
+	return scan_scalar(buf, pos, length, a);
+}
+
+
+// Same as scan_sse2(), but by 32 bytes
+__attribute__((target("avx2")))
+static int scan_avx2(const char *buf, int pos, int length, struct ats *a) {
+	const __m256i nl = _mm256_set1_epi8('\n'), at = _mm256_set1_epi8('@');
+
+	for (; pos + 32 <= length; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+		unsigned nls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		unsigned ats = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, at));
+
+		if (nls) {
+			int end = __builtin_ctz(nls);
+			add_ats(a, pos, ats & ((1u << end) - 1));
+			return pos + end;
+		}
+
+		add_ats(a, pos, ats);
+	}
+
+	return scan_sse2(buf, pos, length, a);
+}
+
+#endif
+
+
+// Selects implementation of scanning, if processor supports it; returns 1
+// on success, 0 otherwise
+int envelope_select(envelope_impl impl) {
+	switch (impl) {
+	case ENVELOPE_SCALAR:
+		scan = scan_scalar;
+		return 1;
+#ifdef ENVELOPE_X86
+	case ENVELOPE_SSE2:
+		if (!__builtin_cpu_supports("sse2")) return 0;
+		scan = scan_sse2;
+		return 1;
+	case ENVELOPE_AVX2:
+		if (!__builtin_cpu_supports("avx2")) return 0;
+		scan = scan_avx2;
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+
+// Selects the fastest implementation of scanning; should be called before
+// threads are started
+int envelope_init() {
+#ifdef ENVELOPE_X86
+	__builtin_cpu_init();
+#endif
+
+	for (int impl = envelope_impl_count - 1; impl > ENVELOPE_SCALAR; --impl) {
+		if (envelope_select(impl)) return 1;
+	}
+
+	return envelope_select(ENVELOPE_SCALAR);
+}
+
+
+// Compares start of line with keyword in upper case, case of letters is
+// ignored as by PCRE_CASELESS
+static int keyword(const char *buf, const char *word, int n) {
+	for (int i = 0; i < n; ++i) {
+		char c = buf[i];
+		if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+		if (c != word[i]) return 0;
+	}
+
+	return 1;
+}
+
+
+// Same characters, which are matched by \s
+static int is_space(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+
+// Checks "\s*<.+>\r\n" after keyword, which ends at 'pos', in line with
+// '\n' at 'eol'; returns position of address after '<', or 0
+static int address(const char *buf, int pos, int eol) {
+	while (pos < eol && is_space(buf[pos])) pos++;
+
+	if (pos + 3 >= eol || buf[pos] != '<' || buf[eol - 2] != '>' || buf[eol - 1] != '\r') return 0;
+
+	return pos + 1;
+}
+
+
+// Recognizes first line of buffer; returns its length with '\n' and fills
+// in its type and parts, or returns 0 if there is no '\n' in 'length' bytes.
+// Lines, which don't match any regexp of envelope, have ENVELOPE_INVALID type
+int envelope_scan(const char *buf, int length, struct envelope_line *l) {
+	struct ats a = {-1, -1};
+	int eol = scan(buf, 0, length, &a);
+
+	memset(l, 0, sizeof(*l));
+	l->type = ENVELOPE_INVALID;
+
+	if (eol < 0) return 0;
+
+	l->length = eol + 1;
+
+	if (l->length == 6 && keyword(buf, "DATA\r\n", 6)) {
+		l->type = ENVELOPE_DATA;
+	} else if (l->length > 10 && keyword(buf, "MAIL FROM:", 10)) {
+		if (address(buf, 10, eol)) l->type = ENVELOPE_MAIL_FROM;
+	} else if (l->length > 8 && keyword(buf, "RCPT TO:", 8)) {
+		int start = address(buf, 8, eol), end = eol - 2;
+
+		// Keyword has no '@', so all of them are in address; domain starts
+		// after last '@', which is not the last character of address
+		int at = a.last == end - 1 ? a.prev : a.last;
+
+		if (start && at > start) {
+			l->type = ENVELOPE_RCPT_TO;
+			l->name = start;
+			l->name_length = end - start;
+			l->domain = at + 1;
+			l->domain_length = end - at - 1;
+		}
+	}
+
+	return l->length;
+}
@@ -0,0 +1,659 @@
+/**
+ * \file event.c
+ * \brief Ожидание событий на множестве дескрипторов через poll(), epoll()
+ * или io_uring
+ */
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+#include <log.h>
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef USE_IO_URING
+#include <uring.h>
+
+#define URING_ENTRIES 256
+
+// Kinds of requests; they are packed into user data of request together
+// with descriptor and sequence number of request for this descriptor
+enum {
+	OP_POLL = 1,
+	OP_RECV,
+	OP_SEND,
+	OP_CANCEL
+};
+
+#define UD(fd, op, seq)	((uint64_t)(unsigned)(fd) << 32 | (uint64_t)(op) << 24 | ((seq) & 0xffffff))
+#define UD_FD(ud)		((int)((ud) >> 32))
+#define UD_OP(ud)		((int)((ud) >> 24 & 0xff))
+
+/**
+ * \brief Дескриптор, зарегистрированный в io_uring: его запросы в ядре и
+ * события, которые еще не были возвращены из event_wait()
+ */
+struct uring_slot {
+	void *data;
+	int events;			// events of interest, EVENT_READ | EVENT_WRITE
+	int registered;
+	unsigned seq;		// sequence number of last request
+	uint64_t poll_ud;	// user data of requests in flight, or 0
+	uint64_t recv_ud;
+	uint64_t send_ud;
+	int inflight;		// all requests in flight, including cancelled ones
+	int ready;			// EVENT_* flags to return
+	int queued;			// 1 if descriptor is in ready list
+	int recv_res;
+	int send_res;
+};
+
+static __thread struct uring ring;
+static __thread struct uring_slot *slots;
+static __thread int slot_cap;
+
+// Descriptors with events to return; stale entries of removed descriptors
+// are skipped
+static __thread int *ready_fds;
+static __thread int ready_count, ready_cap;
+#endif
+
+#define EVENT_MAX_BATCH 256
+
+// Every delivery thread has its own event loop, so state of backend is
+// thread local
+static __thread event_backend backend;
+
+static __thread struct event_stats stats;
+
+// epoll descriptor
+static __thread int epfd = -1;
+
+// poll() backend: registered descriptors, their data, and index of each
+// descriptor in these arrays (by descriptor number) for O(1) removal
+static __thread struct pollfd *pfds;
+static __thread void **pdata;
+static __thread int *pindex;
+static __thread int pcount, pcap, pindex_cap;
+
+
+#ifdef USE_IO_URING
+// Creates rings and checks, that kernel supports all needed requests
+static int uring_backend_init() {
+	static const int ops[] = {
+		IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL
+	};
+
+	if (!uring_init(&ring, URING_ENTRIES)) return 0;
+
+	for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+		if (!uring_supports(&ring, ops[i])) {
+			uring_final(&ring);
+			return 0;
+		}
+	}
+
+	slots = 0;
+	slot_cap = 0;
+	ready_fds = 0;
+	ready_count = ready_cap = 0;
+
+	return 1;
+}
+#endif
+
+
+// Selects and initializes backend by name; returns 1 on success
+int event_init(const char *name) {
+	backend = EVENT_BACKEND_POLL;
+	memset(&stats, 0, sizeof(stats));
+
+#ifdef USE_IO_URING
+	if (name && strcmp(name, "io_uring") == 0) {
+		if (uring_backend_init()) {
+			backend = EVENT_BACKEND_IO_URING;
+			DLOG("Using io_uring event backend.");
+			return 1;
+		}
+
+		ELOG("io_uring is not available, falling back to epoll().");
+	}
+#endif
+
+#ifdef USE_EPOLL
+	if (!name || strcmp(name, "poll") != 0) {
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0) {
+			backend = EVENT_BACKEND_EPOLL;
+			DLOG("Using epoll() event backend.");
+			return 1;
+		}
+
+		ELOG("Can't create epoll descriptor, falling back to poll().");
+	}
+#endif
+
+	pcount = pcap = pindex_cap = 0;
+	pfds = 0;
+	pdata = 0;
+	pindex = 0;
+
+	DLOG("Using poll() event backend.");
+	return 1;
+}
+
+
+// Frees all backend structures
+void event_final() {
+	if (epfd >= 0) {
+		close(epfd);
+		epfd = -1;
+	}
+
+	free(pfds);
+	free(pdata);
+	free(pindex);
+	pfds = 0;
+	pdata = 0;
+	pindex = 0;
+	pcount = pcap = pindex_cap = 0;
+
+#ifdef USE_IO_URING
+	if (backend == EVENT_BACKEND_IO_URING) {
+		uring_final(&ring);
+		free(slots);
+		free(ready_fds);
+		slots = 0;
+		ready_fds = 0;
+		slot_cap = ready_count = ready_cap = 0;
+	}
+#endif
+}
+
+
+// Returns backend which is actually used
+event_backend event_current_backend() {
+	return backend;
+}
+
+
+// Returns 1 if event_recv() and event_send() are available
+int event_async() {
+	return backend == EVENT_BACKEND_IO_URING;
+}
+
+
+// Adds count of events handled by caller after last event_wait()
+void event_count_handled(int handled) {
+	stats.handled += handled;
+}
+
+
+// Returns counters of events per wakeup
+struct event_stats event_get_stats() {
+	return stats;
+}
+
+
+#ifdef USE_EPOLL
+// Converts EVENT_* flags into epoll flags and back
+static unsigned to_epoll(int events) {
+	return (events & EVENT_READ ? EPOLLIN : 0) | (events & EVENT_WRITE ? EPOLLOUT : 0);
+}
+
+static int from_epoll(unsigned events) {
+	return (events & EPOLLIN ? EVENT_READ : 0)
+		| (events & EPOLLOUT ? EVENT_WRITE : 0)
+		| (events & (EPOLLERR | EPOLLHUP) ? EVENT_ERROR : 0);
+}
+#endif
+
+
+static short to_poll(int events) {
+	return (events & EVENT_READ ? POLLIN : 0) | (events & EVENT_WRITE ? POLLOUT : 0);
+}
+
+static int from_poll(short events) {
+	return (events & POLLIN ? EVENT_READ : 0)
+		| (events & POLLOUT ? EVENT_WRITE : 0)
+		| (events & (POLLERR | POLLHUP | POLLNVAL) ? EVENT_ERROR : 0);
+}
+
+
+#ifdef USE_IO_URING
+// Returns slot of registered descriptor, or 0
+static struct uring_slot* uring_slot(int fd) {
+	if (fd < 0 || fd >= slot_cap || !slots[fd].registered) return 0;
+	return &slots[fd];
+}
+
+
+static void uring_reap();
+
+
+// Returns free submission entry; kernel may take no more requests, until
+// completions are reaped. Returns 0 if there is no room anyway
+static struct io_uring_sqe* uring_sqe() {
+	struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+	if (!sqe) {
+		uring_reap();
+		sqe = uring_get_sqe(&ring);
+	}
+
+	if (!sqe) ELOG("Can't queue request to io_uring.");
+
+	return sqe;
+}
+
+
+// Queues request for descriptor; it is submitted by next event_wait().
+// Returns 0 if it can't be queued
+static struct io_uring_sqe* uring_request(int fd, int op, uint64_t *ud) {
+	struct uring_slot *s = &slots[fd];
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe) return 0;
+
+	sqe->opcode = op == OP_POLL ? IORING_OP_POLL_ADD : op == OP_RECV ? IORING_OP_RECV : IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->user_data = *ud = UD(fd, op, ++s->seq);
+	s->inflight++;
+
+	return sqe;
+}
+
+
+// Queues one-shot poll for events of interest; it is queued again every
+// time it fires, so that readiness is level-triggered as with epoll
+static void uring_arm_poll(int fd) {
+	struct uring_slot *s = &slots[fd];
+	int events = s->events & (EVENT_READ | EVENT_WRITE);
+
+	if (!events || s->poll_ud) return;
+
+	struct io_uring_sqe *sqe = uring_request(fd, OP_POLL, &s->poll_ud);
+	if (!sqe) return;
+
+	sqe->poll32_events = (events & EVENT_READ ? POLLIN : 0) | (events & EVENT_WRITE ? POLLOUT : 0);
+}
+
+
+// Queues cancellation of request; returns 0 if it can't be queued
+static int uring_cancel(int op, uint64_t ud) {
+	struct io_uring_sqe *sqe = uring_sqe();
+
+	if (!sqe) return 0;
+
+	sqe->opcode = op == OP_POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->user_data = UD(-1, OP_CANCEL, 0);
+	return 1;
+}
+
+
+// Records completions of requests as events of their descriptors
+static void uring_reap() {
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(&ring))) {
+		uint64_t ud = cqe->user_data;
+		int res = cqe->res, fd = UD_FD(ud), op = UD_OP(ud);
+
+		uring_cqe_seen(&ring);
+
+		if (op == OP_CANCEL || fd < 0 || fd >= slot_cap) continue;
+
+		struct uring_slot *s = &slots[fd];
+		int events = 0;
+		s->inflight--;
+
+		// Results of cancelled requests and of requests of removed
+		// descriptor are dropped
+		if (op == OP_POLL && ud == s->poll_ud) {
+			s->poll_ud = 0;
+			events = res < 0 ? EVENT_ERROR : from_poll(res);
+		} else if (op == OP_RECV && ud == s->recv_ud) {
+			s->recv_ud = 0;
+			s->recv_res = res;
+			events = EVENT_RECV;
+		} else if (op == OP_SEND && ud == s->send_ud) {
+			s->send_ud = 0;
+			s->send_res = res;
+			events = EVENT_SEND;
+		}
+
+		if (!events || !s->registered) continue;
+
+		s->ready |= events;
+
+		if (!s->queued) {
+			if (ready_count == ready_cap) {
+				ready_cap = ready_cap ? ready_cap * 2 : 64;
+				ready_fds = realloc(ready_fds, ready_cap * sizeof(*ready_fds));
+			}
+
+			ready_fds[ready_count++] = fd;
+			s->queued = 1;
+		}
+	}
+}
+
+
+static int uring_add(int fd, int events, void *data) {
+	if (fd >= slot_cap) {
+		int cap = slot_cap ? slot_cap : 64;
+		while (cap <= fd) cap *= 2;
+		slots = realloc(slots, cap * sizeof(*slots));
+		memset(slots + slot_cap, 0, (cap - slot_cap) * sizeof(*slots));
+		slot_cap = cap;
+	}
+
+	struct uring_slot *s = &slots[fd];
+	s->data = data;
+	s->events = events;
+	s->registered = 1;
+	s->ready = 0;
+	s->queued = 0;
+
+	uring_arm_poll(fd);
+	return 1;
+}
+
+
+static int uring_mod(int fd, int events, void *data) {
+	struct uring_slot *s = uring_slot(fd);
+
+	if (!s) return 0;
+
+	s->data = data;
+
+	if (s->events == events) return 1;
+
+	s->events = events;
+	s->ready &= ~(EVENT_READ | EVENT_WRITE);
+
+	if (s->poll_ud) {
+		uring_cancel(OP_POLL, s->poll_ud);
+		s->poll_ud = 0;
+	}
+
+	uring_arm_poll(fd);
+	return 1;
+}
+
+
+// Cancels all requests of descriptor and waits for them to finish, as
+// buffers of operations may be freed after descriptor is removed
+static int uring_del(int fd) {
+	struct uring_slot *s = uring_slot(fd);
+
+	if (!s) return 0;
+
+	s->registered = 0;
+	s->queued = 0;
+	s->ready = 0;
+
+	int cancelled = (!s->poll_ud || uring_cancel(OP_POLL, s->poll_ud))
+			& (!s->recv_ud || uring_cancel(OP_RECV, s->recv_ud))
+			& (!s->send_ud || uring_cancel(OP_SEND, s->send_ud));
+	s->poll_ud = s->recv_ud = s->send_ud = 0;
+
+	// Requests, which were not cancelled, would never finish
+	if (!cancelled) {
+		ELOG("Can't cancel requests of descriptor %d.", fd);
+		return 0;
+	}
+
+	while (slots[fd].inflight > 0) {
+		if (uring_submit(&ring, 1, 1000) < 0) {
+			ELOG("Can't cancel requests of descriptor %d.", fd);
+			return 0;
+		}
+
+		uring_reap();
+	}
+
+	return 1;
+}
+
+
+static int uring_wait(struct event *evs, int max, int ms) {
+	// Events, which were not returned yet, need no waiting
+	if (uring_submit(&ring, ready_count == 0 && ms != 0, ms) < 0) return -1;
+
+	uring_reap();
+
+	int n = 0, i = 0;
+	for (; i < ready_count && n < max; ++i) {
+		int fd = ready_fds[i];
+		struct uring_slot *s = &slots[fd];
+
+		if (!s->queued) continue;
+
+		s->queued = 0;
+
+		// Readiness may be dropped by event_mod()
+		if (!s->ready) continue;
+
+		evs[n].data = s->data;
+		evs[n].events = s->ready;
+		evs[n].recv_res = s->recv_res;
+		evs[n++].send_res = s->send_res;
+
+		s->ready = 0;
+		uring_arm_poll(fd);
+	}
+
+	ready_count -= i;
+	memmove(ready_fds, ready_fds + i, ready_count * sizeof(*ready_fds));
+
+	return n;
+}
+#endif
+
+
+// Registers descriptor; 'data' will be returned by event_wait() when
+// descriptor is ready; returns 1 on success, 0 on failure
+int event_add(int fd, int events, void *data) {
+	if (fd < 0) return 0;
+
+#ifdef USE_IO_URING
+	if (backend == EVENT_BACKEND_IO_URING) return uring_add(fd, events, data);
+#endif
+
+#ifdef USE_EPOLL
+	if (backend == EVENT_BACKEND_EPOLL) {
+		struct epoll_event ev = { .events = to_epoll(events), .data.ptr = data };
+		return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+	}
+#endif
+
+	if (pcount == pcap) {
+		pcap = pcap ? pcap * 2 : 64;
+		pfds = realloc(pfds, pcap * sizeof(*pfds));
+		pdata = realloc(pdata, pcap * sizeof(*pdata));
+	}
+
+	if (fd >= pindex_cap) {
+		int cap = pindex_cap ? pindex_cap : 64;
+		while (cap <= fd) cap *= 2;
+		pindex = realloc(pindex, cap * sizeof(*pindex));
+		pindex_cap = cap;
+	}
+
+	pfds[pcount].fd = fd;
+	pfds[pcount].events = to_poll(events);
+	pfds[pcount].revents = 0;
+	pdata[pcount] = data;
+	pindex[fd] = pcount++;
+
+	return 1;
+}
+
+
+// Returns slot of registered descriptor in poll set, or -1 if it was not
+// added, so that foreign descriptor can't spoil slot of another one
+static int poll_slot(int fd) {
+	if (fd < 0 || fd >= pindex_cap) return -1;
+
+	int i = pindex[fd];
+	if (i < 0 || i >= pcount || pfds[i].fd != fd) return -1;
+
+	return i;
+}
+
+
+// Changes events of interest (and data) of registered descriptor
+int event_mod(int fd, int events, void *data) {
+#ifdef USE_IO_URING
+	if (backend == EVENT_BACKEND_IO_URING) return uring_mod(fd, events, data);
+#endif
+
+#ifdef USE_EPOLL
+	if (backend == EVENT_BACKEND_EPOLL) {
+		struct epoll_event ev = { .events = to_epoll(events), .data.ptr = data };
+		return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+	}
+#endif
+
+	int i = poll_slot(fd);
+	if (i < 0) return 0;
+
+	pfds[i].events = to_poll(events);
+	pdata[i] = data;
+
+	return 1;
+}
+
+
+// Removes descriptor; should be called before descriptor is closed
+int event_del(int fd) {
+#ifdef USE_IO_URING
+	if (backend == EVENT_BACKEND_IO_URING) return uring_del(fd);
+#endif
+
+#ifdef USE_EPOLL
+	if (backend == EVENT_BACKEND_EPOLL) {
+		return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, 0) == 0;
+	}
+#endif
+
+	int i = poll_slot(fd);
+	if (i < 0) return 0;
+
+	int last = --pcount;
+
+	if (i != last) {
+		pfds[i] = pfds[last];
+		pdata[i] = pdata[last];
+		pindex[pfds[i].fd] = i;
+	}
+
+	return 1;
+}
+
+
+// Waits up to 'ms' milliseconds for events; fills at most 'max' ready
+// descriptors into 'evs'; returns their count, 0 on timeout or -1 on error
+int event_wait(struct event *evs, int max, int ms) {
+#ifdef USE_IO_URING
+	if (backend == EVENT_BACKEND_IO_URING) {
+		int n = uring_wait(evs, max, ms);
+
+		if (n > 0) {
+			stats.wakeups++;
+			stats.events += n;
+		}
+
+		return n;
+	}
+#endif
+
+#ifdef USE_EPOLL
+	if (backend == EVENT_BACKEND_EPOLL) {
+		struct epoll_event ready[EVENT_MAX_BATCH];
+		int n = epoll_wait(epfd, ready, max < EVENT_MAX_BATCH ? max : EVENT_MAX_BATCH, ms);
+
+		for (int i = 0; i < n; ++i) {
+			evs[i].data = ready[i].data.ptr;
+			evs[i].events = from_epoll(ready[i].events);
+		}
+
+		if (n > 0) {
+			stats.wakeups++;
+			stats.events += n;
+		}
+
+		return n;
+	}
+#endif
+
+	int res = poll(pfds, pcount, ms);
+
+	if (res <= 0) return res;
+
+	int n = 0;
+	for (int i = 0; i < pcount && n < max && n < res; ++i) {
+		if (pfds[i].revents) {
+			evs[n].data = pdata[i];
+			evs[n++].events = from_poll(pfds[i].revents);
+		}
+	}
+
+	stats.wakeups++;
+	stats.events += n;
+
+	return n;
+}
+
+
+// Queues receiving into buffer from registered descriptor; its result is
+// returned by event_wait() with EVENT_RECV. Buffer should stay valid until
+// then or until descriptor is removed. Returns 0 if backend can't do it,
+// or if receiving is already in progress
+int event_recv(int fd, void *buf, int length) {
+#ifdef USE_IO_URING
+	struct uring_slot *s = backend == EVENT_BACKEND_IO_URING ? uring_slot(fd) : 0;
+
+	if (!s || s->recv_ud) return 0;
+
+	struct io_uring_sqe *sqe = uring_request(fd, OP_RECV, &s->recv_ud);
+	if (!sqe) return 0;
+
+	sqe->addr = (unsigned long)buf;
+	sqe->len = length;
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+
+// Queues sending of buffer, like event_recv(); result is returned with
+// EVENT_SEND
+int event_send(int fd, const void *buf, int length) {
+#ifdef USE_IO_URING
+	struct uring_slot *s = backend == EVENT_BACKEND_IO_URING ? uring_slot(fd) : 0;
+
+	if (!s || s->send_ud) return 0;
+
+	struct io_uring_sqe *sqe = uring_request(fd, OP_SEND, &s->send_ud);
+	if (!sqe) return 0;
+
+	sqe->addr = (unsigned long)buf;
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	return 1;
+#else
+	return 0;
+#endif
+}
@@ -80,6 +80,12 @@ int quit_key_pressed() {
 }
 
 
+// Returns socket, which becomes readable when 'Q' was pressed
+int keyboard_listener_fd() {
+	return key_sock;
+}
+
+
 // Waits till listener will stop its work
 int keyboard_listener_final() {
 	fcntl(key_sock, F_SETFL, !O_NONBLOCK);
@@ -2,21 +2,90 @@
  * \file maildir.c
  * \brief Файл со структурами и функциями для работы с сообщениями 
  */ 
+#include <sys/inotify.h>
+#include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <maildir.h>
-#include <regexp.h>
+#include <envelope.h>
+#include <parser.h>
+#include <event.h>
+#include <tree.h>
 #include <utils.h>
 #include <opts.h>
 #include <log.h>
 
+#ifdef USE_IO_URING
+#include <uring.h>
+#endif
+
 
 // Array of all dir paths in MAILDIR directory
 char *maildir_path[maildir_count];
 
+// inotify descriptor watching MAILDIR/NEW; -1 if watcher is not available
+static int watch_fd = -1;
+
+// Time of last full scan of MAILDIR/NEW; 0 forces scan on next wait
+static time_t last_rescan;
+
+
+/**
+ * \brief Файл из MAILDIR/NEW, уже замеченный сканером
+ */
+struct spool_file {
+	char *name;
+	ino_t ino;
+	unsigned generation;	// number of last full scan which saw this file
+	int pending;			// 1 if file was not read yet
+	RB_ENTRY(spool_file) entry;
+	TAILQ_ENTRY(spool_file) pending_entry;
+};
+RB_HEAD(spool_tree, spool_file);
+TAILQ_HEAD(spool_queue, spool_file);
+
+int spool_file_cmp(struct spool_file *a, struct spool_file *b) {
+	return strcmp(a->name, b->name);
+}
+
+RB_PROTOTYPE(spool_tree, spool_file, entry, spool_file_cmp)
+RB_GENERATE(spool_tree, spool_file, entry, spool_file_cmp)
+
+// Set of all known files in MAILDIR/NEW and queue of not yet read ones
+static struct spool_tree spool_seen = RB_INITIALIZER(&spool_seen);
+static struct spool_queue spool_pending = TAILQ_HEAD_INITIALIZER(spool_pending);
+static int spool_pending_count;
+static unsigned spool_generation;
+
+
+#ifdef USE_IO_URING
+/**
+ * \brief Перемещение, копирование или удаление файла письма, ожидающее
+ * отправки в io_uring вместе с остальными операциями пакета
+ */
+struct file_op {
+	int op;				// IORING_OP_RENAMEAT, IORING_OP_LINKAT or IORING_OP_UNLINKAT
+	char *filename;
+	maildir_dir from_dir, to_dir;
+	char from[500], to[500];
+};
+
+// Batches are used by main thread only; in other threads files are
+// handled at once
+static struct uring batch_ring;
+static int batch_ring_state;	// 1 if ring works, -1 if it is not available
+static struct file_op batch[MAILDIR_BATCH_SIZE];
+static int batch_count;
+static __thread int batching;
+#endif
+
 
 // Allocates and itinializes all maildir path strings
 int maildir_init() {
@@ -35,204 +104,588 @@ int maildir_init() {
 	sprintf(maildir_path[DIR_CUR],		"%s%s", root, cur);
 	sprintf(maildir_path[DIR_NOTSENT],	"%s%s", root, not_sent);
 
+	// Envelopes of mail files are recognized by vector instructions, if
+	// processor has them
+	envelope_init();
+
 	return 1;
 }
 
 
-// Frees all maildir path strings
+// Frees all maildir path strings and scanner state
 int maildir_final() {
+	struct spool_file *sf, *sf_tmp;
+	RB_FOREACH_SAFE(sf, spool_tree, &spool_seen, sf_tmp) {
+		spool_forget(sf->name);
+	}
+
 	for (int i = 0; i < maildir_count; ++i) {
 		free(maildir_path[i]);
 	}
 
+#ifdef USE_IO_URING
+	if (batch_ring_state == 1) uring_final(&batch_ring);
+	batch_ring_state = 0;
+#endif
+
 	return 1;
 }
 
 
-// Returns count of mail files in MAILDIR/NEW/ directory
-int new_mail_exist() {
-	int ret = 0;
+// Adds file to the set of known files; if it was not known yet (or was
+// replaced by another file with the same name), queues it for reading.
+// Returns 1 if file is new, 0 otherwise
+int spool_add(const char *name, ino_t ino) {
+	struct spool_file key, *sf;
+	key.name = (char *)name;
+
+	if ((sf = RB_FIND(spool_tree, &spool_seen, &key))) {
+		sf->generation = spool_generation;
+
+		if (!sf->ino) sf->ino = ino;
+		if (!ino || sf->ino == ino) return 0;
+
+		DLOG(YELLOW "Mail file '%s' was replaced.", name);
+		spool_forget(name);
+	}
+
+	sf = malloc(sizeof(*sf));
+	sf->name = strdup(name);
+	sf->ino = ino;
+	sf->generation = spool_generation;
+	sf->pending = 1;
+
+	RB_INSERT(spool_tree, &spool_seen, sf);
+	TAILQ_INSERT_TAIL(&spool_pending, sf, pending_entry);
+	spool_pending_count++;
+
+	return 1;
+}
+
+
+// Removes file from the set of known files; should be called when file
+// leaves MAILDIR/NEW, so a new file with the same name will be read again
+void spool_forget(const char *name) {
+	struct spool_file key, *sf;
+	key.name = (char *)name;
+
+	if (!(sf = RB_FIND(spool_tree, &spool_seen, &key))) return;
 
+	if (sf->pending) {
+		TAILQ_REMOVE(&spool_pending, sf, pending_entry);
+		spool_pending_count--;
+	}
+
+	RB_REMOVE(spool_tree, &spool_seen, sf);
+	free(sf->name);
+	free(sf);
+}
+
+
+// Scans MAILDIR/NEW directory, queues files that were not seen before and
+// forgets files that disappeared; returns count of mail files not read yet
+int new_mail_exist() {
 	struct dirent *dir;
 	DIR *root = opendir(maildir_path[DIR_NEW]);
 
-	if (root) {
-		while ((dir = readdir(root)) != 0) {
-			if (dir->d_type == DT_REG) {
-				ret += 1;
+	if (!root) return spool_pending_count;
+
+	spool_generation++;
+
+	while ((dir = readdir(root)) != 0) {
+		if (dir->d_type == DT_REG) {
+			spool_add(dir->d_name, dir->d_ino);
+		}
+	}
+
+	closedir(root);
+
+	struct spool_file *sf, *sf_tmp;
+	RB_FOREACH_SAFE(sf, spool_tree, &spool_seen, sf_tmp) {
+		if (sf->generation != spool_generation) {
+			spool_forget(sf->name);
+		}
+	}
+
+	return spool_pending_count;
+}
+
+
+// Starts inotify watcher on MAILDIR/NEW; without it wait_for_new_mail()
+// falls back to polling the directory
+int maildir_watch_init() {
+	last_rescan = 0;
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (watch_fd < 0) {
+		ELOG("Can't create inotify watcher, falling back to polling MAILDIR.");
+		return 0;
+	}
+
+	if (inotify_add_watch(watch_fd, maildir_path[DIR_NEW], IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+		ELOG("Can't watch '%s', falling back to polling MAILDIR.", maildir_path[DIR_NEW]);
+		close(watch_fd);
+		watch_fd = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// Stops inotify watcher
+int maildir_watch_final() {
+	if (watch_fd >= 0) {
+		close(watch_fd);
+		watch_fd = -1;
+	}
+
+	return 1;
+}
+
+
+// Returns inotify descriptor, so it can be polled along with sockets;
+// -1 if watcher is not available
+int maildir_watch_fd() {
+	return watch_fd;
+}
+
+
+// Reads all pending inotify events and queues arrived files; returns 1
+// if event queue overflowed and full rescan is needed, 0 otherwise
+static int drain_watch_events() {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int overflow = 0;
+	ssize_t len;
+
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				overflow = 1;
+			} else if (ev->len && (ev->mask & (IN_MOVED_TO | IN_CLOSE_WRITE))) {
+				spool_add(ev->name, 0);
 			}
+
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return overflow;
+}
+
+
+// Waits up to 'ms' milliseconds (-1 - until next rescan) for mail in
+// MAILDIR/NEW, or till any of 'wake_fds' is readable (it is not read);
+// returns count of mail files that were not read yet. Watcher reports file
+// names directly, so the directory is only read when rescan interval has
+// passed (safety net for lost events) or inotify queue overflowed
+int wait_for_new_mail(int ms, const int *wake_fds, int wake_count) {
+	// Mail, which parser threads have not given out yet, is not waited for
+	int parsing = parser_pending();
+	if (parsing) ms = 0;
+
+	int interval = opts_rescan_interval();
+	int elapsed = difftime(time(0), last_rescan);
+	int rescan = elapsed >= interval;
+
+	// Waiting does not delay next rescan
+	if (!rescan && (ms < 0 || ms > (interval - elapsed) * 1000)) {
+		ms = (interval - elapsed) * 1000;
+	}
+
+	struct pollfd fds[wake_count + 1];
+	for (int i = 0; i < wake_count; ++i) {
+		fds[i].fd = wake_fds[i];
+		fds[i].events = POLLIN;
+	}
+
+	if (watch_fd < 0) {
+		int count = new_mail_exist();
+		if (!count) poll(fds, wake_count, ms);
+		return count + parsing;
+	}
+
+	if (!rescan && !spool_pending_count) {
+		struct pollfd *fd = &fds[wake_count];
+		fd->fd = watch_fd;
+		fd->events = POLLIN;
+
+		if (poll(fds, wake_count + 1, ms) > 0 && (fd->revents & POLLIN)) {
+			rescan = drain_watch_events();
 		}
+	} else {
+		rescan |= drain_watch_events();
+	}
+
+	if (rescan) {
+		last_rescan = time(0);
+		return new_mail_exist() + parsing;
+	}
 
-		closedir(root);
+	return spool_pending_count + parsing;
+}
+
+
+// Gives all files queued by the scanner to parser threads
+static void submit_pending() {
+	char **names = malloc(spool_pending_count * sizeof(*names));
+	int n = 0;
+
+	struct spool_file *sf;
+	while ((sf = TAILQ_FIRST(&spool_pending))) {
+		TAILQ_REMOVE(&spool_pending, sf, pending_entry);
+		sf->pending = 0;
+
+		// Scanner may forget file, while it is being parsed
+		names[n++] = strdup(sf->name);
 	}
 
-	return ret;
+	spool_pending_count = 0;
+
+	if (n) parser_submit(names, n);
+	free(names);
 }
 
 
-// Allocates structures for and reads all mail in MAILDIR/NEW directory;
-// returns count of mail files successfully read, or 0 on failure
+// Allocates structures for and reads all mail queued by the scanner of
+// MAILDIR/NEW directory; returns 1 if any mail file was successfully
+// read, or 0 on failure. With parser threads up to MAILDIR_READ_BATCH
+// mails are taken in order of arrival of their files, the rest are
+// parsed meanwhile and taken by next calls
 int read_all_mail(struct mail_list *ml) {
 	int total = 0, success = 0;
 
-	struct dirent *dir;
-	DIR *root = opendir(maildir_path[DIR_NEW]);
+	if (!spool_pending_count && !parser_pending()) {
+		new_mail_exist();
+	}
+
+	if (parser_count()) {
+		struct parser_job job;
 
-	if (root) {
-		while ((dir = readdir(root)) != 0) {
-			if (dir->d_type == DT_REG) {
-				LOG(YELLOW "Found mail file: '%s'.", dir->d_name);
+		if (!parser_pending()) submit_pending();
 
-				struct mail *m = read_mail_file(dir->d_name);
-				if (m) {
-					TAILQ_INSERT_TAIL(ml, m, entry);
-					success++;
-				}
+		while (total < MAILDIR_READ_BATCH && parser_next(&job)) {
+			LOG(YELLOW "Found mail file: '%s'.", job.name);
 
-				total++;
+			if (job.mail) {
+				TAILQ_INSERT_TAIL(ml, job.mail, entry);
+				success++;
+			} else {
+				mail_file_failed(job.name, job.status);
 			}
-		}
 
-		if (!success) {
-			ELOG("None of %d mail files were read.", total);
-			return 0;
+			free(job.name);
+			total++;
 		}
+	} else {
+		struct spool_file *sf;
+		while ((sf = TAILQ_FIRST(&spool_pending))) {
+			TAILQ_REMOVE(&spool_pending, sf, pending_entry);
+			spool_pending_count--;
+			sf->pending = 0;
+
+			LOG(YELLOW "Found mail file: '%s'.", sf->name);
+
+			struct mail *m = read_mail_file(sf->name);
+			if (m) {
+				TAILQ_INSERT_TAIL(ml, m, entry);
+				success++;
+			}
 
-		LOG(YELLOW "Successfully read %d/%d mail files.", success, total);
-		filter_my_mail(ml);
-		closedir(root);
+			total++;
+		}
+	}
 
-		return 1;
-	} else {
-		ELOG("Can't open MAILDIR directory.");
+	if (!success) {
+		ELOG("None of %d mail files were read.", total);
 		return 0;
 	}
+
+	LOG(YELLOW "Successfully read %d/%d mail files.", success, total);
+	filter_my_mail(ml);
+
+	return 1;
 }
 
 
-// Returns pointer to allocated mail structure, or 0 on failure
+// Returns pointer to allocated mail structure, or 0 on failure; file of
+// broken mail is moved to NOT_SENT directory
 struct mail* read_mail_file(const char *filename) {
+	mail_status status;
+	struct mail *m = parse_mail_file(filename, &status);
+
+	if (!m) mail_file_failed(filename, status);
+
+	return m;
+}
+
+
+// Reads and parses mail file; returns pointer to allocated mail structure,
+// or 0 and reason of failure in 'status'. Small file is read by one
+// pread(), larger one is mapped into memory, so that only pages of its
+// envelope are read; message body stays in file. Files and state of
+// scanner are not changed, so it may be called by any thread
+struct mail* parse_mail_file(const char *filename, mail_status *status) {
 	char file[500];
 	sprintf(file, "%s/%s", maildir_path[DIR_NEW], filename);
-	FILE *f = fopen(file, "r");
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
 
-	if (!f) {
-		ELOG("Can't open mail file.");
+	if (fd < 0) {
+		ELOG("Can't open mail file '%s'.", filename);
+		*status = MAIL_GONE;
 		return 0;
 	}
 
-	struct mail *m = calloc(1, sizeof(*m));
+	// Mail is the first structure in its arena
+	struct arena a;
+	arena_init(&a, MAIL_ARENA_SIZE);
+
+	struct mail *m = arena_alloc(&a, sizeof(*m));
+	m->arena = a;
 	TAILQ_INIT(&m->rcpts);
-	m->msg = 0;
 	m->was_sent = 0;
-	m->filename = malloc(strlen(filename)+1);
-	strcpy(m->filename, filename);
+	m->filename = arena_strdup(&m->arena, filename);
+
+	char head[MAIL_READ_SIZE];
+	char *buf = head, *map = 0;
+	struct stat st;
+	int ok = 0;
+
+	if (fstat(fd, &st) != 0) {
+		ELOG("Can't read from mail file '%s'.", filename);
+	} else if (st.st_size <= sizeof(head)) {
+		ok = pread(fd, head, st.st_size, 0) == st.st_size;
+		if (!ok) ELOG("Can't read from mail file '%s'.", filename);
+	} else if ((map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		map = 0;
+		ELOG("Can't map mail file '%s'.", filename);
+	} else {
+		buf = map;
+		ok = 1;
+	}
 
-	int from = read_mail_from(f, m);
-	int to   = read_mail_to  (f, m);
-	int data = read_mail_data(f, m);
+	close(fd);
 
-	fclose(f);
+	if (ok) {
+		ok = read_mail(buf, st.st_size, m);
+	}
+
+	if (map) munmap(map, st.st_size);
+
+	if (ok < 0) {
+		*status = MAIL_DEFERRED;
+		free_mail(m);
+		return 0;
+	}
 
-	if (!(from && to && data)) {
+	if (!ok) {
 		ELOG("Incorrect syntax of mail in file '%s'.", filename);
-		move_mail(filename, DIR_NEW, DIR_NOTSENT);
+		*status = MAIL_BROKEN;
 		free_mail(m);
 		return 0;
 	}
 
+	*status = MAIL_PARSED;
 	return m;
 }
 
 
-// Fills in information about MAIL FROM section of mail
-int read_mail_from(FILE *f, struct mail *m) {
-	char buf[500];
+// Handles file, which parse_mail_file() failed to read: broken one is moved
+// to NOT_SENT directory, vanished or deferred one is forgotten by scanner,
+// so deferred file is read again after next scan of directory
+void mail_file_failed(const char *filename, mail_status status) {
+	if (status == MAIL_BROKEN) {
+		move_mail(filename, DIR_NEW, DIR_NOTSENT);
+	} else {
+		spool_forget(filename);
+	}
+}
+
+
+// Recognizes line of envelope at start of buffer; returns its length with
+// '\n', or 0 if there is no complete line
+static int mail_line(const char *buf, off_t length, struct envelope_line *l) {
+	if (length > MAIL_LINE_SIZE) length = MAIL_LINE_SIZE;
+
+	return envelope_scan(buf, length, l);
+}
+
+
+// Fills in mail from contents of its file; returns 0 on failure, or -1 if
+// mail can't be read now, as table of domains is full
+int read_mail(const char *buf, off_t length, struct mail *m) {
+	int from = read_mail_from(buf, length, m);
+	if (!from) return 0;
+
+	int to = read_mail_to(buf + from, length - from, m);
+	if (to <= 0) return to;
+
+	return read_mail_data(buf, length, from + to, m);
+}
+
+
+// Fills in information about MAIL FROM section of mail; returns length
+// of its line, or 0 on failure
+int read_mail_from(const char *buf, off_t length, struct mail *m) {
+	struct envelope_line l;
+	int n = mail_line(buf, length, &l);
 
-	if (!fgets(buf, sizeof(buf), f)) {
+	if (!n) {
 		ELOG("Can't read from mail file '%s'.", m->filename);
 		return 0;
 	}
 
-	if (!re_match(RE_mail_from, buf, strlen(buf))) {
+	if (l.type != ENVELOPE_MAIL_FROM) {
 		ELOG("Incorrect mail format (can't read MAIL FROM) of file '%s'.", m->filename);
 		return 0;
 	}
 
-	strcpy(m->from, buf);
+	m->from = arena_strndup(&m->arena, buf, n);
 
-	return 1;
+	return n;
 }
 
 
-// Fills in information about RCPT TO section of mail
-int read_mail_to(FILE *f, struct mail *m) {
-	char buf[500], rcpt_buf[500];
-
+// Fills in information about RCPT TO section of mail; returns length of
+// its lines with DATA line, 0 on failure, or -1 if domain of recipient
+// can't be added to full table of domains
+int read_mail_to(const char *buf, off_t length, struct mail *m) {
+	struct envelope_line l;
+	off_t pos = 0;
 	int count = 0;
-	int data = 0;
 
-	while (!data) {
-		if (!fgets(buf, sizeof(buf), f)) {
+	while (1) {
+		const char *line = buf + pos;
+		int n = mail_line(line, length - pos, &l);
+
+		if (!n) {
 			ELOG("Can't read from mail file '%s'.", m->filename);
 			return 0;
 		}
 
-		if (re_match(RE_data, buf, strlen(buf))) {
-			data = 1;
-		} else {
-			if (!re_match(RE_rcpt_to, buf, strlen(buf))) {
-				ELOG("Incorrect mail format (can't read RCPT TO) of file '%s'.", m->filename);
-				return 0;
-			}
+		pos += n;
+
+		if (l.type == ENVELOPE_DATA) break;
+
+		if (l.type != ENVELOPE_RCPT_TO) {
+			ELOG("Incorrect mail format (can't read RCPT TO) of file '%s'.", m->filename);
+			return 0;
+		}
 
-			struct rcpt *r = malloc(sizeof(struct rcpt));
+		if (l.name_length >= MAIL_NAME_SIZE) {
+			ELOG("Too long recipient in mail file '%s'.", m->filename);
+			return 0;
+		}
 
-			re_match_and_fill_substring(RE_rcpt_to, buf, strlen(buf), rcpt_buf);
-			strcpy(r->name, rcpt_buf);
+		int domain = domain_id(line + l.domain, l.domain_length);
 
-			re_match_and_fill_substring(RE_rcpt_domain, buf, strlen(buf), rcpt_buf);
-			strcpy(r->domain, rcpt_buf);
+		if (domain < 0) {
+			ELOG("Too many domains of recipients, mail file '%s' is left for later.", m->filename);
+			return -1;
+		}
 
-			TAILQ_INSERT_TAIL(&m->rcpts, r, entry);
-			count++;
+		if (!domain) {
+			ELOG("Too long recipient in mail file '%s'.", m->filename);
+			return 0;
 		}
+
+		struct rcpt *r = arena_alloc(&m->arena, sizeof(struct rcpt));
+		r->name = arena_strndup(&m->arena, line + l.name, l.name_length);
+		r->domain = domain;
+
+		TAILQ_INSERT_TAIL(&m->rcpts, r, entry);
+		count++;
 	}
 
-	return count;
+	return count ? pos : 0;
 }
 
 
-// Fills in information about DATA section of mail
-int read_mail_data(FILE *f, struct mail *m) {
-	char buf[1000];
+// Fills in information about DATA section of mail, which starts at
+// 'offset' of file: message body is not kept, only its place in file is
+// remembered, and its final dot is checked
+int read_mail_data(const char *buf, off_t length, off_t offset, struct mail *m) {
+	m->data_offset = offset;
+	m->data_length = length - offset;
 
-	int curr_size = 0;
-	int max_size = 1000;
-	char *msg = malloc(max_size);
+	// Body ends with line, which has only a dot
+	const char *end = buf + length;
 
-	while (fgets(buf, sizeof(buf), f)) {
-		int bytes_read = strlen(buf) > sizeof(buf) ? sizeof(buf) : strlen(buf);
+	if (m->data_length < 3 || memcmp(end - 3, ".\r\n", 3) != 0
+			|| (m->data_length > 3 && end[-4] != '\n')) {
+		ELOG("Empty message in file '%s'.", m->filename);
+		return 0;
+	}
 
-		if ((curr_size + bytes_read) > max_size) {
-			max_size *= 2;
-			msg = realloc(msg, max_size);
-		}
+	return 1;
+}
+
+
+// Opens file of mail for sending of its body; returns descriptor, or -1
+// on failure
+int open_mail_data(struct mail *m) {
+	char file[500];
+	sprintf(file, "%s/%s", maildir_path[DIR_NEW], m->filename);
+
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
 
-		strcpy(msg + curr_size, buf);
-		curr_size += bytes_read;
+	if (fd < 0) {
+		ELOG("Can't open mail file '%s'.", m->filename);
 	}
 
-	if (curr_size == 0 || strcmp(buf, ".\r\n") != 0) {
-		ELOG("Empty message in file '%s'.", m->filename);
-		free(msg);
-		m->msg = 0;
-		return 0;
-	} else {
-		msg = realloc(msg, curr_size + 1);
-		m->msg = msg;
-		return 1;
+	return fd;
+}
+
+
+// Finds dots, which were added to lines of message body starting with a
+// dot (RFC 5321, 4.5.2), in body without its final dot; returns their count
+// and allocates array of their offsets in file, or returns -1 on error.
+// Body is mapped into memory and scanned without copying it
+int find_stuffed_dots(struct mail *m, int fd, off_t **dots) {
+	off_t length = m->data_length - 3;
+	struct stat st;
+
+	*dots = 0;
+
+	if (length <= 0) return 0;
+
+	// Mapping of truncated file can't be read
+	if (fstat(fd, &st) != 0 || st.st_size < m->data_offset + m->data_length) {
+		ELOG("Mail file '%s' was changed.", m->filename);
+		return -1;
+	}
+
+	off_t start = m->data_offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t size = m->data_offset - start + length;
+	char *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, start);
+
+	if (map == MAP_FAILED) {
+		ELOG("Can't map mail file '%s'.", m->filename);
+		return -1;
+	}
+
+	const char *body = map + (m->data_offset - start);
+	const char *end = body + length, *line = body;
+	int count = 0, room = 0;
+
+	while (line) {
+		if (*line == '.') {
+			if (count == room) {
+				room = room ? room * 2 : 8;
+				*dots = realloc(*dots, room * sizeof(**dots));
+			}
+
+			(*dots)[count++] = m->data_offset + (line - body);
+		}
+
+		line = memchr(line, '\n', end - line);
+		if (line && ++line == end) line = 0;
 	}
+
+	munmap(map, size);
+	return count;
 }
 
 
@@ -240,6 +693,7 @@ int read_mail_data(FILE *f, struct mail *m) {
 int filter_my_mail(struct mail_list *ml) {
 	struct rcpt *r, *r_tmp;
 	struct mail *m, *m_tmp;
+	int my_domain = domain_id(opts_my_domain(), strlen(opts_my_domain()));
 
 	LOG(YELLOW "Filtering mail list...");
 
@@ -248,13 +702,12 @@ int filter_my_mail(struct mail_list *ml) {
 		int other_rcpts = 0;
 
 		TAILQ_FOREACH_SAFE(r, &m->rcpts, entry, r_tmp) {
-			if (strcmp(r->domain, opts_my_domain()) != 0) {
+			if (r->domain != my_domain) {
 				other_rcpts = 1;
 			} else {
 				DLOG(YELLOW "Found local recipient '%s'.", r->name);
 				has_local_rcpt = 1;
 				TAILQ_REMOVE(&m->rcpts, r, entry);
-				free(r);
 			}
 		}
 
@@ -276,18 +729,11 @@ int filter_my_mail(struct mail_list *ml) {
 
 
 
-// Frees all allocated memory for mail structure
+// Frees all allocated memory for mail structure: mail, its recipients and
+// name of its file are released with its arena
 void free_mail(struct mail *m) {
-	struct rcpt *r, *r_tmp;
-
-	TAILQ_FOREACH_SAFE(r, &m->rcpts, entry, r_tmp) {
-		TAILQ_REMOVE(&m->rcpts, r, entry);
-		free(r);
-	}
-
-	free(m->filename);
-	free(m->msg);
-	free(m);
+	struct arena a = m->arena;
+	arena_release(&a);
 }
 
 
@@ -306,18 +752,155 @@ void free_mail_list(struct mail_list *ml) {
  *		Below are functions used to move/copy/delete files
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// Operations with files
+enum {
+	FILE_MOVE,
+	FILE_COPY,
+	FILE_DELETE
+};
+
+static void file_op_failed(int op, const char *filename, maildir_dir from_dir, maildir_dir to_dir) {
+	if (op == FILE_MOVE) {
+		ELOG("Can't move mail '%s' from '%s' to '%s'.", filename, maildir_path[from_dir], maildir_path[to_dir]);
+	} else if (op == FILE_COPY) {
+		ELOG("Can't copy mail '%s' from '%s' to '%s'.", filename, maildir_path[from_dir], maildir_path[to_dir]);
+	} else {
+		ELOG("Can't delete mail '%s' from '%s' dir.", filename, maildir_path[from_dir]);
+	}
+}
+
+
+#ifdef USE_IO_URING
+// Submits all operations of batch at once (in parts, if ring has no room
+// for all of them) and waits for their results
+static void batch_flush() {
+	static const int opcodes[] = {
+		[FILE_MOVE] = IORING_OP_RENAMEAT,
+		[FILE_COPY] = IORING_OP_LINKAT,
+		[FILE_DELETE] = IORING_OP_UNLINKAT
+	};
+
+	int queued = 0, done = 0;
+	while (done < batch_count) {
+		struct io_uring_sqe *sqe;
+		struct io_uring_cqe *cqe;
+
+		// Operations are queued while ring has room for them
+		while (queued < batch_count && (sqe = uring_get_sqe(&batch_ring))) {
+			struct file_op *fo = &batch[queued];
+
+			sqe->opcode = opcodes[fo->op];
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)fo->from;
+			sqe->user_data = queued++;
+
+			if (fo->op != FILE_DELETE) {
+				sqe->len = AT_FDCWD;
+				sqe->addr2 = (unsigned long)fo->to;
+			}
+		}
+
+		if (done == queued || uring_submit(&batch_ring, 1, -1) < 0) {
+			ELOG("Can't submit operations with mail files.");
+			break;
+		}
+
+		while ((cqe = uring_peek_cqe(&batch_ring))) {
+			struct file_op *fo = &batch[cqe->user_data];
+
+			if (cqe->res < 0) file_op_failed(fo->op, fo->filename, fo->from_dir, fo->to_dir);
+
+			uring_cqe_seen(&batch_ring);
+			done++;
+		}
+	}
+
+	for (int i = 0; i < batch_count; ++i) {
+		free(batch[i].filename);
+	}
+
+	batch_count = 0;
+}
+
+
+// Adds operation to current batch; returns 0 if there is no batch, and
+// file should be handled at once
+static int batch_add(int op, const char *filename, maildir_dir from_dir, maildir_dir to_dir, const char *from, const char *to) {
+	if (!batching) return 0;
+
+	// Operations of batch may be reordered, so that operations with the
+	// same file go to different batches
+	for (int i = 0; i < batch_count; ++i) {
+		if (strcmp(batch[i].filename, filename) == 0) {
+			batch_flush();
+			break;
+		}
+	}
+
+	if (batch_count == MAILDIR_BATCH_SIZE) batch_flush();
+
+	struct file_op *fo = &batch[batch_count++];
+	fo->op = op;
+	fo->filename = strdup(filename);
+	fo->from_dir = from_dir;
+	fo->to_dir = to_dir;
+	strcpy(fo->from, from);
+	strcpy(fo->to, to);
+
+	return 1;
+}
+#endif
+
+
+// Starts batch of operations with files in this thread: they are submitted
+// to io_uring together by maildir_batch_end(). Works with io_uring event
+// backend only; otherwise files are handled at once
+void maildir_batch_begin() {
+#ifdef USE_IO_URING
+	if (strcmp(opts_event_backend(), "io_uring") != 0) return;
+
+	if (!batch_ring_state) {
+		batch_ring_state = uring_init(&batch_ring, MAILDIR_BATCH_SIZE)
+				&& uring_supports(&batch_ring, IORING_OP_RENAMEAT)
+				&& uring_supports(&batch_ring, IORING_OP_LINKAT)
+				&& uring_supports(&batch_ring, IORING_OP_UNLINKAT) ? 1 : -1;
+
+		if (batch_ring_state < 0) {
+			uring_final(&batch_ring);
+			ELOG("io_uring can't handle mail files, they are handled one by one.");
+		}
+	}
+
+	batching = batch_ring_state == 1;
+#endif
+}
+
+
+// Finishes all operations of current batch
+void maildir_batch_end() {
+#ifdef USE_IO_URING
+	if (batching) batch_flush();
+	batching = 0;
+#endif
+}
+
+
 // Moves file from 'from_dir' to 'to_dir'
 void move_mail(const char *filename, maildir_dir from_dir, maildir_dir to_dir) {
 	char from[500], to[500];
 	sprintf(from, "%s/%s", maildir_path[from_dir], filename);
 	sprintf(to,   "%s/%s", maildir_path[to_dir],   filename);
 
+	if (from_dir == DIR_NEW) {
+		spool_forget(filename);
+	}
+
+#ifdef USE_IO_URING
+	if (batch_add(FILE_MOVE, filename, from_dir, to_dir, from, to)) return;
+#endif
+
 	if (rename(from, to) != 0) {
-		ELOG("Can't move mail '%s' from '%s' to '%s'.",
-				filename,
-				maildir_path[from_dir],
-				maildir_path[to_dir]
-			);
+		file_op_failed(FILE_MOVE, filename, from_dir, to_dir);
 	}
 }
 
@@ -328,12 +911,12 @@ void copy_mail(const char *filename, maildir_dir from_dir, maildir_dir to_dir) {
 	sprintf(from, "%s/%s", maildir_path[from_dir], filename);
 	sprintf(to,   "%s/%s", maildir_path[to_dir],   filename);
 
+#ifdef USE_IO_URING
+	if (batch_add(FILE_COPY, filename, from_dir, to_dir, from, to)) return;
+#endif
+
 	if (link(from, to) != 0) {
-		ELOG("Can't copy mail '%s' from '%s' to '%s'.",
-				filename,
-				maildir_path[from_dir],
-				maildir_path[to_dir]
-			);
+		file_op_failed(FILE_COPY, filename, from_dir, to_dir);
 	}
 }
 
@@ -343,7 +926,15 @@ void delete_mail(const char *filename, maildir_dir dir) {
 	char file[500];
 	sprintf(file, "%s/%s", maildir_path[dir], filename);
 
+	if (dir == DIR_NEW) {
+		spool_forget(filename);
+	}
+
+#ifdef USE_IO_URING
+	if (batch_add(FILE_DELETE, filename, dir, dir, file, "")) return;
+#endif
+
 	if (unlink(file) != 0) {
-		ELOG("Can't delete mail '%s' from '%s' dir.", filename, maildir_path[dir]);
+		file_op_failed(FILE_DELETE, filename, dir, dir);
 	}
 }
@@ -1,6 +1,7 @@
 #include <key-listener.h>
 #include <protocol.h>
 #include <maildir.h>
+#include <domain-id.h>
 #include <regexp.h>
 #include <opts.h>
 #include <log.h>
@@ -23,6 +24,7 @@ int init() {
 					ELOG("Can't compile regular expressions. Exiting...");
 				} else {
 					maildir_init();
+					maildir_watch_init();
 					return 1;
 				}
 
@@ -37,9 +39,11 @@ int init() {
 
 // Stops all processes and frees allocated structures
 void final() {
+	maildir_watch_final();
 	maildir_final();
 	keyboard_listener_final();
 	re_final();
+	domain_id_final();
 	opts_final();
 	close_log();
 }
@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <string.h>
 #include <libconfig.h>
 #include <opts.h>
 #include <log.h>
@@ -35,18 +37,121 @@ int opts_connection_timeout() {
 	return timeout;
 }
 
+// Timeouts of SMTP client from RFC 5321 section 4.5.3.2, seconds; can be
+// changed in 'client.timeouts' group of config
+int opts_smtp_timeout(const char *command) {
+	static const struct {
+		const char *command;
+		int timeout;
+	} defaults[] = {
+		{ "banner",		300 },
+		{ "mail",		300 },
+		{ "rcpt",		300 },
+		{ "data",		120 },
+		{ "data_block",	180 },
+		{ "data_end",	600 }
+	};
+
+	char path[100];
+	int timeout = opts_connection_timeout();
+
+	for (int i = 0; i < sizeof(defaults) / sizeof(defaults[0]); ++i) {
+		if (!strcmp(defaults[i].command, command)) timeout = defaults[i].timeout;
+	}
+
+	snprintf(path, sizeof(path), "client.timeouts.%s", command);
+	config_lookup_int(&cfg, path, &timeout);
+	return timeout;
+}
+
+int opts_rescan_interval() {
+	int interval = 30;
+	config_lookup_int(&cfg, "client.rescan_interval", &interval);
+	return interval;
+}
+
+int opts_min_sessions() {
+	int count = 1;
+	config_lookup_int(&cfg, "client.min_sessions", &count);
+	return count;
+}
+
+int opts_max_sessions() {
+	int count = 4;
+	config_lookup_int(&cfg, "client.max_sessions", &count);
+	return count;
+}
+
+int opts_mails_per_session() {
+	int count = 10;
+	config_lookup_int(&cfg, "client.mails_per_session", &count);
+	return count;
+}
+
+int opts_idle_timeout() {
+	int timeout = 30;
+	config_lookup_int(&cfg, "client.idle_timeout", &timeout);
+	return timeout;
+}
+
+int opts_pipelining() {
+	int pipelining = 1;
+	config_lookup_bool(&cfg, "client.pipelining", &pipelining);
+	return pipelining;
+}
+
+int opts_chunking() {
+	int chunking = 1;
+	config_lookup_bool(&cfg, "client.chunking", &chunking);
+	return chunking;
+}
+
 int opts_mx_port() {
 	int port = 25;
 	config_lookup_int(&cfg, "client.port", &port);
 	return port;
 }
 
+// Count of delivery threads; 0 means one per CPU
+int opts_workers() {
+	int count = 1;
+	config_lookup_int(&cfg, "client.workers", &count);
+	return count;
+}
+
+// Count of threads parsing mail files; 0 means one per CPU
+int opts_parser_threads() {
+	int count = 1;
+	config_lookup_int(&cfg, "client.parser_threads", &count);
+	return count;
+}
+
 const char *opts_my_domain() {
 	const char *my_domain = "quint.com";
 	config_lookup_string(&cfg, "client.domain", &my_domain);
 	return my_domain;
 }
 
+const char *opts_event_backend() {
+	const char *backend = "epoll";
+	config_lookup_string(&cfg, "client.event_backend", &backend);
+	return backend;
+}
+
+// Empty string means the first nameserver of /etc/resolv.conf
+const char *opts_dns_server() {
+	const char *server = "";
+	config_lookup_string(&cfg, "client.dns_server", &server);
+	return server;
+}
+
+// File, where DNS cache is kept between runs; empty string disables it
+const char *opts_dns_cache() {
+	const char *file = "";
+	config_lookup_string(&cfg, "client.dns_cache", &file);
+	return file;
+}
+
 const char *opts_maildir_root() {
 	const char *root = "../maildir";
 	config_lookup_string(&cfg, "client.maildir", &root);
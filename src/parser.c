@@ -0,0 +1,177 @@
+/**
+ * \file parser.c
+ * \brief Потоки разбора файлов писем
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <parser.h>
+#include <log.h>
+
+static pthread_t *threads;
+static int count;
+
+// Batch of files: parser threads take chunks of it from 'next', main
+// thread takes parsed mail from 'consumed' in the same order
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;	// new batch or stop
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;	// chunk is parsed
+static struct parser_job *jobs;
+static int jobs_count;
+static int next;
+static int consumed;
+static int waiting;		// main thread waits for next job of batch
+static int stop;
+
+
+// Takes chunks of batch and parses their files until pool is stopped
+static void* parser_loop(void *arg) {
+	pthread_mutex_lock(&lock);
+
+	while (1) {
+		while (!stop && next >= jobs_count) {
+			pthread_cond_wait(&work_cond, &lock);
+		}
+
+		if (stop) break;
+
+		struct parser_job *chunk = jobs + next;
+		int n = jobs_count - next < PARSER_CHUNK_SIZE ? jobs_count - next : PARSER_CHUNK_SIZE;
+		next += n;
+
+		pthread_mutex_unlock(&lock);
+
+		for (int i = 0; i < n; ++i) {
+			chunk[i].mail = parse_mail_file(chunk[i].name, &chunk[i].status);
+		}
+
+		pthread_mutex_lock(&lock);
+
+		for (int i = 0; i < n; ++i) {
+			chunk[i].done = 1;
+		}
+
+		if (waiting) pthread_cond_signal(&done_cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+
+// Starts parser threads; 0 means one per CPU. Returns 1 on success
+int parser_start(int n) {
+	if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > PARSER_MAX) n = PARSER_MAX;
+
+	stop = 0;
+	threads = calloc(n, sizeof(*threads));
+
+	for (count = 0; count < n; ++count) {
+		if (pthread_create(&threads[count], 0, parser_loop, 0) != 0) {
+			ELOG("Can't start parser thread %d.", count);
+			parser_stop();
+			return 0;
+		}
+	}
+
+	LOG(GREEN "Started %d parser threads.", n);
+	return 1;
+}
+
+
+// Stops parser threads; mail of batch, which was not taken yet, is freed,
+// its files stay in NEW directory
+void parser_stop() {
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], 0);
+	}
+
+	struct parser_job job;
+	while (consumed < jobs_count) {
+		job = jobs[consumed++];
+		if (job.mail) free_mail(job.mail);
+		free(job.name);
+	}
+
+	free(jobs);
+	jobs = 0;
+	jobs_count = next = consumed = 0;
+
+	free(threads);
+	threads = 0;
+	count = 0;
+}
+
+
+// Returns count of parser threads
+int parser_count() {
+	return count;
+}
+
+
+// Gives batch of files to parser threads and takes over their names;
+// returns 0 if previous batch was not taken yet
+int parser_submit(char **names, int n) {
+	pthread_mutex_lock(&lock);
+
+	if (consumed < jobs_count) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	free(jobs);
+	jobs = calloc(n, sizeof(*jobs));
+
+	for (int i = 0; i < n; ++i) {
+		jobs[i].name = names[i];
+	}
+
+	jobs_count = n;
+	next = consumed = 0;
+
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	return 1;
+}
+
+
+// Returns count of files of batch, which were not taken by parser_next()
+// yet. Called by main thread only
+int parser_pending() {
+	pthread_mutex_lock(&lock);
+	int pending = jobs_count - consumed;
+	pthread_mutex_unlock(&lock);
+
+	return pending;
+}
+
+
+// Takes next file of batch in order of submission, waiting until it is
+// parsed; returns 0 if batch is over. Name of file is given to caller
+int parser_next(struct parser_job *job) {
+	pthread_mutex_lock(&lock);
+
+	if (consumed == jobs_count) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	while (!jobs[consumed].done) {
+		waiting = 1;
+		pthread_cond_wait(&done_cond, &lock);
+		waiting = 0;
+	}
+
+	*job = jobs[consumed++];
+
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
@@ -3,487 +3,1611 @@
  * \brief Файл содержащий структуры и функции для работы по протоколу SMTP
  */ 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <resolv.h>
-#include <netdb.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/sendfile.h>
 
 #include <key-listener.h>
 #include <protocol.h>
+#include <event.h>
+#include <dns.h>
+#include <dns-cache.h>
 #include <regexp.h>
+#include <worker.h>
+#include <parser.h>
+#include <arena.h>
 #include <utils.h>
 #include <opts.h>
 #include <log.h>
 
-#include <sys/poll.h>
 
+// Every delivery thread has its own domains and sessions with their MX
+static __thread struct domain_set *domains;
+static __thread struct mx_conn_list *connections;
+static __thread int connectionsCount;
 
-struct mail_list *mails;
-struct domain_set *domains;
-struct mx_conn_list *connections;
-static int connectionsCount;
+// Domains, sessions and entries of domain queues of this thread are taken
+// from its arena and then reused; arena is released by conn_final()
+static __thread struct arena conn_arena;
+static __thread struct domain_set free_domains;
+static __thread struct mx_conn_list free_conns;
+static __thread struct mail_queue free_queued;
+
+// Mails which were processed by all their domains and wait for their
+// files to be deleted or moved to NOT_SENT directory
+static __thread struct mail_list finished_mails;
+
+// Timeouts of replies expected in every state, ms; while message body is
+// being sent, every sent block rearms data block timeout instead
+static __thread long state_timeout[SMTP_CLIENT_FSM_STATE_CT];
+static __thread long data_block_timeout;
 
 
 /**
  * \fn int smtp_client_loop()
  * \brief Основная функция, которая мониторит директорию с почтой, чтобы ее отправить
+ *
+ * Письма доставляются потоками доставки (worker.h), каждый со своим
+ * conn_loop(); этот поток только раздает им новые письма и удаляет или
+ * переносит файлы писем, с которыми они закончили. Новые письма ставятся
+ * в очереди доменов сразу, не дожидаясь окончания уже идущих сессий.
+ * Файлы писем разбирают потоки разбора (parser.h), большая очередь
+ * раздается частями по мере разбора.
  */
 int smtp_client_loop() {
+	// Unlike send(), sendfile() can't be told not to raise SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!workers_start(opts_workers())) {
+		ELOG("Can't start delivery threads.");
+		return 0;
+	}
+
+	// Without parser threads mail files are parsed by this thread
+	if (!parser_start(opts_parser_threads())) {
+		ELOG("Can't start parser threads, mail files are parsed one by one.");
+	}
+
+	// Without new mail this thread sleeps till workers return finished
+	// mail or 'Q' is pressed
+	int wake_fds[] = { keyboard_listener_fd(), workers_done_fd() };
+
 	while (1) {
 		if (quit_key_pressed()) break;
 
-		int mailcount = new_mail_exist();
+		int mailcount = wait_for_new_mail(-1, wake_fds, 2);
 
-		if (!mailcount) {
-			LOG("No new mail. Sleeping. zzzzzz...");
-			sleep(1);
-		} else {
+		if (mailcount) {
 			LOG("New mail found! [%d]", mailcount);
+			workers_dispatch_new_mail();
+		}
+
+		workers_finish_mail();
+	}
+
+	workers_stop();
+	parser_stop();
+
+	struct arena_stats as = arena_get_stats();
+	LOG("Arenas: %lu released, %lu allocations of %lu bytes in %lu blocks.",
+			as.arenas, as.allocs, as.bytes, as.blocks);
+
+	return 0;
+}
+
+
+// Returns list of finished mails of this thread
+static struct mail_list* finished_list() {
+	if (!finished_mails.tqh_last) TAILQ_INIT(&finished_mails);
+	return &finished_mails;
+}
+
+/**
+ * \fn int conn_init()
+ * \brief Initialize structures for connections with several SMTP servers
+ */
+// Initialize structures for connections with several SMTP servers
+int conn_init() {
+	domains		= calloc(1, sizeof(*domains));
+	connections = calloc(1, sizeof(*connections));
+	
+	connectionsCount = 0;
+	
+	TAILQ_INIT(domains);
+	TAILQ_INIT(connections);
+
+	arena_init(&conn_arena, CONN_ARENA_SIZE);
+	TAILQ_INIT(&free_domains);
+	TAILQ_INIT(&free_conns);
+	TAILQ_INIT(&free_queued);
+
+	TAILQ_INIT(finished_list());
+
+	event_init(opts_event_backend());
+	timer_init(time_ms());
+
+	for (int i = 0; i < SMTP_CLIENT_FSM_STATE_CT; ++i) {
+		state_timeout[i] = opts_connection_timeout() * 1000L;
+	}
+
+	state_timeout[SMTP_CLIENT_FSM_ST_INIT]		= opts_smtp_timeout("banner") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_ENVELOPE]	= opts_smtp_timeout("mail") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_MAILFROM]	= opts_smtp_timeout("mail") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_RCPTTO]	= opts_smtp_timeout("rcpt") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_DATA]		= opts_smtp_timeout("data") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_DATASTR]	= opts_smtp_timeout("data_end") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_BDAT]		= opts_smtp_timeout("data_end") * 1000L;
+	state_timeout[SMTP_CLIENT_FSM_ST_IDLE]		= opts_idle_timeout() * 1000L;
+	data_block_timeout = opts_smtp_timeout("data_block") * 1000L;
+
+	dns_cache_init(opts_dns_cache());
+	dns_init(opts_dns_server(), 0);
+
+	return 1;
+}
+
+
+// Puts mail into queues of its domains, which belong to this thread;
+// returns count of these domains
+int conn_enqueue_mail(struct mail *m) {
+	int count = 0;
+	struct rcpt *r;
+
+	TAILQ_FOREACH(r, &m->rcpts, entry) {
+		if (!worker_owns_domain(domain_id_name(r->domain))) continue;
+
+		struct domain *d = domain_add(domains, r->domain);
+		if (d) {
+			domain_enqueue_mail(d, m);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+
+// Opens sessions for all domains which have queued mail, until every
+// domain has as many sessions as domain_session_target() allows; idle
+// sessions of domain, or idle sessions with same MX, are used first
+void conn_start() {
+	struct domain *d;
+	struct mx_conn *conn;
+	TAILQ_FOREACH(d, domains, entry) {
+		TAILQ_FOREACH(conn, &d->conns, dom_entry) {
+			if (TAILQ_EMPTY(&d->queue)) break;
+			if (conn->state == SMTP_CLIENT_FSM_ST_IDLE) conn_wakeup(conn);
+		}
+
+		if (TAILQ_EMPTY(&d->queue)) continue;
+
+		// Addresses are resolved again when their TTL expires; sessions,
+		// which are open already, are not affected
+		if (d->dns_state == DOMAIN_DNS_NONE ||
+				(d->dns_state == DOMAIN_DNS_READY && time(0) >= d->dns_expires)) {
+			domain_resolve(d);
+		}
+
+		int all_failed = d->dns_state == DOMAIN_DNS_FAILED ||
+				(d->dns_state == DOMAIN_DNS_READY && !domain_mx_alive(d));
+
+		if (all_failed && !d->conn_count) {
+			if (d->dns_state == DOMAIN_DNS_READY) {
+				ELOG("All MX of domain '%s' have failed.", d->name);
+			}
+			domain_fail(d);
+			continue;
+		}
+
+		int target = domain_session_target(d);
+
+		// Sessions are opened as soon as some of best MX have addresses
+		while (d->conn_count < target && !TAILQ_EMPTY(&d->queue)) {
+			struct domain_mx *mx = domain_pick_mx(d);
+			if (!mx) break;
+
+			if ((conn = find_idle_connection(mx->host))) {
+				DLOG(BLUE "Reusing idle session of domain '%s' with MX '%s'.", conn->dom->name, mx->host);
+				TAILQ_REMOVE(&conn->dom->conns, conn, dom_entry);
+				conn->dom->conn_count--;
+				conn->dom = d;
+				TAILQ_INSERT_TAIL(&d->conns, conn, dom_entry);
+				d->conn_count++;
+				conn_wakeup(conn);
+				continue;
+			}
+
+			if (!(conn = create_connection(d, mx))) {
+				// Next session goes to another MX
+				mx->failed = 1;
+				continue;
+			}
+
+			worker_stats()->sessions++;
+			conn_attach(conn);
+		}
+	}
+}
+
+
+// Adds new session to sessions of thread and of its domain
+void conn_attach(struct mx_conn *conn) {
+	TAILQ_INSERT_TAIL(connections, conn, entry);
+	TAILQ_INSERT_TAIL(&conn->dom->conns, conn, dom_entry);
+	conn->dom->conn_count++;
+	++connectionsCount;
+}
+
+
+// Returns idle session with specified MX, or 0 if there are none
+struct mx_conn* find_idle_connection(const char *mx_address) {
+	struct mx_conn *conn;
+	TAILQ_FOREACH(conn, connections, entry) {
+		if (conn->state == SMTP_CLIENT_FSM_ST_IDLE && strcmp(conn->mx, mx_address) == 0) {
+			return conn;
+		}
+	}
+
+	return 0;
+}
+
+
+// Gives next mail of its domain to idle session and resumes it
+void conn_wakeup(struct mx_conn *conn) {
+	conn->m = domain_next_mail(conn->dom);
+	conn->r = TAILQ_FIRST(&conn->m->rcpts);
+	conn->reused = 1;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_NEW_MAIL, conn);
+	conn_rearm(conn);
+}
+
+
+// Returns zeroed session structure, reused one if there is any
+static struct mx_conn* conn_alloc() {
+	struct mx_conn *conn = TAILQ_FIRST(&free_conns);
+
+	if (!conn) return arena_alloc(&conn_arena, sizeof(*conn));
+
+	TAILQ_REMOVE(&free_conns, conn, entry);
+	memset(conn, 0, sizeof(*conn));
+	return conn;
+}
+
+
+// Keeps structure of closed session for reuse
+static void conn_recycle(struct mx_conn *conn) {
+	TAILQ_INSERT_HEAD(&free_conns, conn, entry);
+}
+
+
+// Returns entry of domain queue for mail, reused one if there is any
+static struct queued_mail* queued_alloc(struct mail *m) {
+	struct queued_mail *qm = TAILQ_FIRST(&free_queued);
+
+	if (qm) {
+		TAILQ_REMOVE(&free_queued, qm, entry);
+	} else {
+		qm = arena_alloc(&conn_arena, sizeof(*qm));
+	}
+
+	qm->m = m;
+	return qm;
+}
+
+
+// Keeps entry of domain queue for reuse
+static void queued_recycle(struct queued_mail *qm) {
+	TAILQ_INSERT_HEAD(&free_queued, qm, entry);
+}
+
+
+int free_connection(struct mx_conn *conn) {
+	TAILQ_REMOVE(connections, conn, entry);
+	--connectionsCount;
+
+	// Operations in flight are cancelled before their buffers are freed
+	if (conn->sock >= 0) {
+		event_del(conn->sock);
+		close(conn->sock);
+	}
+
+	if (conn->m) {
+		mail_release(conn->m);
+	}
+
+	TAILQ_REMOVE(&conn->dom->conns, conn, dom_entry);
+	conn->dom->conn_count--;
+	conn_clear_output(conn);
+
+	conn_close_attempts(conn, -1);
+	timer_cancel(&conn->attempt_timer);
+	timer_cancel(&conn->timeout);
+
+	conn_recycle(conn);
+	return 0;
+}
+
+
+// Drops reference of domain to mail, which was not delivered; mail is
+// freed by the last one, and its file stays in NEW directory
+static void mail_drop(struct mail *m) {
+	if (__atomic_sub_fetch(&m->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		free_mail(m);
+	}
+}
+
+
+// Removes domain from set; its structure is kept for reuse
+int free_domain(struct domain_set *domains, struct domain *d) {
+	struct queued_mail *qm;
+	while ((qm = TAILQ_FIRST(&d->queue))) {
+		TAILQ_REMOVE(&d->queue, qm, entry);
+		queued_recycle(qm);
+	}
+
+	TAILQ_REMOVE(domains, d, entry);
+	TAILQ_INSERT_HEAD(&free_domains, d, entry);
+	return 0;
+}
+
+/**
+ * \fn int conn_final()
+ * \brief Frees all structures used in mail transfer
+ */
+// Frees all structures used in mail transfer; mail that was not
+// delivered yet stays in NEW directory
+int conn_final() {
+	struct mx_conn *conn, *conn_tmp;
+	TAILQ_FOREACH_SAFE(conn, connections, entry, conn_tmp) {
+		if (conn->m) mail_drop(conn->m);
+		conn->m = 0;
+		free_connection(conn);
+	}
+
+	struct domain *d, *d_tmp;
+	TAILQ_FOREACH_SAFE(d, domains, entry, d_tmp) {
+		// Mail may be queued by domains of other threads too
+		struct queued_mail *qm;
+		TAILQ_FOREACH(qm, &d->queue, entry) {
+			mail_drop(qm->m);
+		}
+
+		free_domain(domains, d);
+	}
+
+	conn_finish_mail();
+
+	struct dns_cache_stats cs = dns_cache_get_stats();
+	DLOG("DNS cache: %lu hits (%lu negative), %lu misses, %d entries.",
+			cs.hits, cs.negative_hits, cs.misses, cs.entries);
+
+	dns_final();
+	dns_cache_final();
+	event_final();
+
+	free(domains);
+	free(connections);
+
+	arena_release(&conn_arena);
+	TAILQ_INIT(&free_domains);
+	TAILQ_INIT(&free_conns);
+	TAILQ_INIT(&free_queued);
+
+	return 0;
+}
+
+/**
+ * \fn domain_add(struct domain_set *domains, int new_domain)
+ * \brief Adds another domain into domain set if it is not present there and if it is not local domain (MY_DOMAIN in maildir.h)
+ * \param domains -- список доменов куда нужно добавить
+ * \param new_domain -- номер домена для добавления (domain-id.h)
+ * \return домен из списка, или 0 для локального домена
+ */
+// Adds another domain into domain set if it is not present there and
+// if it is not local domain (MY_DOMAIN in maildir.h); returns domain
+struct domain* domain_add(struct domain_set *domains, int new_domain) {
+	if (new_domain == domain_id(opts_my_domain(), strlen(opts_my_domain()))) return 0;
+
+	struct domain *d;
+	TAILQ_FOREACH(d, domains, entry) {
+		if (d->id == new_domain) return d;
+	}
+
+	if ((d = TAILQ_FIRST(&free_domains))) {
+		TAILQ_REMOVE(&free_domains, d, entry);
+		memset(d, 0, sizeof(*d));
+	} else {
+		d = arena_alloc(&conn_arena, sizeof(*d));
+	}
+
+	d->id = new_domain;
+	d->name = domain_id_name(new_domain);
+	TAILQ_INIT(&d->queue);
+	TAILQ_INIT(&d->conns);
+	d->max_conns = opts_max_sessions();
+	TAILQ_INSERT_TAIL(domains, d, entry);
+
+	return d;
+}
+
+
+// Puts mail into queue of domain, if it is not there yet. Mail is queued
+// once when it is read, so it may be there already only as the last one,
+// queued for another recipient of the same domain
+void domain_enqueue_mail(struct domain *d, struct mail *m) {
+	struct queued_mail *qm = TAILQ_LAST(&d->queue, mail_queue);
+	if (qm && qm->m == m) return;
+
+	qm = queued_alloc(m);
+	TAILQ_INSERT_TAIL(&d->queue, qm, entry);
+	d->queued++;
+	__atomic_add_fetch(&m->pending, 1, __ATOMIC_RELAXED);
+}
+
+
+// Puts mail taken by session back to the head of domain queue, so that
+// another session of domain sends it
+void domain_requeue_mail(struct domain *d, struct mail *m) {
+	struct queued_mail *qm = queued_alloc(m);
+	TAILQ_INSERT_HEAD(&d->queue, qm, entry);
+	d->queued++;
+}
+
+
+// Returns count of sessions domain should have: at least min_sessions,
+// one per mails_per_session mails (queued and being sent), and not more
+// than limit of domain
+int domain_session_target(struct domain *d) {
+	int per_session = opts_mails_per_session();
+	int target = (d->queued + d->conn_count + per_session - 1) / per_session;
+
+	if (target < opts_min_sessions()) target = opts_min_sessions();
+	if (target > d->max_conns) target = d->max_conns;
+	if (target < 1) target = 1;
+
+	return target;
+}
+
+
+// Takes next mail from queue of domain; returns 0 if queue is empty
+struct mail* domain_next_mail(struct domain *d) {
+	struct queued_mail *qm = TAILQ_FIRST(&d->queue);
+
+	if (!qm) return 0;
+
+	struct mail *m = qm->m;
+	TAILQ_REMOVE(&d->queue, qm, entry);
+	d->queued--;
+	queued_recycle(qm);
+
+	return m;
+}
+
+
+// Gives up all queued mail of domain (e.g. when MX is unreachable)
+void domain_fail(struct domain *d) {
+	struct mail *m;
+	while ((m = domain_next_mail(d))) {
+		mail_release(m);
+	}
+}
+
+
+// Called when domain has finished with mail (whether it was sent or not);
+// when all domains are done, mail is scheduled for finishing. Domains of
+// mail may belong to different threads
+void mail_release(struct mail *m) {
+	if (__atomic_sub_fetch(&m->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		TAILQ_INSERT_TAIL(finished_list(), m, entry);
+	}
+}
+
+
+// Releases mail of session, which was accepted by server, and takes next
+// one from domain queue, as it may have arrived while session was running;
+// returns 0 if there is no mail
+int conn_next_mail(struct mx_conn *conn) {
+	// We managed to send mail to at least one mailbox
+	conn->m->was_sent = 1;
+	mail_release(conn->m);
+
+	conn->m = domain_next_mail(conn->dom);
+	if (!conn->m) return 0;
+
+	conn->r = TAILQ_FIRST(&conn->m->rcpts);
+	return 1;
+}
+
+
+// Deletes file of mail which was sent to at least one domain, or moves
+// it to NOT_SENT directory; frees mail structure
+void mail_finish(struct mail *m) {
+	if (m->was_sent) {
+		LOG("Mail '%s' was successfully sent. Deleting file from NEW directory.", m->filename);
+		delete_mail(m->filename, DIR_NEW);
+	} else {
+		ELOG("Mail '%s' was not sent. Moving it to NOT_SENT directory.", m->filename);
+		move_mail(m->filename, DIR_NEW, DIR_NOTSENT);
+	}
+
+	free_mail(m);
+}
+
+
+// Finishes all mails released by their domains; delivery threads give
+// them to main thread, which owns files of mail
+void conn_finish_mail() {
+	struct mail_list *list = finished_list();
+	struct mail *m;
+
+	while ((m = TAILQ_FIRST(list))) {
+		TAILQ_REMOVE(list, m, entry);
+
+		if (!worker_self()) {
+			mail_finish(m);
+		} else if (!worker_return_mail(m)) {
+			TAILQ_INSERT_HEAD(list, m, entry);
+			break;
+		}
+	}
+}
+
+
+// Returns 1 if recipient is from specified domain; otherwise 0
+int rcpt_is_from_domain(struct rcpt *r, struct domain *d) {
+	return r->domain == d->id;
+}
+
+
+// Returns 1 if mail has recipient from specified domain; 0 otherwise
+int mail_has_rcpts_from_domain(struct mail *m, struct domain *d) {
+	int ret = 0;
 
-			if (conn_init()) {
-				conn_loop();
-				conn_final();
+	struct rcpt *r;
+	TAILQ_FOREACH(r, &m->rcpts, entry) {
+		if (rcpt_is_from_domain(r, d)) ret = 1;
+	}
+
+	return ret;
+}
+
+
+// Fills socket address for address of MX; returns its length
+static socklen_t make_sockaddr(struct dns_addr *addr, int port, struct sockaddr_storage *sa) {
+	memset(sa, 0, sizeof(*sa));
+
+	if (addr->family == AF_INET6) {
+		struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)sa;
+		sa6->sin6_family = AF_INET6;
+		sa6->sin6_port = htons(port);
+		sa6->sin6_addr = addr->v6;
+		return sizeof(*sa6);
+	}
+
+	struct sockaddr_in *sa4 = (struct sockaddr_in *)sa;
+	sa4->sin_family = AF_INET;
+	sa4->sin_port = htons(port);
+	sa4->sin_addr = addr->v4;
+	return sizeof(*sa4);
+}
+
+
+// Starts non-blocking connect to next address of MX; earlier attempts
+// are left running, and the first one to finish wins (conn_connected()).
+// Returns 0 if there are no more addresses to try
+int conn_connect_next(struct mx_conn *conn) {
+	while (conn->addr_next < conn->addr_count) {
+		struct sockaddr_storage sa;
+		socklen_t sa_len = make_sockaddr(&conn->addrs[conn->addr_next++], conn->port, &sa);
+		int sock = socket(sa.ss_family, SOCK_STREAM, 0);
+
+		if (sock < 0) {
+			ELOG("Can't create a socket.");
+			continue;
+		}
+
+		// Socket stays non-blocking: all output goes through write queue
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+
+		if (connect(sock, (struct sockaddr *)&sa, sa_len) < 0 && errno != EINPROGRESS) {
+			close(sock);
+			continue;
+		}
+
+		conn->attempts[conn->attempt_count++] = sock;
+		conn->connecting = 1;
+		event_add(sock, EVENT_WRITE, conn);
+
+		// Next address joins the race, if this one is slow
+		if (conn->addr_next < conn->addr_count) {
+			timer_set(&conn->attempt_timer, time_ms() + CONNECT_ATTEMPT_DELAY);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+
+// Closes all connect attempts, except specified socket
+void conn_close_attempts(struct mx_conn *conn, int except) {
+	for (int i = 0; i < conn->attempt_count; ++i) {
+		if (conn->attempts[i] == except) continue;
+		event_del(conn->attempts[i]);
+		close(conn->attempts[i]);
+	}
+
+	conn->attempt_count = 0;
+}
+
+
+// Called when some of connect attempts became writable or got an error:
+// the first connected socket becomes socket of session and the rest are
+// closed. Failed attempts are dropped, and next address is tried at once;
+// when nothing is left, connection is invalidated
+void conn_connected(struct mx_conn *conn) {
+	int failed = 0;
+
+	for (int i = 0; i < conn->attempt_count; ++i) {
+		int sock = conn->attempts[i], err = 0;
+		socklen_t len = sizeof(err);
+		struct sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			event_del(sock);
+			close(sock);
+			conn->attempts[i--] = conn->attempts[--conn->attempt_count];
+			failed++;
+			continue;
+		}
+
+		// Socket without peer is still connecting
+		if (getpeername(sock, (struct sockaddr *)&peer, &peer_len) < 0) continue;
+
+		LOG(GREEN "Sucessfully connected to MX '%s'.", conn->mx);
+
+		conn_close_attempts(conn, sock);
+		timer_cancel(&conn->attempt_timer);
+		conn->sock = sock;
+		conn->connecting = 0;
+
+		conn_rearm(conn);
+
+		// With asynchronous I/O socket is not polled: replies are received
+		// by operation, which is always in flight
+		if (event_async()) {
+			event_mod(conn->sock, 0, conn);
+			conn_recv(conn);
+		} else {
+			event_mod(conn->sock, EVENT_READ, conn);
+		}
+
+		return;
+	}
+
+	if (!failed) return;
+
+	DLOG("Couldn't connect to %d of the possible addresses of MX '%s'; trying next one...", failed, conn->mx);
+
+	if (!conn_connect_next(conn) && !conn->attempt_count) {
+		ELOG("Can't connect to MX '%s'.", conn->mx);
+		invalidate_connection(conn);
+	}
+}
+
+
+// Starts next connect attempt, when previous ones are slow
+static void conn_attempt_timeout(struct timer *t, void *arg) {
+	struct mx_conn *conn = arg;
+
+	if (conn->connecting) {
+		DLOG("MX '%s' is slow to connect; trying one more address...", conn->mx);
+		conn_connect_next(conn);
+	}
+}
+
+
+// Expires idle session, or invalidates session, which got no reply in time
+static void conn_timeout(struct timer *t, void *arg) {
+	struct mx_conn *conn = arg;
+
+	if (conn->state == SMTP_CLIENT_FSM_ST_IDLE) {
+		conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_EXPIRE, conn);
+		conn_rearm(conn);
+	} else if (conn->connecting) {
+		ELOG("Can't connect to MX '%s' in time.", conn->mx);
+		invalidate_connection(conn);
+	} else {
+		ELOG("Timeout for connection with domain '%s'.", conn->dom->name);
+		invalidate_connection(conn);
+	}
+}
+
+
+// Prepares timers of connection; they are armed while it is connected
+void conn_setup_timers(struct mx_conn *conn) {
+	timer_setup(&conn->attempt_timer, conn_attempt_timeout, conn);
+	timer_setup(&conn->timeout, conn_timeout, conn);
+}
+
+
+// Arms timeout for reply, which is expected in current state of
+// connection; called on every reply and state change
+void conn_rearm(struct mx_conn *conn) {
+	if (conn->state == SMTP_CLIENT_FSM_ST_DONE || conn->state == SMTP_CLIENT_FSM_ST_INVALID) {
+		timer_cancel(&conn->timeout);
+		return;
+	}
+
+	long timeout = state_timeout[conn->state];
+
+	if ((conn->state == SMTP_CLIENT_FSM_ST_DATASTR || conn->state == SMTP_CLIENT_FSM_ST_BDAT)
+			&& conn->out_bytes) {
+		timeout = data_block_timeout;
+	}
+
+	timer_set(&conn->timeout, time_ms() + timeout);
+}
+
+
+// Orders addresses for connect attempts: IPv6 and IPv4 take turns,
+// starting with IPv6 (RFC 8305); returns count of addresses
+static int interleave_addrs(const struct dns_addr *addrs, int count, struct dns_addr *out) {
+	int v6 = 0, v4 = 0, n = 0;
+
+	while (n < count) {
+		while (v6 < count && addrs[v6].family != AF_INET6) v6++;
+		if (v6 < count) out[n++] = addrs[v6++];
+
+		while (v4 < count && addrs[v4].family != AF_INET) v4++;
+		if (v4 < count && n < count) out[n++] = addrs[v4++];
+	}
+
+	return n;
+}
+
+
+// Starts connecting to MX of specified domain, which addresses are
+// resolved already; returns 0 on failure, or a pointer to mx_conn
+// structure, which is connected in event loop
+struct mx_conn* create_connection(struct domain *dom, struct domain_mx *mx) {
+	LOG(BLUE "Connecting to MX '%s' on domain '%s'.", mx->host, dom->name);
+
+	struct mx_conn *conn = conn_alloc();
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->sock = -1;
+	conn->dom = dom;
+	strcpy(conn->mx, mx->host);
+	conn->addr_count = interleave_addrs(mx->addrs, mx->addr_count, conn->addrs);
+	conn->port = opts_mx_port();
+	TAILQ_INIT(&conn->out);
+	conn_setup_timers(conn);
+
+	if (!conn_connect_next(conn)) {
+		ELOG("Can't connect to MX '%s'.", conn->mx);
+		timer_cancel(&conn->attempt_timer);
+		conn_recycle(conn);
+		return 0;
+	}
+
+	// Whole race of connect attempts is limited by connection timeout
+	timer_set(&conn->timeout, time_ms() + opts_connection_timeout() * 1000L);
+
+	conn->m = domain_next_mail(dom);
+
+	conn->r = TAILQ_FIRST(&conn->m->rcpts);
+
+	while (!rcpt_is_from_domain(conn->r, dom)) {
+		conn->r = TAILQ_NEXT(conn->r, entry);
+	}
+
+	return conn;
+}
+
+
+// Starts resolving MX of domain; its sessions are opened when addresses
+// of MX are known
+void domain_resolve(struct domain *d) {
+	LOG(BLUE "Making DNS request for MX entries for domain '%s'.", d->name);
+
+	d->dns_state = DOMAIN_DNS_MX;
+	d->dns_expires = 0;
+	d->dns_pending++;
+	dns_resolve(d->name, DNS_T_MX, domain_mx_resolved, d);
+}
+
+
+// Keeps all MX of domain ordered by preference; MX with equal preference
+// are shuffled, so that load is spread over them. Addresses of all MX are
+// resolved at once
+void domain_mx_resolved(void *arg, const char *name, const struct dns_result *res) {
+	struct domain *d = arg;
+	d->dns_pending--;
+
+	if (res->status != DNS_OK) {
+		ELOG("No MX entries in DNS response for domain '%s'.", d->name);
+		d->dns_state = DOMAIN_DNS_FAILED;
+		return;
+	}
+
+	int order[DNS_MAX_RECORDS];
+	for (int i = 0; i < res->count; ++i) {
+		DLOG("DNS MX entry for domain '%s': prio=%d, addr='%s'.", d->name, res->mx[i].pref, res->mx[i].host);
+		order[i] = i;
+	}
+
+	// Shuffle, then stable sort by preference
+	for (int i = res->count - 1; i > 0; --i) {
+		int j = rand() % (i + 1), tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (int i = 1; i < res->count; ++i) {
+		int k = order[i], j = i - 1;
+		for (; j >= 0 && res->mx[order[j]].pref > res->mx[k].pref; --j) {
+			order[j + 1] = order[j];
+		}
+		order[j + 1] = k;
+	}
+
+	LOG(BLUE "Best DNS entry for domain '%s': '%s'[%d].", d->name, res->mx[order[0]].host, res->mx[order[0]].pref);
+
+	memset(d->mxs, 0, sizeof(d->mxs));
+	d->mx_count = res->count;
+	d->mx_next = 0;
+	d->dns_expires = time(0) + res->ttl;
+	d->dns_state = DOMAIN_DNS_ADDR;
+
+	// Pending counters are set before queries, as answers may be cached
+	for (int i = 0; i < d->mx_count; ++i) {
+		struct domain_mx *mx = &d->mxs[i];
+		strcpy(mx->host, res->mx[order[i]].host);
+		mx->pref = res->mx[order[i]].pref;
+		mx->dom = d;
+		mx->pending = 2;
+		d->dns_pending += 2;
+	}
+
+	for (int i = 0; i < d->mx_count; ++i) {
+		dns_resolve(d->mxs[i].host, DNS_T_AAAA, domain_addr_resolved, &d->mxs[i]);
+		dns_resolve(d->mxs[i].host, DNS_T_A, domain_addr_resolved, &d->mxs[i]);
+	}
+}
+
+
+// Collects addresses of MX, IPv6 addresses go first; when all queries
+// of domain are done, it is ready (or failed, if no MX has addresses)
+void domain_addr_resolved(void *arg, const char *name, const struct dns_result *res) {
+	struct domain_mx *mx = arg;
+	struct domain *d = mx->dom;
+	mx->pending--;
+	d->dns_pending--;
+
+	if (res->status == DNS_OK && time(0) + res->ttl < d->dns_expires) {
+		d->dns_expires = time(0) + res->ttl;
+	}
+
+	for (int i = 0; i < res->count && mx->addr_count < MX_MAX_ADDRS; ++i) {
+		int pos = mx->addr_count;
+
+		if (res->addr[i].family == AF_INET6) {
+			for (pos = 0; pos < mx->addr_count && mx->addrs[pos].family == AF_INET6; ++pos);
+			memmove(mx->addrs + pos + 1, mx->addrs + pos, (mx->addr_count - pos) * sizeof(*mx->addrs));
+		}
+
+		mx->addrs[pos] = res->addr[i];
+		mx->addr_count++;
+	}
+
+	if (!mx->pending && !mx->addr_count) {
+		ELOG("Can't get address info about MX '%s'.", mx->host);
+		mx->failed = 1;
+	}
+
+	if (d->dns_pending) return;
+
+	d->dns_state = domain_mx_alive(d) ? DOMAIN_DNS_READY : DOMAIN_DNS_FAILED;
+}
+
+
+// Returns count of MX of domain, which are not known to be failed
+int domain_mx_alive(struct domain *d) {
+	int alive = 0;
+
+	for (int i = 0; i < d->mx_count; ++i) {
+		if (!d->mxs[i].failed) alive++;
+	}
+
+	return alive;
+}
+
+
+// Returns MX for next session of domain: MX with best preference among
+// not failed ones are taken in turn. Returns 0 if addresses of these MX
+// are not resolved yet
+struct domain_mx* domain_pick_mx(struct domain *d) {
+	if (d->dns_state != DOMAIN_DNS_ADDR && d->dns_state != DOMAIN_DNS_READY) return 0;
+
+	int best = -1;
+	for (int i = 0; i < d->mx_count && best < 0; ++i) {
+		if (!d->mxs[i].failed) best = d->mxs[i].pref;
+	}
+
+	for (int k = 0; k < d->mx_count; ++k) {
+		int i = (d->mx_next + k) % d->mx_count;
+		struct domain_mx *mx = &d->mxs[i];
+
+		if (mx->failed || mx->pref != best || !mx->addr_count) continue;
+
+		// Wait for all addresses, if some of them are still resolved
+		if (mx->pending) continue;
+
+		d->mx_next = i + 1;
+		return mx;
+	}
+
+	return 0;
+}
+
+
+// Returns MX of domain with specified host name, or 0
+struct domain_mx* domain_find_mx(struct domain *d, const char *host) {
+	for (int i = 0; i < d->mx_count; ++i) {
+		if (!strcmp(d->mxs[i].host, host)) return &d->mxs[i];
+	}
+
+	return 0;
+}
+
+
+// One round of connections state machine: opens connections for domains
+// with queued mail, waits for responses and removes finished connections
+void conn_loop() {
+	// Wheel of timers catches up with time, while there are no connections
+	timer_run(time_ms());
+
+	conn_start();
+
+	int had_connections = !TAILQ_EMPTY(connections);
+
+	// New mail from main thread wakes loop, even without connections
+	wait_for_response();
+	timer_run(time_ms());
+	dns_check_timeouts();
+
+	struct mx_conn *conn, *conn_tmp;
+	TAILQ_FOREACH_SAFE(conn, connections, entry, conn_tmp) {
+		int remove = 0;
+
+		if (conn->out_error) {
+			invalidate_connection(conn);
+		}
+
+		if (conn->state == SMTP_CLIENT_FSM_ST_DONE) {
+			LOG(GREEN "All mail for domain '%s' was successfully sent!", conn->dom->name);
+			remove = 1;
+		}
+
+		if (conn->state == SMTP_CLIENT_FSM_ST_INVALID && (!conn->m || conn->reused)) {
+			// Session was closed while idle or quitting, or right after it was
+			// woken up; it was not MX of domain who refused mail
+			DLOG(BLUE "Session with domain '%s' was closed without mail in progress.", conn->dom->name);
+
+			if (conn->m) {
+				domain_requeue_mail(conn->dom, conn->m);
+				conn->m = 0;
+			}
+
+			remove = 1;
+		} else if (conn->state == SMTP_CLIENT_FSM_ST_INVALID && !conn->greeted) {
+			// MX can't be connected or has refused session; its mail is left
+			// to other sessions, or to next MX
+			int same = 0, greeted = 0;
+			struct mx_conn *other;
+			TAILQ_FOREACH(other, &conn->dom->conns, dom_entry) {
+				if (other == conn || strcmp(other->mx, conn->mx)) continue;
+				same++;
+				greeted += other->greeted;
+			}
+
+			if (greeted) {
+				LOG(BLUE "MX of domain '%s' refused session %d; limiting domain to %d sessions.",
+						conn->dom->name, conn->dom->conn_count, conn->dom->conn_count - 1);
+				conn->dom->max_conns = conn->dom->conn_count - 1;
+			} else if (!same) {
+				struct domain_mx *mx = domain_find_mx(conn->dom, conn->mx);
+				if (mx) mx->failed = 1;
+
+				ELOG("MX '%s' of domain '%s' has failed; %d MX left.",
+						conn->mx, conn->dom->name, domain_mx_alive(conn->dom));
 			}
+
+			if (conn->m) {
+				domain_requeue_mail(conn->dom, conn->m);
+				conn->m = 0;
+			}
+
+			remove = 1;
+		} else if (conn->state == SMTP_CLIENT_FSM_ST_INVALID) {
+			ELOG("Connection with domain '%s' was marked as invalid. Aborting mail transfer.", conn->dom->name);
+			domain_fail(conn->dom);
+			remove = 1;
+		}
+
+		if (remove) {
+			free_connection(conn);
+		}
+	}
+
+	if (had_connections && TAILQ_EMPTY(connections)) {
+		LOG(GREEN "All connections were finished. Waiting for another mail...");
+	}
+
+	conn_finish_mail();
+
+	struct domain *d, *d_tmp;
+	TAILQ_FOREACH_SAFE(d, domains, entry, d_tmp) {
+		if (!d->conn_count && TAILQ_EMPTY(&d->queue) && !d->dns_pending) {
+			free_domain(domains, d);
 		}
 	}
+}
+
+
+// Finds first complete reply in buffer: one or more CRLF-terminated lines,
+// where all lines except the last one are continuations ("250-...");
+// returns its length and offset of its last line, or 0 if reply is not
+// complete yet
+int reply_frame(const char *buf, int length, int *last_line) {
+	int line = 0;
+
+	while (line < length) {
+		const char *eol = memchr(buf + line, '\n', length - line);
+
+		if (!eol) return 0;
+
+		int next = eol - buf + 1;
+
+		if (next - line < 5 || buf[line + 3] != '-') {
+			if (last_line) *last_line = line;
+			return next;
+		}
+
+		line = next;
+	}
+
+	return 0;
+}
+
+
+// Parses response from MX server and activates state machine; for
+// multiline replies reply code is taken from the last line
+int parse_response(struct mx_conn *conn, char *str, int length) {
+	te_smtp_client_fsm_event event;
+	int last = 0;
+
+	if (!reply_frame(str, length, &last)) {
+		last = 0;
+	}
+
+	switch (re_match_any(str + last, length - last)) {
+		case r220: 	event = SMTP_CLIENT_FSM_EV_R220;	break;
+		case r221:	event = SMTP_CLIENT_FSM_EV_R221;	break;
+		case r250:	event = SMTP_CLIENT_FSM_EV_R250;	break;
+		case r354:	event = SMTP_CLIENT_FSM_EV_R354;	break;
+		case r5xx:	event = SMTP_CLIENT_FSM_EV_R5XX;
+					// Rejected EHLO is expected from old servers
+					if (conn->state != SMTP_CLIENT_FSM_ST_EHLO) {
+						ELOG(BLUE "[%s] " RED "Command was rejected: '%s'.",
+								conn->dom->name,
+								str_without_new_line(str + last, length - last)
+						);
+					}
+					break;
+		default:	event = SMTP_CLIENT_FSM_EV_INVALID;
+					ELOG(BLUE "[%s] " RED "Received unexpected message: '%s'.",
+							conn->dom->name,
+							str_without_new_line(str, length)
+					);
+					break;
+	}
+
+	if (conn->state == SMTP_CLIENT_FSM_ST_INIT && event == SMTP_CLIENT_FSM_EV_R220) {
+		conn->greeted = 1;
+	}
+
+	if (conn->state == SMTP_CLIENT_FSM_ST_EHLO && event == SMTP_CLIENT_FSM_EV_R250) {
+		conn->caps = ehlo_capabilities(str, length);
+	}
+
+	conn->state = smtp_client_fsm_step(conn->state, event, conn);
+	conn_rearm(conn);
 
 	return 0;
 }
 
-/**
- * \fn int conn_init()
- * \brief Initialize structures for connections with several SMTP servers
- */
-// Initialize structures for connections with several SMTP servers
-int conn_init() {
-	mails		= calloc(1, sizeof(*mails));
-	domains		= calloc(1, sizeof(*domains));
-	connections = calloc(1, sizeof(*connections));
-	
-	connectionsCount = 0;
-	
-	TAILQ_INIT(mails);
-	TAILQ_INIT(domains);
-	TAILQ_INIT(connections);
 
-	if (!read_all_mail(mails)) {
-		ELOG("Can't read mail, aborting mail transfer.");
-		return 0;
-	}
+// Returns SMTP_CAP_* flags for extensions listed in EHLO reply; every
+// line of reply is '250-KEYWORD params' or '250 KEYWORD params'
+int ehlo_capabilities(const char *str, int length) {
+	int caps = 0;
+	const char *end = str + length;
 
-	struct mail *m;
-	struct rcpt *r;
-	TAILQ_FOREACH(m, mails, entry) {
-		TAILQ_FOREACH(r, &m->rcpts, entry) {
-			domain_add(domains, r->domain);
+	while (str < end) {
+		const char *eol = memchr(str, '\n', end - str);
+		if (!eol) eol = end;
+
+		// Skipping reply code and separator
+		const char *kw = str + 4;
+		int kw_length = eol - kw;
+		while (kw_length > 0 && (kw[kw_length - 1] == '\r' || kw[kw_length - 1] == ' ')) kw_length--;
+
+		if (kw_length >= 10 && !strncasecmp(kw, "PIPELINING", 10) &&
+				(kw_length == 10 || kw[10] == ' ')) {
+			caps |= SMTP_CAP_PIPELINING;
 		}
-	}
 
-	struct domain *d;
-	struct mx_conn *conn;
-	TAILQ_FOREACH(d, domains, entry) {
-		if ((conn = create_connection(d))) {
-			TAILQ_INSERT_TAIL(connections, conn, entry);
-			++connectionsCount;
+		if (kw_length >= 8 && !strncasecmp(kw, "CHUNKING", 8) &&
+				(kw_length == 8 || kw[8] == ' ')) {
+			caps |= SMTP_CAP_CHUNKING;
 		}
+
+		str = eol + 1;
 	}
 
-	return 1;
-}
+	if (!opts_pipelining()) {
+		caps &= ~SMTP_CAP_PIPELINING;
+	}
 
+	if (!opts_chunking()) {
+		caps &= ~SMTP_CAP_CHUNKING;
+	}
 
-int free_connection(struct mx_conn *conn) {
-	TAILQ_REMOVE(connections, conn, entry);
-	close(conn->sock);
-	free(conn);
-	return 0;
+	return caps;
 }
 
 
-int free_domain(struct domain *d) {
-	TAILQ_REMOVE(domains, d, entry);
-	free(d);
-	return 0;
+// Marks connections as invalid
+void invalidate_connection(struct mx_conn *conn) {
+	conn->state = SMTP_CLIENT_FSM_ST_INVALID;
 }
 
-/**
- * \fn int conn_final()
- * \brief Frees all structures used in mail transfer
- */
-// Frees all structures used in mail transfer
-int conn_final() {
-	struct mx_conn *conn, *conn_tmp;
-	TAILQ_FOREACH_SAFE(conn, connections, entry, conn_tmp) {
-		free_connection(conn);
-	}
 
-	struct domain *d, *d_tmp;
-	TAILQ_FOREACH_SAFE(d, domains, entry, d_tmp) {
-		free_domain(d);
-	}
+// Makes room for more data at the end of reply buffer; returns 0 if
+// buffer is full of one incomplete reply
+static int reply_buf_room(struct mx_conn *conn) {
+	struct reply_buf *in = &conn->in;
 
-	free(domains);
-	free(connections);
-	free_mail_list(mails);
+	if (in->end == REPLY_BUF_SIZE) {
+		if (in->start == 0) {
+			ELOG("Too long reply from MX '%s'.", conn->dom->name);
+			invalidate_connection(conn);
+			return 0;
+		}
 
-	return 0;
+		memmove(in->data, in->data + in->start, in->end - in->start);
+		in->end -= in->start;
+		in->start = 0;
+	}
+
+	return 1;
 }
 
-/**
- * \fn domain_add(struct domain_set *domains, char *new_domain_name)
- * \brief Adds another domain into domain set if it is not present there and if it is not local domain (MY_DOMAIN in maildir.h)
- * \param domains -- список доменов куда нужно добавить
- * \param new_domain_name -- имя домена для добавления
- */
-// Adds another domain into domain set if it is not present there and
-// if it is not local domain (MY_DOMAIN in maildir.h)
-void domain_add(struct domain_set *domains, char *new_domain_name) {
-	int exist = 0;
 
-	if (strcmp(new_domain_name, opts_my_domain()) == 0) return;
+// Reads data from MX into connection buffer and advances its state machine
+// once per every complete reply; returns count of handled replies, or 0
+// if connection failed
+int read_response(struct mx_conn *conn) {
+	if (!reply_buf_room(conn)) return 0;
 
-	struct domain *d;
-	TAILQ_FOREACH(d, domains, entry) {
-		if (strcmp(d->name, new_domain_name) == 0) exist = 1;
-	}
+	struct reply_buf *in = &conn->in;
+	int res = recv(conn->sock, in->data + in->end, REPLY_BUF_SIZE - in->end, 0);
 
-	if (!exist) {
-		d = malloc(sizeof(*d));
-		strcpy(d->name, new_domain_name);
-		TAILQ_INSERT_TAIL(domains, d, entry);
+	if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
 	}
+
+	return conn_received(conn, res < 0 ? -errno : res);
 }
 
 
-// Returns 1 if recipient is from specified domain; otherwise 0
-int rcpt_is_from_domain(struct rcpt *r, struct domain *d) {
-	return strcmp(r->domain, d->name) == 0;
+// Queues asynchronous receiving into connection buffer; its result is
+// handled by conn_received()
+int conn_recv(struct mx_conn *conn) {
+	if (!reply_buf_room(conn)) return 0;
+
+	struct reply_buf *in = &conn->in;
+	return event_recv(conn->sock, in->data + in->end, REPLY_BUF_SIZE - in->end);
 }
 
 
-// Returns 1 if mail has recipient from specified domain; 0 otherwise
-int mail_has_rcpts_from_domain(struct mail *m, struct domain *d) {
-	int ret = 0;
+// Handles 'res' bytes received at the end of connection buffer (or -errno)
+// and advances state machine once per every complete reply; returns
+// count of handled replies, or 0 if connection failed
+int conn_received(struct mx_conn *conn, int res) {
+	struct reply_buf *in = &conn->in;
 
-	struct rcpt *r;
-	TAILQ_FOREACH(r, &m->rcpts, entry) {
-		if (rcpt_is_from_domain(r, d)) ret = 1;
+	if (res < 0) {
+		ELOG("Can't recieve any data from MX '%s'.", conn->dom->name);
+		invalidate_connection(conn);
+		return 0;
+	} else if (res == 0) {
+		ELOG("MX '%s' disconnected.", conn->dom->name);
+		invalidate_connection(conn);
+		return 0;
 	}
 
-	return ret;
+	DLOG(BLUE "[%s] " MAGENTA "recv [%d]: >%s",
+			conn->dom->name,
+			res,
+			str_without_new_line(in->data + in->end, res)
+	);
+
+	in->end += res;
+
+	int handled = 0, length;
+	while (conn->state != SMTP_CLIENT_FSM_ST_INVALID
+			&& (length = reply_frame(in->data + in->start, in->end - in->start, 0))) {
+		parse_response(conn, in->data + in->start, length);
+		in->start += length;
+		handled++;
+	}
+
+	if (in->start == in->end) {
+		in->start = in->end = 0;
+	}
+
+	return handled;
 }
 
 
-// Tries to connect to remote host with timeout; returns 0 on failure,
-// or returns socket on success.
-int connect_with_timeout(int sock, struct addrinfo *addr, int ms) {
-	struct pollfd fd[1];
-	fd[0].fd = sock;
-	fd[0].events = POLLOUT;
-	
-	fcntl(sock, F_SETFL, O_NONBLOCK);
+// Waiting for responses from SMTP servers and handles all of them that
+// are ready at once; returns count of handled responses
+int wait_for_response() {
+	struct event evs[connectionsCount + 1];
+	struct mx_conn *conn;
+	int timeout = 1000;
 
-	if (connect(sock, addr->ai_addr, addr->ai_addrlen) < 0) {
-		if (errno != EINPROGRESS || poll(fd, 1, ms) <= 0) {
-			return 0;
-		}
+	// Wait is not longer than till the closest timer or DNS timeout
+	int timer_timeout = timer_next_timeout(time_ms());
+	if (timer_timeout >= 0 && timer_timeout < timeout) {
+		timeout = timer_timeout;
 	}
 
-	fcntl(sock, F_SETFL, !O_NONBLOCK);
+	int dns_timeout = dns_next_timeout();
+	if (dns_timeout >= 0 && dns_timeout < timeout) {
+		timeout = dns_timeout;
+	}
 
-	return sock;
-}
+	int res = event_wait(evs, connectionsCount + 1, timeout);
+
+	if (res == -1) {
+		ELOG("Can't wait for events on multiple connections.");
+		return 0;
+	} else if (res == 0) {
+		DLOG(MAGENTA "Timeout, no responses from any of connections.");
+		return 0;
+	}
 
+	int handled = 0;
 
-// Tries to connect to any possible IPs of specified host; returns 0 on
-// failure, or socket on success
-int connect_to_any_with_timeout(struct addrinfo *info, int ms) {
-	int sock;
-	struct addrinfo *addr;
+	for (int i = 0; i < res; ++i) {
+		if (!evs[i].data) continue;
 
-	for (addr = info; addr != NULL; addr = addr->ai_next) {
-		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		// New mail from main thread is queued before sessions are handled
+		if (evs[i].data == worker_self()) {
+			worker_receive_mail();
+			continue;
+		}
 
-		if (sock < 0) {
-			ELOG("Can't create a socket.");
+		if (evs[i].data == dns_event_data()) {
+			dns_process();
 			continue;
 		}
 
-		if (!connect_with_timeout(sock, addr, ms)) {
-			close(sock);
-			DLOG("Couldn't connect to one of the possible addresses: '%s'; trying next one...", addr->ai_canonname);
+		conn = evs[i].data;
+
+		if (conn->connecting) {
+			conn_connected(conn);
 			continue;
 		}
 
-		break;
-	}
+		if (evs[i].events & EVENT_WRITE) {
+			conn_flush(conn);
+		}
 
-	if (addr == NULL) {
-		return 0;
+		if (evs[i].events & (EVENT_READ | EVENT_ERROR)) {
+			handled += read_response(conn);
+		}
+
+		if (evs[i].events & EVENT_SEND) {
+			conn_sent(conn, evs[i].send_res);
+		}
+
+		// Next receiving is queued at once, so that it is submitted
+		// together with other operations of this round
+		if (evs[i].events & EVENT_RECV) {
+			if (evs[i].recv_res != -EAGAIN) {
+				handled += conn_received(conn, evs[i].recv_res);
+			}
+
+			if (conn->state != SMTP_CLIENT_FSM_ST_INVALID) {
+				conn_recv(conn);
+			}
+		}
 	}
 
-	DLOG("Sucessfully connected to one of the possible addresses: '%s'.", addr->ai_canonname);
+	event_count_handled(handled);
 
-	return sock;
+	return handled;
 }
 
 
-// Tries to establish connection with MX from specified domain; returns
-// 0 on failure, or a pointer to mx_conn structure on success
-struct mx_conn* create_connection(struct domain *dom) {
-	LOG(BLUE "Connecting to MX on domain '%s'.", dom->name);
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Below are functions, used to buffer output to external
+ * SMTP servers;
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-	char mx_address[200];
-	if (!check_dns(dom->name, mx_address)) {
-		return 0;
-	}
+// Frees chunk of output and its data
+static void chunk_free(struct out_chunk *c) {
+	if (c->owned) free(c->data);
+	if (c->file) out_file_release(c->file);
+	free(c);
+}
 
-	struct addrinfo hints, *servinfo;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
 
-	char mx_port[5];
-	sprintf(mx_port, "%d", opts_mx_port());
+// Wraps descriptor of file, which is sent in several chunks; its only
+// reference is given to caller. Descriptor is closed on failure
+struct out_file* out_file_open(int fd) {
+	struct out_file *f = malloc(sizeof(*f));
 
-	if (getaddrinfo(mx_address, "25", &hints, &servinfo) != 0) {
-		ELOG("Can't get address info about MX '%s'.", mx_address);
+	if (!f) {
+		close(fd);
 		return 0;
 	}
 
-	int sock = connect_to_any_with_timeout(servinfo, 500);
+	f->fd = fd;
+	f->refs = 1;
+	return f;
+}
 
-	freeaddrinfo(servinfo);
 
-	if (!sock) {
-		ELOG("Can't connect to MX '%s'.", mx_address);
-		return 0;
-	} else {
-		LOG(GREEN "Sucessfully connected to MX '%s'.", mx_address);
-	}
+// Drops reference to file; the last one closes it
+void out_file_release(struct out_file *f) {
+	if (--f->refs > 0) return;
+
+	close(f->fd);
+	free(f);
+}
 
-	struct mx_conn *conn = malloc(sizeof(*conn));
-	conn->state = SMTP_CLIENT_FSM_ST_INIT;
-	conn->time_of_last_response = time(0);
-	conn->sock = sock;
-	conn->dom = dom;
 
-	conn->m = TAILQ_FIRST(mails);
-	while (!mail_has_rcpts_from_domain(conn->m, dom)) {
-		conn->m = TAILQ_NEXT(conn->m, entry);
+// Sends not yet sent part of chunk right away; data of file is sent by
+// sendfile(), without copying it into memory of process
+static int chunk_send(struct mx_conn *conn, struct out_chunk *c) {
+	if (!c->file) {
+		return send(conn->sock, c->data + c->offset, c->length - c->offset, MSG_NOSIGNAL);
 	}
 
-	conn->r = TAILQ_FIRST(&conn->m->rcpts);
-	while (!rcpt_is_from_domain(conn->r, dom)) {
-		conn->r = TAILQ_NEXT(conn->r, entry);
+	off_t offset = c->file_offset + c->offset;
+	int sent = sendfile(conn->sock, c->file->fd, &offset, c->length - c->offset);
+
+	// File was truncated after it was read
+	if (sent == 0) {
+		errno = EIO;
+		return -1;
 	}
 
-	return conn;
+	return sent;
 }
 
 
-// Returns address of MX server for given domain in 'output address'
-int check_dns(char *d, char *output_address) {
-	u_char nsbuf[4096];
-	char dispbuf[4096];
-	ns_msg msg;
-	ns_rr rr;
+// Accounts 'sent' bytes of first chunk and frees it, when it is sent
+static void chunk_sent(struct mx_conn *conn, struct out_chunk *c, int sent) {
+	c->offset += sent;
+	conn->out_bytes -= sent;
+
+	// Every block of message body gets its own timeout
+	if (conn->state == SMTP_CLIENT_FSM_ST_DATASTR || conn->state == SMTP_CLIENT_FSM_ST_BDAT) {
+		conn_rearm(conn);
+	}
 
-	LOG(BLUE "Making DNS request for MX entries for domain '%s'.", d);
+	if (c->offset < c->length) return;
 
-	int l = res_query(d, ns_c_any, ns_t_mx, nsbuf, sizeof(nsbuf));
+	TAILQ_REMOVE(&conn->out, c, entry);
+	chunk_free(c);
+}
 
-	if (l < 0) {
-		ELOG("Couldn't make DNS request. Code: %d.", l);
-		return 0;
-	}
 
-	int prio, prio_best = 999999;
-	char prio_str[10];
-	char dns_addr[200], dns_addr_best[200];
+// Sends queued data by asynchronous operations, one chunk at a time,
+// unless sending is in progress already. sendfile() has no asynchronous
+// counterpart, so data of file is sent right away, while socket accepts
+// it, and then after socket becomes writable
+static void conn_send_next(struct mx_conn *conn) {
+	struct out_chunk *c = 0;
 
-	ns_initparse(nsbuf, l, &msg);
-	l = ns_msg_count(msg, ns_s_an);
+	while (!conn->sending && (c = TAILQ_FIRST(&conn->out))) {
+		if (!c->file) {
+			if (!event_send(conn->sock, c->data + c->offset, c->length - c->offset)) break;
 
-	for (int i = 0; i < l; ++i) {
-		int matches = 0;
-		ns_parserr(&msg, ns_s_an, i, &rr);
-		ns_sprintrr(&msg, &rr, NULL, NULL, dispbuf, sizeof(dispbuf));
+			conn->sending = 1;
+			event_mod(conn->sock, 0, conn);
+			return;
+		}
 
-		matches |= re_match_and_fill_substring(RE_mx_dns, dispbuf, strlen(dispbuf), dns_addr);
-		matches |= re_match_and_fill_substring(RE_mx_dns_prio, dispbuf, strlen(dispbuf), prio_str);
+		int sent = chunk_send(conn, c);
 
-		if (matches) {
-			prio = (int)strtol(prio_str, 0, 10);
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) break;
 
-			if (prio < prio_best) {
-				prio_best = prio;
-				strcpy(dns_addr_best, dns_addr);
-			}
+		if (sent > 0) chunk_sent(conn, c, sent);
 
-			DLOG("DNS MX entry '%s' matches, prio=%d, addr='%s'.", dispbuf, prio, dns_addr);
+		if (TAILQ_FIRST(&conn->out) == c) {
+			event_mod(conn->sock, EVENT_WRITE, conn);
+			return;
 		}
 	}
 
-	if (prio_best < 999999) {
-		LOG(BLUE "Best DNS entry for domain '%s': '%s'[%d].", d, dns_addr_best, prio_best);
-		strcpy(output_address, dns_addr_best);
-		return 1;
-	} else {
-		ELOG("No MX entries in DNS response for domain '%s'.", d);
-		output_address[0] = '\0';
-		return 0;
+	if (c) {
+		ELOG("Can't send data to MX '%s'.", conn->dom->name);
+		conn->out_error = 1;
 	}
-}
 
+	event_mod(conn->sock, 0, conn);
+}
 
-// Returns mx_conn struct for given socket; 0 if it is not present
-struct mx_conn* get_conn_by_socket(struct mx_conn_list *cl, int sock) {
-	struct mx_conn *conn, *rc = 0;
 
-	TAILQ_FOREACH(conn, cl, entry) {
-		if (conn->sock == sock) rc = conn;
-	}
+// Appends chunk to output queue; if queue was empty, starts sending
+static void conn_queue_chunk(struct mx_conn *conn, struct out_chunk *c) {
+	int idle = TAILQ_EMPTY(&conn->out);
 
-	if (!rc) DLOG("Warning: connection by socket not found.");
+	TAILQ_INSERT_TAIL(&conn->out, c, entry);
+	conn->out_bytes += c->length - c->offset;
 
-	return rc;
+	if (event_async()) {
+		conn_send_next(conn);
+	} else if (idle) {
+		conn_flush(conn);
+	}
 }
 
 
-// Loop for connections state machine
-void conn_loop() {
-	while (!TAILQ_EMPTY(connections)) {
-		wait_for_response();
-
-		struct mx_conn *conn, *conn_tmp;
-		TAILQ_FOREACH_SAFE(conn, connections, entry, conn_tmp) {
-			int remove = 0;
+// Queues data for sending to MX and tries to send as much as possible
+// right away; rest of data is sent by conn_flush() when socket becomes
+// writable. With asynchronous I/O all data is queued and sent by
+// operations, which are submitted together in next event_wait().
+// If 'copy' is 0, data must stay valid until it is sent
+int conn_write(struct mx_conn *conn, const char *data, int length, int copy) {
+	int sent = 0;
 
-			if (difftime(time(0), conn->time_of_last_response) > opts_connection_timeout()) {
-				ELOG("Timeout for connection with domain '%s'.", conn->dom->name);
-				invalidate_connection(conn);
-			}
+	if (conn->out_error) return 0;
 
-			if (conn->state == SMTP_CLIENT_FSM_ST_DONE) {
-				LOG(GREEN "All mail for domain '%s' was successfully sent!", conn->dom->name);
-				remove = 1;
-			}
+	if (TAILQ_EMPTY(&conn->out) && !event_async()) {
+		sent = send(conn->sock, data, length, MSG_NOSIGNAL);
 
-			if (conn->state == SMTP_CLIENT_FSM_ST_INVALID) {
-				ELOG("Connection with domain '%s' was marked as invalid. Aborting mail transfer.", conn->dom->name);
-				remove = 1;
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ELOG("Can't send data to MX '%s'.", conn->dom->name);
+				conn->out_error = 1;
+				return 0;
 			}
 
-			if (remove) {
-				free_connection(conn);
-			}
+			sent = 0;
 		}
+
+		if (sent == length) return 1;
 	}
 
-	struct mail *m;
-	TAILQ_FOREACH(m, mails, entry) {
-		if (m->was_sent) {
-			LOG("Mail '%s' was successfully sent. Deleting file from NEW directory.", m->filename);
-			delete_mail(m->filename, DIR_NEW);
-		} else {
-			ELOG("Mail '%s' was not sent. Moving it to NOT_SENT directory.", m->filename);
-			move_mail(m->filename, DIR_NEW, DIR_NOTSENT);
-		}
+	struct out_chunk *c = malloc(sizeof(*c));
+	c->length = length - sent;
+	c->offset = 0;
+	c->owned = copy;
+	c->file = 0;
+
+	if (copy) {
+		c->data = malloc(c->length);
+		memcpy(c->data, data + sent, c->length);
+	} else {
+		c->data = (char *)data + sent;
 	}
 
-	LOG(GREEN "All connections were finished. Waiting for another mail...");
-}
+	conn_queue_chunk(conn, c);
 
+	return 1;
+}
 
-// Parses response from MX server and activates state machine
-int parse_response(struct mx_conn *conn, char *str, int length) {
-	te_smtp_client_fsm_event event;
 
-	switch (re_match_any(str, length)) {
-		case r220: 	event = SMTP_CLIENT_FSM_EV_R220;	break;
-		case r221:	event = SMTP_CLIENT_FSM_EV_R221;	break;
-		case r250:	event = SMTP_CLIENT_FSM_EV_R250;	break;
-		case r354:	event = SMTP_CLIENT_FSM_EV_R354;	break;
-		default:	event = SMTP_CLIENT_FSM_EV_INVALID;
-					ELOG(BLUE "[%s] " RED "Received unexpected message: '%s'.",
-							conn->dom->name,
-							str_without_new_line(str, length)
-					);
-					break;
-	}
+// Queues 'length' bytes of file from 'offset' for sending to MX, like
+// conn_write(); chunk holds its own reference to file
+int conn_write_file(struct mx_conn *conn, struct out_file *f, off_t offset, int length) {
+	if (conn->out_error) return 0;
 
-	conn->time_of_last_response = time(0);
+	struct out_chunk *c = malloc(sizeof(*c));
+	c->data = 0;
+	c->length = length;
+	c->offset = 0;
+	c->owned = 0;
+	c->file = f;
+	c->file_offset = offset;
+	f->refs++;
 
-	conn->state = smtp_client_fsm_step(conn->state, event, conn);
+	conn_queue_chunk(conn, c);
 
-	return 0;
+	return !conn->out_error;
 }
 
 
-// Marks connections as invalid
-void invalidate_connection(struct mx_conn *conn) {
-	conn->state = SMTP_CLIENT_FSM_ST_INVALID;
-}
+// Sends queued data while socket accepts it; when queue is empty, stops
+// waiting for socket to become writable
+int conn_flush(struct mx_conn *conn) {
+	struct out_chunk *c;
+
+	if (event_async()) {
+		conn_send_next(conn);
+		return !conn->out_error;
+	}
 
+	while ((c = TAILQ_FIRST(&conn->out))) {
+		int sent = chunk_send(conn, c);
 
-// Waiting for response from any SMTP server; if there was any, returns
-// 1, or 0 otherwise
-int wait_for_response() {
-	char buf[500];
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+			ELOG("Can't send data to MX '%s'.", conn->dom->name);
+			conn->out_error = 1;
+			return 0;
+		}
 
-	fd_set readfds;
-	FD_ZERO(&readfds);
+		chunk_sent(conn, c, sent);
 
-	struct pollfd pfds[connectionsCount];
-	struct mx_conn *conn;
-	
-	int i = 0;
-	TAILQ_FOREACH(conn, connections, entry) {
-		pfds[i].fd = conn->sock;
-		pfds[i++].events = POLLIN;
+		if (TAILQ_FIRST(&conn->out) == c) break;
 	}
 
-	int res = poll(pfds, connectionsCount, 5000);
+	event_mod(conn->sock, TAILQ_EMPTY(&conn->out) ? EVENT_READ : EVENT_READ | EVENT_WRITE, conn);
 
-	if (res == -1) {
-		ELOG("Can't use 'poll()' on multiple connections.");
-		return 0;
-	} else if (res == 0) {
-		DLOG(MAGENTA "Timeout, no responses from any of connections.");
+	return 1;
+}
+
+
+// Handles result of asynchronous sending of first chunk: 'res' bytes were
+// sent, or -errno; sends the rest of data
+int conn_sent(struct mx_conn *conn, int res) {
+	struct out_chunk *c = TAILQ_FIRST(&conn->out);
+
+	conn->sending = 0;
+
+	if (res < 0 && res != -EAGAIN) {
+		ELOG("Can't send data to MX '%s'.", conn->dom->name);
+		conn->out_error = 1;
 		return 0;
 	}
 
-	for (int i = 0; i < res; ++i) {
-		if (pfds[i].revents & POLLIN) {
-			conn = get_conn_by_socket(connections, pfds[i].fd);
+	if (c && res > 0) {
+		chunk_sent(conn, c, res);
+	}
 
-			res = recv(conn->sock, buf, sizeof(buf), 0);
+	conn_send_next(conn);
+	return 1;
+}
 
-			if (res == -1) {
-				ELOG("Can't recieve any data from MX '%s'.", conn->dom->name);
-				invalidate_connection(conn);
-				return 0;
-			} else if (res == 0) {
-				ELOG("MX '%s' disconnected.", conn->dom->name);
-				invalidate_connection(conn);
-				return 0;
-			} else {
-				DLOG(BLUE "[%s] " MAGENTA "recv [%d]: >%s",
-						((struct mx_conn*)conn)->dom->name,
-						res,
-						str_without_new_line(buf, res)
-				);
-
-				parse_response(conn, buf, res);
-				return 1;
-			}
-		}
+
+// Drops all data queued for sending
+void conn_clear_output(struct mx_conn *conn) {
+	struct out_chunk *c;
+
+	while ((c = TAILQ_FIRST(&conn->out))) {
+		TAILQ_REMOVE(&conn->out, c, entry);
+		chunk_free(c);
 	}
 
-	return 0;
+	conn->out_bytes = 0;
+	conn->sending = 0;
 }
 
 
@@ -492,10 +1616,19 @@ int wait_for_response() {
  * with external SMTP servers;
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// Send EHLO message to SMTP server
+int send_ehlo(struct mx_conn *conn) {
+	const char *msg_ehlo = "EHLO quint.nope\r\n";
+	conn_write(conn, msg_ehlo, strlen(msg_ehlo), 0);
+
+	return 0;
+}
+
+
 // Send HELLO message to SMTP server
 int send_hello(struct mx_conn *conn) {
 	const char *msg_helo = "HELO quint.nope\r\n";
-	send(conn->sock, msg_helo, strlen(msg_helo), 0);
+	conn_write(conn, msg_helo, strlen(msg_helo), 0);
 
 	return 0;
 }
@@ -504,7 +1637,7 @@ int send_hello(struct mx_conn *conn) {
 // Send MAIL FROM message to SMTP server
 int send_mailfrom(struct mx_conn *conn) {
 	char *msg = conn->m->from;
-	send(conn->sock, msg, strlen(msg), 0);
+	conn_write(conn, msg, strlen(msg), 0);
 
 	return 0;
 }
@@ -517,10 +1650,12 @@ int send_rcptto(struct mx_conn *conn) {
 	}
 
 	if (conn->r) {
-		char msg[200];
-		sprintf(msg, "RCPT TO: <%s>\r\n", conn->r->name);
+		int length = strlen(conn->r->name) + 16;
+		char *msg = malloc(length);
+		length = snprintf(msg, length, "RCPT TO: <%s>\r\n", conn->r->name);
 
-		send(conn->sock, msg, strlen(msg), 0);
+		conn_write(conn, msg, length, 1);
+		free(msg);
 		conn->r = TAILQ_NEXT(conn->r, entry);
 
 		return 1;
@@ -530,28 +1665,141 @@ int send_rcptto(struct mx_conn *conn) {
 }
 
 
+// Send MAIL FROM, RCPT TO for all recipients from domain of connection and
+// DATA in one write, when server supports pipelining (RFC 2920); if server
+// supports chunking, message body is sent by BDAT commands instead of DATA
+// right after them. Returns count of replies to wait for
+int send_envelope(struct mx_conn *conn) {
+	const char *msg_data = "DATA\r\n";
+	int chunking = conn->caps & SMTP_CAP_CHUNKING;
+	struct rcpt *r;
+	int length = strlen(conn->m->from) + strlen(msg_data) + 1;
+
+	TAILQ_FOREACH(r, &conn->m->rcpts, entry) {
+		length += strlen(r->name) + 16;
+	}
+
+	char *msg = malloc(length);
+	char *end = msg + snprintf(msg, length, "%s", conn->m->from);
+	conn->replies = chunking ? 1 : 2;
+
+	TAILQ_FOREACH(r, &conn->m->rcpts, entry) {
+		if (!rcpt_is_from_domain(r, conn->dom)) continue;
+
+		end += snprintf(end, msg + length - end, "RCPT TO: <%s>\r\n", r->name);
+		conn->replies++;
+	}
+
+	if (!chunking) end += snprintf(end, msg + length - end, "%s", msg_data);
+	conn->r = 0;
+
+	conn_write(conn, msg, end - msg, 1);
+	free(msg);
+
+	if (chunking) conn->replies += send_bdat(conn);
+
+	return conn->replies;
+}
+
+
+// Send RSET message to SMTP server, before reusing idle session
+int send_rset(struct mx_conn *conn) {
+	const char *msg_rset = "RSET\r\n";
+	conn_write(conn, msg_rset, strlen(msg_rset), 0);
+
+	return 0;
+}
+
+
 // Send DATA message to SMTP server
 int send_data(struct mx_conn *conn) {
 	const char *msg_data = "DATA\r\n";
-	send(conn->sock, msg_data, strlen(msg_data), 0);
+	conn_write(conn, msg_data, strlen(msg_data), 0);
 
 	return 0;
 }
 
 
-// Send mail message to SMTP server
+// Send mail message to SMTP server; message is not read into memory, it
+// is sent straight from mail file
 int send_datastr(struct mx_conn *conn) {
-	send(conn->sock, conn->m->msg, strlen(conn->m->msg), 0);
+	int fd = open_mail_data(conn->m);
+	struct out_file *f = fd < 0 ? 0 : out_file_open(fd);
+
+	if (!f) {
+		conn->out_error = 1;
+		return 0;
+	}
+
+	conn_write_file(conn, f, conn->m->data_offset, conn->m->data_length);
+	out_file_release(f);
 
 	return 0;
 }
 
 
+// Send message body by BDAT commands (RFC 3030): body is sent from mail
+// file without final dot and without dots added for transparency, so pieces
+// of file between these dots are queued one after another. With pipelining
+// body is split into chunks of BDAT_CHUNK_SIZE, which are sent at once;
+// otherwise it is sent in one chunk, as every BDAT waits for its reply.
+// Returns count of BDAT commands
+int send_bdat(struct mx_conn *conn) {
+	off_t *dots = 0;
+	int fd = open_mail_data(conn->m);
+	int dot_count = fd < 0 ? -1 : find_stuffed_dots(conn->m, fd, &dots);
+	struct out_file *f = dot_count < 0 ? 0 : out_file_open(fd);
+
+	if (!f) {
+		if (fd >= 0 && dot_count < 0) close(fd);
+		free(dots);
+		conn->out_error = 1;
+		return 0;
+	}
+
+	off_t pos = conn->m->data_offset;
+	off_t left = conn->m->data_length - 3 - dot_count;
+	off_t chunk_size = (conn->caps & SMTP_CAP_PIPELINING) ? BDAT_CHUNK_SIZE : left;
+	int chunks = 0, next_dot = 0;
+
+	do {
+		off_t size = left < chunk_size ? left : chunk_size;
+		char cmd[64];
+
+		left -= size;
+		sprintf(cmd, "BDAT %lld%s\r\n", (long long)size, left ? "" : " LAST");
+		conn_write(conn, cmd, strlen(cmd), 1);
+		chunks++;
+
+		while (size > 0) {
+			if (next_dot < dot_count && dots[next_dot] == pos) {
+				pos++;
+				next_dot++;
+				continue;
+			}
+
+			off_t piece = size;
+			if (next_dot < dot_count && dots[next_dot] - pos < piece) piece = dots[next_dot] - pos;
+
+			// Pieces share one descriptor of file
+			conn_write_file(conn, f, pos, piece);
+
+			pos += piece;
+			size -= piece;
+		}
+	} while (left > 0);
+
+	out_file_release(f);
+	free(dots);
+
+	return chunks;
+}
+
+
 // Send QUIT message to SMTP server
 int send_quit(struct mx_conn *conn) {
 	const char *msg_quit = "QUIT\r\n";
-	send(conn->sock, msg_quit, strlen(msg_quit), 0);
+	conn_write(conn, msg_quit, strlen(msg_quit), 0);
 
 	return 0;
 }
-
@@ -14,12 +14,11 @@ const char *patterns[smtp_re_count] = {
 	"^221(?:\\s+.+)?\\r\\n",
 	"^250(?:\\s+.+)?\\r\\n",
 	"^354(?:\\s+.+)?\\r\\n",
+	"^5\\d\\d(?:\\s+.+)?\\r\\n",
 	"^DATA\\r\\n",
 	"^MAIL FROM:\\s*<.+>\\r\\n",
 	"^RCPT TO:\\s*<(.+@.+)>\\r\\n",
-	"^RCPT TO:\\s*<.+@(.+)>\\r\\n",
-	"MX\\s+\\d+\\s*(.+)\\.$",
-	"MX\\s+(\\d+)\\s*.+\\.$"
+	"^RCPT TO:\\s*<.+@(.+)>\\r\\n"
 };
 
 
@@ -0,0 +1,168 @@
+/**
+ * \file timer.c
+ * \brief Иерархическое колесо таймеров
+ */
+#include <string.h>
+
+#include <timer.h>
+
+#define SLOT_MASK	(TIMER_SLOTS - 1)
+
+// Every delivery thread has its own wheel
+static __thread struct timer_list wheel[TIMER_LEVELS][TIMER_SLOTS];
+static __thread long current;	// next millisecond to be processed
+static __thread int count;
+
+
+// Empties wheel; timers, which were in it, should not be used after this
+void timer_init(long now) {
+	for (int l = 0; l < TIMER_LEVELS; ++l) {
+		for (int i = 0; i < TIMER_SLOTS; ++i) {
+			TAILQ_INIT(&wheel[l][i]);
+		}
+	}
+
+	current = now;
+	count = 0;
+}
+
+
+// Prepares timer, which is not pending yet
+void timer_setup(struct timer *t, timer_callback cb, void *arg) {
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->arg = arg;
+}
+
+
+// Puts timer into slot by time left till it expires
+static void timer_insert(struct timer *t) {
+	long expires = t->expires < current ? current : t->expires;
+	long delta = expires - current;
+	int level = 0;
+
+	while (level < TIMER_LEVELS - 1 && delta >= 1L << (TIMER_SLOT_BITS * (level + 1))) {
+		level++;
+	}
+
+	// Last level holds at most one round of slots; such timer is put
+	// there again when its slot is reached
+	long max = (1L << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+	if (delta > max) expires = current + max;
+
+	t->slot = &wheel[level][(expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+	TAILQ_INSERT_TAIL(t->slot, t, entry);
+}
+
+
+// Arms timer (again) to expire at specified time
+void timer_set(struct timer *t, long expires) {
+	timer_cancel(t);
+
+	t->expires = expires;
+	count++;
+	timer_insert(t);
+}
+
+
+// Removes timer from wheel, if it is there
+void timer_cancel(struct timer *t) {
+	if (!t->slot) return;
+
+	TAILQ_REMOVE(t->slot, t, entry);
+	t->slot = 0;
+	count--;
+}
+
+
+// Moves timers of slot of upper level to lower ones; returns slot index
+static int cascade(int level) {
+	int slot = (current >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+	struct timer_list list;
+	struct timer *t;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &wheel[level][slot], entry);
+
+	while ((t = TAILQ_FIRST(&list))) {
+		TAILQ_REMOVE(&list, t, entry);
+		timer_insert(t);
+	}
+
+	return slot;
+}
+
+
+// Calls callbacks of all timers, which expired by 'now'; returns their
+// count. Callbacks may arm and cancel any timers
+int timer_run(long now) {
+	int fired = 0;
+
+	// Nothing to process: wheel just catches up with time
+	if (!count) {
+		if (now >= current) current = now + 1;
+		return 0;
+	}
+
+	while (current <= now) {
+		int slot = current & SLOT_MASK;
+
+		// Crossing border of slot of upper levels
+		for (int level = 1; level < TIMER_LEVELS && !slot; ++level) {
+			slot = cascade(level);
+		}
+
+		struct timer_list *list = &wheel[0][current & SLOT_MASK];
+		struct timer *t;
+
+		while ((t = TAILQ_FIRST(list))) {
+			TAILQ_REMOVE(list, t, entry);
+			t->slot = 0;
+			count--;
+			fired++;
+			t->cb(t, t->arg);
+		}
+
+		current++;
+
+		if (!count && now >= current) current = now + 1;
+	}
+
+	return fired;
+}
+
+
+// Returns milliseconds till next timer expires, or -1 if there are no
+// timers. For timers on upper levels time till they are moved down is
+// returned, which is never later than they expire
+int timer_next_timeout(long now) {
+	if (!count) return -1;
+
+	long next = -1;
+
+	for (int level = 0; level < TIMER_LEVELS; ++level) {
+		int shift = TIMER_SLOT_BITS * level;
+		long base = current >> shift;
+
+		// Level 0 slot of current millisecond is not processed yet; upper
+		// levels are looked at from their next slot, and their current slot
+		// is reached again after full round
+		for (int k = level ? 1 : 0; k <= (level ? TIMER_SLOTS : TIMER_SLOTS - 1); ++k) {
+			if (!TAILQ_EMPTY(&wheel[level][(base + k) & SLOT_MASK])) {
+				long at = level ? (base + k) << shift : current + k;
+				if (next < 0 || at < next) next = at;
+				break;
+			}
+		}
+	}
+
+	if (next < 0) return -1;
+
+	return next > now ? next - now : 0;
+}
+
+
+// Returns count of pending timers
+int timer_count() {
+	return count;
+}
@@ -0,0 +1,196 @@
+/**
+ * \file uring.c
+ * \brief Минимальная обертка над io_uring без liburing
+ */
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef USE_IO_URING
+#include <uring.h>
+
+// Completion queue is larger, as one-shot polls are armed again before
+// completions of other requests are reaped, and many of them may be in
+// flight at once
+#define CQ_ENTRIES_FACTOR 4
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+
+// Creates rings with specified count of submission entries; returns 1 on
+// success. Kernel should support completions, which are never dropped,
+// and timeouts of waiting (Linux 5.11)
+int uring_init(struct uring *r, unsigned entries) {
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * CQ_ENTRIES_FACTOR;
+
+	if ((r->fd = sys_setup(entries, &p)) < 0) return 0;
+
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(r->fd);
+		return 0;
+	}
+
+	r->entries = p.sq_entries;
+	r->features = p.features;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	// Both rings may share one mapping
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		close(r->fd);
+		return 0;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(0, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			munmap(r->sq_ring, r->sq_ring_size);
+			close(r->fd);
+			return 0;
+		}
+	}
+
+	r->sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+		munmap(r->sq_ring, r->sq_ring_size);
+		close(r->fd);
+		return 0;
+	}
+
+	char *sq = r->sq_ring, *cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 1;
+}
+
+
+// Unmaps rings and closes descriptor; requests in flight are cancelled
+void uring_final(struct uring *r) {
+	if (!r->sq_ring) return;
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+
+	memset(r, 0, sizeof(*r));
+}
+
+
+// Returns 1 if kernel supports operation
+int uring_supports(struct uring *r, int op) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int supported = 0;
+
+	if (sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 && op <= probe->last_op) {
+		supported = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+
+	free(probe);
+	return supported;
+}
+
+
+// Returns cleared submission entry; if queue is full, entries filled so
+// far are submitted first. Returns 0 if kernel takes none of them (e.g.
+// completion queue is full, and completions should be reaped first)
+struct io_uring_sqe* uring_get_sqe(struct uring *r) {
+	unsigned tail = *r->sq_tail;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+		if (uring_submit(r, 0, 0) < 0) return 0;
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) return 0;
+	}
+
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->sq_pending++;
+
+	return sqe;
+}
+
+
+// Submits all filled entries and, if 'wait' is set, waits up to 'ms'
+// milliseconds (forever, if it is negative) for at least one completion.
+// Returns 0 on success or timeout, -1 on error
+int uring_submit(struct uring *r, int wait, int ms) {
+	struct __kernel_timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	struct io_uring_getevents_arg arg = { .ts = ms >= 0 ? (unsigned long)&ts : 0 };
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+	// Completions, which are there already, need no waiting
+	if (wait && *r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		flags = 0;
+		wait = 0;
+	}
+
+	if (!r->sq_pending && !wait) return 0;
+
+	int res = sys_enter(r->fd, r->sq_pending, wait ? 1 : 0, flags, wait ? &arg : 0, wait ? sizeof(arg) : 0);
+
+	if (res >= 0) {
+		r->sq_pending -= res;
+		return 0;
+	}
+
+	return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+}
+
+
+// Returns next completion, or 0 if there are none
+struct io_uring_cqe* uring_peek_cqe(struct uring *r) {
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+
+// Releases completion returned by uring_peek_cqe()
+void uring_cqe_seen(struct uring *r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
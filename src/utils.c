@@ -1,4 +1,5 @@
 #include <sys/types.h>
+#include <time.h>
 #include <termios.h>
 #include <unistd.h>
 #include <utils.h>
@@ -6,7 +7,7 @@
 // Converts string into another string, substituting '\n' and '\r' by "\n" and "\r"
 char *str_without_new_line(char *str, int length) {
 	int i = 0, j = 0;
-	static char buf[UTILS_BUF_SIZE];
+	static __thread char buf[UTILS_BUF_SIZE];
 
 	while (i < length && j < UTILS_BUF_SIZE - 2) {
 		if (str[i] == '\n') {
@@ -64,3 +65,11 @@ char getch() {
 
 	return buf;
 }
+
+
+// Returns monotonic time in milliseconds
+long time_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
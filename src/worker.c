@@ -0,0 +1,412 @@
+/**
+ * \file worker.c
+ * \brief Потоки доставки и раздача им писем
+ */
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include <worker.h>
+#include <protocol.h>
+#include <event.h>
+#include <dns-cache.h>
+#include <opts.h>
+#include <log.h>
+
+#define RING_MASK (WORKER_RING_SIZE - 1)
+
+static struct worker *workers;
+static int count;
+
+// Workers finish their loops together, before they drop their mail
+static pthread_barrier_t stop_barrier;
+
+// Guards files of mails, which stopping workers finish themselves
+static pthread_mutex_t finish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Eventfd, which wakes main thread, when workers return finished mail;
+// it is written once till main thread takes that mail
+static int done_fd = -1;
+static int done_signalled;
+
+// Worker running in this thread; 0 in main thread
+static __thread struct worker *self;
+static __thread struct worker_stats own_stats;
+
+
+// Puts mail into queue; returns 0 if queue is full. Called by writer only
+int mail_ring_push(struct mail_ring *r, struct mail *m) {
+	unsigned tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == WORKER_RING_SIZE) return 0;
+
+	r->items[tail & RING_MASK] = m;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+
+// Takes mail from queue; returns 0 if queue is empty. Called by reader only
+struct mail* mail_ring_pop(struct mail_ring *r) {
+	unsigned head = r->head;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return 0;
+
+	struct mail *m = r->items[head & RING_MASK];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	return m;
+}
+
+
+// Wakes event loop of worker
+static void wake(struct worker *w) {
+	uint64_t one = 1;
+
+	if (write(w->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+		ELOG("Can't wake delivery thread %d.", w->id);
+	}
+}
+
+
+// Event loop of delivery thread: it has its own sessions, timers, DNS
+// client and cache, and takes mail of its domains from its queue
+static void* worker_loop(void *arg) {
+	self = arg;
+
+	conn_init();
+	event_add(self->wake_fd, EVENT_READ, self);
+
+	while (!__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) {
+		conn_loop();
+	}
+
+	struct event_stats es = event_get_stats();
+	struct dns_cache_stats cs = dns_cache_get_stats();
+	self->stats.wakeups = es.wakeups;
+	self->stats.handled = es.handled;
+	self->stats.dns_hits = cs.hits;
+	self->stats.dns_misses = cs.misses;
+
+	// Mail, which is left in queues of stopped workers, should not be
+	// released by delivery in others
+	pthread_barrier_wait(&stop_barrier);
+
+	event_del(self->wake_fd);
+	conn_final();
+
+	return 0;
+}
+
+
+// Starts delivery threads; 0 means one per CPU. Returns 1 on success
+int workers_start(int n) {
+	if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > WORKER_MAX) n = WORKER_MAX;
+
+	if ((done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		ELOG("Can't create eventfd for finished mail.");
+		return 0;
+	}
+
+	done_signalled = 0;
+	workers = calloc(n, sizeof(*workers));
+
+	for (int i = 0; i < n; ++i) {
+		workers[i].id = i;
+
+		if ((workers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			ELOG("Can't create eventfd for delivery thread %d.", i);
+
+			while (i--) close(workers[i].wake_fd);
+			close(done_fd);
+			done_fd = -1;
+			free(workers);
+			workers = 0;
+			return 0;
+		}
+	}
+
+	// Shards of domains are fixed before any thread starts
+	count = n;
+	pthread_barrier_init(&stop_barrier, 0, n);
+
+	for (int i = 0; i < n; ++i) {
+		if (pthread_create(&workers[i].thread, 0, worker_loop, &workers[i]) != 0) {
+			ELOG("Can't start delivery thread %d.", i);
+
+			// Started threads don't wait on barrier until they are stopped,
+			// and they have no mail yet
+			pthread_barrier_destroy(&stop_barrier);
+			pthread_barrier_init(&stop_barrier, 0, i ? i : 1);
+
+			for (int j = i; j < n; ++j) close(workers[j].wake_fd);
+
+			count = i;
+			workers_stop();
+			return 0;
+		}
+	}
+
+	LOG(GREEN "Started %d delivery threads.", n);
+	return 1;
+}
+
+
+// Stops delivery threads and logs their counters. Mail, which was not
+// delivered yet, stays in NEW directory
+void workers_stop() {
+	struct mail *m;
+
+	for (int i = 0; i < count; ++i) {
+		__atomic_store_n(&workers[i].stop, 1, __ATOMIC_RELEASE);
+		wake(&workers[i]);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		pthread_join(workers[i].thread, 0);
+	}
+
+	workers_finish_mail();
+
+	struct worker_stats total = {0};
+
+	for (int i = 0; i < count; ++i) {
+		struct worker *w = &workers[i];
+		struct worker_stats *st = &w->stats;
+
+		// Mail, which worker did not take
+		while ((m = mail_ring_pop(&w->in))) {
+			if (__atomic_sub_fetch(&m->pending, 1, __ATOMIC_ACQ_REL) == 0) free_mail(m);
+		}
+
+		LOG("Delivery thread %d: %lu mails, %lu finished, %lu sessions, %lu responses in %lu wakeups, "
+				"DNS cache %lu hits, %lu misses.",
+				i, st->mails, st->finished, st->sessions, st->handled, st->wakeups,
+				st->dns_hits, st->dns_misses);
+
+		total.mails += st->mails;
+		total.sessions += st->sessions;
+		total.handled += st->handled;
+		total.wakeups += st->wakeups;
+
+		close(w->wake_fd);
+	}
+
+	LOG("All delivery threads: %lu mails, %lu sessions, %lu responses in %lu wakeups (%.2f per wakeup).",
+			total.mails, total.sessions, total.handled, total.wakeups,
+			total.wakeups ? (double)total.handled / total.wakeups : 0.0);
+
+	pthread_barrier_destroy(&stop_barrier);
+	free(workers);
+	workers = 0;
+	count = 0;
+
+	if (done_fd >= 0) close(done_fd);
+	done_fd = -1;
+}
+
+
+// Returns count of delivery threads
+int workers_count() {
+	return count;
+}
+
+
+// Returns descriptor, which becomes readable, when workers return
+// finished mail, or -1 without workers
+int workers_done_fd() {
+	return done_fd;
+}
+
+
+// Reads all new mail and gives it to workers, which own domains of its
+// recipients; returns count of read mails. Files of broken and local mail
+// are moved in one batch
+int workers_dispatch_new_mail() {
+	struct mail_list ml;
+	TAILQ_INIT(&ml);
+
+	maildir_batch_begin();
+
+	if (!read_all_mail(&ml)) {
+		maildir_batch_end();
+		ELOG("Can't read mail, skipping it.");
+		return 0;
+	}
+
+	char woken[WORKER_MAX] = {0};
+	int mails = 0;
+	struct mail *m;
+	struct rcpt *r;
+	int my_domain = domain_id(opts_my_domain(), strlen(opts_my_domain()));
+
+	while ((m = TAILQ_FIRST(&ml))) {
+		TAILQ_REMOVE(&ml, m, entry);
+		mails++;
+
+		char shards[WORKER_MAX] = {0};
+		int n = 0;
+
+		TAILQ_FOREACH(r, &m->rcpts, entry) {
+			if (r->domain == my_domain) continue;
+
+			int id = worker_of_domain(domain_id_name(r->domain));
+			if (!shards[id]) n++;
+			shards[id] = 1;
+		}
+
+		// Every worker holds mail, until it is queued for all its domains
+		m->pending = n;
+
+		if (!n) {
+			mail_finish(m);
+			continue;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			if (!shards[i]) continue;
+
+			// Full queue means that worker is behind; it is woken and
+			// given time to catch up
+			while (!mail_ring_push(&workers[i].in, m)) {
+				wake(&workers[i]);
+				poll(0, 0, 1);
+			}
+
+			woken[i] = 1;
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (woken[i]) wake(&workers[i]);
+	}
+
+	maildir_batch_end();
+
+	return mails;
+}
+
+
+// Deletes or moves files of mails, which workers have finished, in one
+// batch; returns their count
+int workers_finish_mail() {
+	int finished = 0;
+	struct mail *m;
+	uint64_t value;
+
+	// Mail, which is returned after this, signals again
+	if (done_fd >= 0) read(done_fd, &value, sizeof(value));
+	__atomic_store_n(&done_signalled, 0, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	maildir_batch_begin();
+
+	for (int i = 0; i < count; ++i) {
+		while ((m = mail_ring_pop(&workers[i].done))) {
+			mail_finish(m);
+			finished++;
+		}
+	}
+
+	maildir_batch_end();
+
+	return finished;
+}
+
+
+// Returns index of worker, which owns domain. Hash is FNV-1a with final
+// mixing of bits, so that names, which differ in one letter, are spread
+// for any count of workers
+int worker_of_domain(const char *name) {
+	uint32_t hash = 2166136261u;
+
+	if (!count) return 0;
+
+	for (; *name; ++name) {
+		hash ^= (unsigned char)tolower((unsigned char)*name);
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+
+	return hash % count;
+}
+
+
+// Returns 1 if domain belongs to worker of this thread; without workers
+// all domains belong to current thread
+int worker_owns_domain(const char *name) {
+	return !self || worker_of_domain(name) == self->id;
+}
+
+
+// Returns worker of this thread, or 0 in main thread; it is also data of
+// its wake descriptor in event loop
+struct worker* worker_self() {
+	return self;
+}
+
+
+// Takes new mail from queue of worker and puts it into queues of its
+// domains
+void worker_receive_mail() {
+	uint64_t value;
+	struct mail *m;
+
+	// Counter of eventfd is reset; queue is checked even if it was not set
+	read(self->wake_fd, &value, sizeof(value));
+
+	while ((m = mail_ring_pop(&self->in))) {
+		conn_enqueue_mail(m);
+		mail_release(m);
+		self->stats.mails++;
+	}
+}
+
+
+// Wakes main thread for returned mail, unless it was woken already and
+// has not taken mail yet
+static void signal_done() {
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&done_signalled, 1, __ATOMIC_SEQ_CST)) return;
+
+	if (write(done_fd, &one, sizeof(one)) != sizeof(one)) {
+		ELOG("Can't wake main thread for finished mail.");
+	}
+}
+
+
+// Gives mail, which all domains of worker have finished, back to main
+// thread; returns 0 if it should be tried again later
+int worker_return_mail(struct mail *m) {
+	if (!mail_ring_push(&self->done, m)) {
+		if (!__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE)) return 0;
+
+		// Main thread waits for workers to stop and does not touch files
+		pthread_mutex_lock(&finish_lock);
+		mail_finish(m);
+		pthread_mutex_unlock(&finish_lock);
+	} else {
+		signal_done();
+	}
+
+	self->stats.finished++;
+	return 1;
+}
+
+
+// Returns counters of worker of this thread
+struct worker_stats* worker_stats() {
+	return self ? &self->stats : &own_stats;
+}
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <maildir.h>
+#include <parser.h>
+#include <arena.h>
+#include <regexp.h>
+#include <utils.h>
+#include <opts.h>
+#include <log.h>
+
+// Benchmark of parser of mail files: writes small mail files into
+// MAILDIR/NEW, parses all of them in one thread or by parser threads and
+// prints rate of parsing.
+// Usage: bench [count of files] [count of recipients per mail] [parser threads]
+
+#define BENCH_FILES	100000
+#define BENCH_RCPTS	2
+#define BENCH_ROUNDS	3
+
+
+// Writes mail files, which look like ones written by MTA
+static int write_mails(int count, int rcpts) {
+	char name[500], mail[4096];
+
+	for (int i = 0; i < count; ++i) {
+		char *end = mail + sprintf(mail, "MAIL FROM: <origin@example.com>\r\n");
+
+		for (int j = 0; j < rcpts; ++j) {
+			end += sprintf(end, "RCPT TO:<user%d.%d@domain%d.test>\r\n", i, j, (i + j) % 1000);
+		}
+
+		end += sprintf(end, "DATA\r\nSubject: mail #%d\r\n\r\nthis is mail #%d\r\n.\r\n", i, i);
+
+		sprintf(name, "%s/new/benchmail%d", opts_maildir_root(), i);
+		FILE *f = fopen(name, "w");
+
+		if (!f || fwrite(mail, 1, end - mail, f) != end - mail) {
+			fprintf(stderr, "Can't write mail file '%s'.\n", name);
+			if (f) fclose(f);
+			return 0;
+		}
+
+		fclose(f);
+	}
+
+	return 1;
+}
+
+
+static void delete_mails(int count) {
+	char name[500];
+
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "%s/new/benchmail%d", opts_maildir_root(), i);
+		unlink(name);
+	}
+}
+
+
+// Parses all files; returns count of parsed ones
+static int parse_mails(int count) {
+	char name[32];
+	int parsed = 0;
+
+	if (parser_count()) {
+		char **names = malloc(count * sizeof(*names));
+		struct parser_job job;
+
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "benchmail%d", i);
+			names[i] = strdup(name);
+		}
+
+		parser_submit(names, count);
+		free(names);
+
+		while (parser_next(&job)) {
+			if (job.mail) {
+				parsed++;
+				free_mail(job.mail);
+			}
+
+			free(job.name);
+		}
+
+		return parsed;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "benchmail%d", i);
+		struct mail *m = read_mail_file(name);
+
+		if (m) {
+			parsed++;
+			free_mail(m);
+		}
+	}
+
+	return parsed;
+}
+
+
+int main(int argc, char **argv) {
+	int count = argc > 1 ? atoi(argv[1]) : BENCH_FILES;
+	int rcpts = argc > 2 ? atoi(argv[2]) : BENCH_RCPTS;
+	int threads = argc > 3 ? atoi(argv[3]) : 0;
+
+	opts_init();
+	maildir_init();
+	re_init();
+
+	if (!write_mails(count, rcpts) || (threads && !parser_start(threads))) {
+		delete_mails(count);
+		return 1;
+	}
+
+	// First round warms up page cache and allocator
+	for (int round = 0; round <= BENCH_ROUNDS; ++round) {
+		long start = time_ms();
+		int parsed = parse_mails(count);
+		long ms = time_ms() - start;
+
+		if (parsed != count) {
+			fprintf(stderr, "Only %d of %d mail files were parsed.\n", parsed, count);
+			break;
+		}
+
+		if (round) {
+			printf("Round %d: %d files with %d recipients by %d threads in %ld ms, %.0f files per minute.\n",
+					round, count, rcpts, threads ? threads : 1, ms, ms ? count * 60000.0 / ms : 0.0);
+		}
+	}
+
+	if (threads) parser_stop();
+
+	struct arena_stats as = arena_get_stats();
+	printf("Arenas: %lu released, %lu allocations of %lu bytes in %lu blocks.\n",
+			as.arenas, as.allocs, as.bytes, as.blocks);
+
+	delete_mails(count);
+	re_final();
+	maildir_final();
+
+	return 0;
+}
@@ -1,9 +1,26 @@
 #include <CUnit/Basic.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 
 #include <client-fsm.h>
 #include <protocol.h>
 #include <maildir.h>
+#include <event.h>
+#include <dns.h>
+#include <dns-cache.h>
+#include <envelope.h>
+#include <timer.h>
+#include <worker.h>
+#include <parser.h>
+#include <arena.h>
 #include <regexp.h>
 #include <utils.h>
 #include <opts.h>
@@ -16,7 +33,13 @@ struct test {
 };
 
 void maildir_01_test() {
-	CU_ASSERT(read_mail_file("testmail1") != 0);
+	struct mail *m = read_mail_file("testmail1");
+	CU_ASSERT(m != 0);
+	if (m == 0) return;
+
+	// Body is left in file: "hello!\r\n.\r\n" after DATA line
+	CU_ASSERT(m->data_offset == 65 && m->data_length == 11);
+	free_mail(m);
 }
 
 void maildir_02_test() {
@@ -39,6 +62,238 @@ void maildir_06_test() {
 	CU_ASSERT(read_mail_file("testmail6") == 0);
 }
 
+void maildir_10_test() {
+	const char *head = "MAIL FROM: <mail@mail.com>\r\nRCPT TO:<othermail@gmail.com>\r\n"
+			"RCPT TO:<third@mail.ru>\r\nDATA\r\n";
+	FILE *f = fopen("../maildir/new/testmailbig", "w");
+	CU_ASSERT(f != NULL);
+	if (f == NULL) return;
+
+	fputs(head, f);
+	for (int i = 0; i < MAIL_READ_SIZE / 16; ++i) fputs("line of body...\r\n", f);
+	fputs(".\r\n", f);
+	fclose(f);
+
+	// File is larger than block read at once, so it is mapped
+	struct mail *m = read_mail_file("testmailbig");
+	CU_ASSERT(m != 0);
+
+	if (m) {
+		struct rcpt *r = TAILQ_LAST(&m->rcpts, rcpt_list);
+		CU_ASSERT(strcmp(m->from, "MAIL FROM: <mail@mail.com>\r\n") == 0);
+		CU_ASSERT(strcmp(r->name, "third@mail.ru") == 0 && strcmp(domain_id_name(r->domain), "mail.ru") == 0);
+		CU_ASSERT(m->data_offset == strlen(head) && m->data_length == MAIL_READ_SIZE / 16 * 17 + 3);
+		free_mail(m);
+	}
+
+	unlink("../maildir/new/testmailbig");
+}
+
+void maildir_11_test() {
+	int n = PARSER_CHUNK_SIZE * 5 + 3;
+	char **names = malloc(n * sizeof(*names));
+	char name[64];
+
+	for (int i = 0; i < n; ++i) {
+		sprintf(name, "../maildir/new/testparse%d", i);
+		FILE *f = fopen(name, "w");
+		CU_ASSERT(f != NULL);
+		if (f == NULL) return;
+
+		// Every tenth file is broken
+		fprintf(f, "MAIL FROM: <mail@mail.com>\r\nRCPT TO:<user%d@mail.ru>\r\n%s\r\nbody\r\n.\r\n",
+				i, i % 10 ? "DATA" : "BROKEN");
+		fclose(f);
+
+		sprintf(name, "testparse%d", i);
+		names[i] = strdup(name);
+	}
+
+	CU_ASSERT(parser_start(3) && parser_count() == 3);
+	CU_ASSERT(parser_submit(names, n));
+	CU_ASSERT(parser_pending() == n);
+
+	// Mail is taken in order of files, both parsed and broken ones
+	struct parser_job job;
+	int ordered = 0;
+
+	for (int i = 0; i < n - 10 && parser_next(&job); ++i) {
+		sprintf(name, "testparse%d", i);
+		ordered += strcmp(job.name, name) == 0 && (job.mail != 0) == (i % 10 != 0)
+				&& job.status == (i % 10 ? MAIL_PARSED : MAIL_BROKEN);
+
+		if (job.mail) {
+			sprintf(name, "user%d@mail.ru", i);
+			ordered -= strcmp(TAILQ_FIRST(&job.mail->rcpts)->name, name) != 0;
+			free_mail(job.mail);
+		}
+
+		free(job.name);
+	}
+
+	CU_ASSERT(ordered == n - 10);
+	CU_ASSERT(parser_pending() == 10);
+
+	// Next batch is taken only after this one
+	CU_ASSERT(!parser_submit(names, 0));
+
+	// The rest of batch is dropped
+	parser_stop();
+	CU_ASSERT(parser_count() == 0 && parser_pending() == 0);
+
+	for (int i = 0; i < n; ++i) {
+		sprintf(name, "../maildir/new/testparse%d", i);
+		unlink(name);
+	}
+
+	free(names);
+}
+
+void maildir_12_test() {
+	char long_name[DOMAIN_NAME_SIZE + 1];
+	memset(long_name, 'a', DOMAIN_NAME_SIZE);
+	long_name[DOMAIN_NAME_SIZE] = '\0';
+
+	int id = domain_id("Mail.RU", 7);
+	CU_ASSERT(id > 0 && domain_id("mail.ru", 7) == id && domain_id("mail.rux", 7) == id);
+	CU_ASSERT(domain_id("mail.com", 8) != id);
+	CU_ASSERT(strcmp(domain_id_name(id), "mail.ru") == 0);
+	CU_ASSERT(domain_id_name(domain_id_count() + 1) == 0 && domain_id_name(0) == 0);
+	CU_ASSERT(domain_id("", 0) == 0 && domain_id(long_name, DOMAIN_NAME_SIZE) == 0);
+	CU_ASSERT(domain_id(long_name, DOMAIN_NAME_SIZE - 1) > 0);
+
+	// Recipients of the same domain in any case share its number
+	struct mail *m = read_mail_file("testmail3");
+	CU_ASSERT(m != 0);
+	if (m) {
+		struct rcpt *r;
+		TAILQ_FOREACH(r, &m->rcpts, entry) {
+			const char *at = strrchr(r->name, '@');
+			CU_ASSERT(at && strcasecmp(domain_id_name(r->domain), at + 1) == 0);
+			CU_ASSERT(r->domain == domain_id(at + 1, strlen(at + 1)));
+		}
+		free_mail(m);
+	}
+
+	// Mail with new domain is left in NEW, when table of domains is full
+	domain_id_final();
+	char name[32];
+	int n = 0;
+	do {
+		sprintf(name, "d%d.ru", n++);
+	} while (domain_id(name, strlen(name)) > 0);
+	CU_ASSERT(domain_id_count() == DOMAIN_ID_PAGE * DOMAIN_ID_PAGES);
+	CU_ASSERT(domain_id("d1.ru", 5) == 2 && domain_id("mail.ru", 7) == -1);
+
+	mail_status status;
+	CU_ASSERT(parse_mail_file("testmail3", &status) == 0 && status == MAIL_DEFERRED);
+	CU_ASSERT(read_mail_file("testmail3") == 0 && access("../maildir/new/testmail3", F_OK) == 0);
+	domain_id_final();
+}
+
+void maildir_07_test() {
+	CU_ASSERT(maildir_watch_init());
+
+	// First call always scans directory
+	int count = wait_for_new_mail(0, 0, 0);
+	CU_ASSERT(wait_for_new_mail(0, 0, 0) == count);
+
+	FILE *f = fopen("../maildir/new/testmailwatch", "w");
+	CU_ASSERT(f != NULL);
+	if (f == NULL) return;
+	fclose(f);
+
+	CU_ASSERT(wait_for_new_mail(1000, 0, 0) == count + 1);
+
+	// Without pending files waiting is ended by readable wake descriptor
+	DIR *dir = opendir("../maildir/new");
+	struct dirent *de;
+	while (dir && (de = readdir(dir))) spool_forget(de->d_name);
+	if (dir) closedir(dir);
+
+	int wake_fd = eventfd(0, EFD_NONBLOCK);
+	uint64_t one = 1;
+
+	long start = time_ms();
+	CU_ASSERT(wait_for_new_mail(200, &wake_fd, 1) == 0);
+	CU_ASSERT(time_ms() - start >= 150);
+
+	CU_ASSERT(write(wake_fd, &one, sizeof(one)) == sizeof(one));
+	start = time_ms();
+	CU_ASSERT(wait_for_new_mail(5000, &wake_fd, 1) == 0);
+	CU_ASSERT(time_ms() - start < 1000);
+	close(wake_fd);
+
+	unlink("../maildir/new/testmailwatch");
+	maildir_watch_final();
+}
+
+void maildir_08_test() {
+	int count = new_mail_exist();
+	CU_ASSERT(count > 0);
+	CU_ASSERT(new_mail_exist() == count);
+
+	FILE *f = fopen("../maildir/new/testmailscan", "w");
+	CU_ASSERT(f != NULL);
+	if (f == NULL) return;
+	fclose(f);
+
+	CU_ASSERT(new_mail_exist() == count + 1);
+
+	unlink("../maildir/new/testmailscan");
+	CU_ASSERT(new_mail_exist() == count);
+}
+
+
+void maildir_09_test() {
+	char name[32];
+	FILE *f;
+
+	for (int i = 0; i < MAILDIR_BATCH_SIZE + 2; ++i) {
+		sprintf(name, "../maildir/new/testbatch%d", i);
+		f = fopen(name, "w");
+		CU_ASSERT(f != NULL);
+		if (f) fclose(f);
+	}
+
+	// Batches are larger than queue of io_uring
+	maildir_batch_begin();
+	for (int i = 0; i < MAILDIR_BATCH_SIZE + 2; ++i) {
+		sprintf(name, "testbatch%d", i);
+		copy_mail(name, DIR_NEW, DIR_CUR);
+	}
+	maildir_batch_end();
+
+	maildir_batch_begin();
+	for (int i = 0; i < MAILDIR_BATCH_SIZE + 2; ++i) {
+		sprintf(name, "testbatch%d", i);
+		delete_mail(name, DIR_CUR);
+
+		// Operations with the same file keep their order inside a batch
+		if (i % 2) {
+			delete_mail(name, DIR_NEW);
+		} else {
+			copy_mail(name, DIR_NEW, DIR_CUR);
+			move_mail(name, DIR_NEW, DIR_NOTSENT);
+			delete_mail(name, DIR_CUR);
+		}
+	}
+	maildir_batch_end();
+
+	int left = 0;
+	for (int i = 0; i < MAILDIR_BATCH_SIZE + 2; ++i) {
+		sprintf(name, "../maildir/new/testbatch%d", i);
+		left += access(name, F_OK) == 0;
+		sprintf(name, "../maildir/cur/testbatch%d", i);
+		left += access(name, F_OK) == 0;
+		sprintf(name, "../maildir/not_sent/testbatch%d", i);
+		CU_ASSERT((access(name, F_OK) == 0) == !(i % 2));
+		unlink(name);
+	}
+
+	CU_ASSERT(left == 0);
+}
+
 
 void regexp_01_test() {
 	char *msg = "220 hello!\r\n";
@@ -85,23 +340,186 @@ void regexp_09_test() {
 	CU_ASSERT(!re_match(RE_rcpt_to, msg, strlen(msg)));
 }
 
+// Returns 1 if scanner finds same line and parts of it as regexps do
+int envelope_agrees(char *buf, int length) {
+	char name[MAIL_LINE_SIZE], domain[MAIL_LINE_SIZE];
+	struct envelope_line l;
+	char *eol = memchr(buf, '\n', length);
+	int n = eol ? eol - buf + 1 : 0;
+
+	if (envelope_scan(buf, length, &l) != n) return 0;
+	if (!n) return l.type == ENVELOPE_INVALID;
+
+	if (re_match(RE_data, buf, n)) return l.type == ENVELOPE_DATA;
+	if (re_match(RE_mail_from, buf, n)) return l.type == ENVELOPE_MAIL_FROM;
+
+	if (!re_match_and_fill_substring(RE_rcpt_to, buf, n, name)
+			|| !re_match_and_fill_substring(RE_rcpt_domain, buf, n, domain)) {
+		return l.type == ENVELOPE_INVALID;
+	}
+
+	return l.type == ENVELOPE_RCPT_TO
+			&& l.name_length == strlen(name) && memcmp(buf + l.name, name, l.name_length) == 0
+			&& l.domain_length == strlen(domain) && memcmp(buf + l.domain, domain, l.domain_length) == 0;
+}
+
+void envelope_01_test() {
+	char *lines[] = {
+		"MAIL FROM: <mail@mail.com>\r\n",
+		"mail from:<>\r\n",
+		"MAIL FROM:\t<a>\r\n",
+		"MAIL FROM: mail@mail.com\r\n",
+		"RCPT TO:<othermail@gmail.com>\r\n",
+		"Rcpt To: \t <a@b@c>\r\n",
+		"RCPT TO:<a@b@>\r\n",
+		"RCPT TO:<@b>\r\n",
+		"RCPT TO:<mmm%mail.com>\r\n",
+		"RCPT TO:<mmm@mail.com\r\n",
+		"RCPT TO:<mmm@mail.com>\n",
+		"RCPT TO:<a very long name of recipient, which is longer than vector@and.its.domain.too>\r\n",
+		"DATA\r\n",
+		"data\r\nRCPT TO:<a@b>\r\n",
+		"DATA \r\n",
+		"DATA"
+	};
+
+	for (int impl = 0; impl < envelope_impl_count; ++impl) {
+		if (!envelope_select(impl)) continue;
+
+		for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+			CU_ASSERT(envelope_agrees(lines[i], strlen(lines[i])));
+		}
+	}
+
+	struct envelope_line l;
+	char *rcpt = "RCPT TO:<a@b@c>\r\n";
+
+	CU_ASSERT(envelope_scan(rcpt, strlen(rcpt), &l) == strlen(rcpt) && l.type == ENVELOPE_RCPT_TO);
+	CU_ASSERT(l.name == 9 && l.name_length == 5 && l.domain == 13 && l.domain_length == 1);
+
+	envelope_init();
+}
+
+void envelope_02_test() {
+	// Lines are built of pieces, which are likely to be parts of envelope
+	char *pieces[] = {
+		"MAIL FROM:", "RCPT TO:", "rcpt to:", "DATA", " ", "\t", "\r", "\n", "<", ">",
+		"@", "@@", "a", "user.name", "example.com", "\r\n", ">\r\n", "%"
+	};
+	int count = sizeof(pieces) / sizeof(pieces[0]);
+	char buf[256];
+	int failed = 0;
+
+	srand(22);
+
+	for (int impl = 0; impl < envelope_impl_count; ++impl) {
+		if (!envelope_select(impl)) continue;
+
+		for (int i = 0; i < 100000; ++i) {
+			int length = 0;
+
+			// Most lines start with keyword and end with address
+			if (rand() % 4) {
+				char *word = pieces[rand() % 4];
+				length += sprintf(buf, "%s%s<", word, rand() % 2 ? " " : "");
+			}
+
+			for (int k = rand() % 24; k > 0; --k) {
+				char *p = pieces[rand() % count];
+				int n = strlen(p);
+
+				if (length + n + 3 > sizeof(buf)) break;
+
+				memcpy(buf + length, p, n);
+				length += n;
+			}
+
+			if (rand() % 4) {
+				memcpy(buf + length, ">\r\n", 3);
+				length += 3;
+			}
+
+			if (!envelope_agrees(buf, length)) failed++;
+		}
+	}
+
+	CU_ASSERT(failed == 0);
+
+	envelope_init();
+}
+
+// Gives test domain its number and interned name
+void name_domain(struct domain *d, const char *name) {
+	d->id = domain_id(name, strlen(name));
+	d->name = domain_id_name(d->id);
+}
+
+void reply_01_test() {
+	char *msg = "250 OK\r\n354 go on\r\n";
+	int last = -1;
+	CU_ASSERT(reply_frame(msg, strlen(msg), &last) == 8);
+	CU_ASSERT(last == 0);
+	CU_ASSERT(reply_frame(msg + 8, strlen(msg) - 8, &last) == 11);
+}
+
+void reply_02_test() {
+	char *msg = "250 O";
+	CU_ASSERT(reply_frame(msg, strlen(msg), 0) == 0);
+}
+
+void reply_03_test() {
+	char *msg = "250-mx.mail.com\r\n250-PIPELINING\r\n250 8BITMIME\r\n";
+	int last = -1;
+	CU_ASSERT(reply_frame(msg, strlen(msg), &last) == strlen(msg));
+	CU_ASSERT(last == 33);
+	CU_ASSERT(reply_frame(msg, 33, 0) == 0);
+}
+
+void reply_04_test() {
+	struct domain dom = {0};
+	name_domain(&dom, "mail.com");
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->state = SMTP_CLIENT_FSM_ST_QUIT;
+	conn->dom = &dom;
+
+	char *msg = "221-closing\r\n221 bye\r\n";
+	parse_response(conn, msg, strlen(msg));
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_DONE);
+	timer_cancel(&conn->timeout);
+	free(conn);
+}
+
+
+void reply_05_test() {
+	char *msg = "250-mx.mail.com\r\n250-SIZE 1000000\r\n250-pipelining\r\n250 8BITMIME\r\n";
+	CU_ASSERT(ehlo_capabilities(msg, strlen(msg)) == SMTP_CAP_PIPELINING);
+
+	msg = "250-mx.mail.com\r\n250-PIPELININGX\r\n250 X-PIPELINING\r\n";
+	CU_ASSERT(ehlo_capabilities(msg, strlen(msg)) == 0);
+
+	msg = "250-mx.mail.com\r\n250-CHUNKING\r\n250 PIPELINING\r\n";
+	CU_ASSERT(ehlo_capabilities(msg, strlen(msg)) == (SMTP_CAP_PIPELINING | SMTP_CAP_CHUNKING));
+}
+
+
 void fsm_01_test() {
 	struct mail *m = read_mail_file("testmailfsm1");
 	CU_ASSERT(m != NULL);
 	if (m == NULL) return;
 
-	struct domain dom;
-	strcpy(dom.name, "mail.com");
-
-	struct mail_list ml;
-	TAILQ_INIT(&ml);
-	TAILQ_INSERT_TAIL(&ml, m, entry);
+	struct domain dom = {0};
+	name_domain(&dom, "mail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m);
 
-	struct mx_conn *conn = malloc(sizeof(*conn));
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
 	conn->state = SMTP_CLIENT_FSM_ST_INIT;
-	conn->m = m;
-	conn->r = TAILQ_FIRST(&m->rcpts);
 	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m->rcpts);
 
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
@@ -109,6 +527,8 @@ void fsm_01_test() {
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_EXPIRE, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R221, conn);
 
 	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_DONE);
@@ -123,19 +543,19 @@ void fsm_02_test() {
 	CU_ASSERT(m2 != NULL);
 	if (m2 == NULL) return;
 
-	struct domain dom;
-	strcpy(dom.name, "gmail.com");
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m1);
+	domain_enqueue_mail(&dom, m2);
 
-	struct mail_list ml;
-	TAILQ_INIT(&ml);
-	TAILQ_INSERT_TAIL(&ml, m1, entry);
-	TAILQ_INSERT_TAIL(&ml, m2, entry);
-
-	struct mx_conn *conn = malloc(sizeof(*conn));
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
 	conn->state = SMTP_CLIENT_FSM_ST_INIT;
-	conn->m = m1;
-	conn->r = TAILQ_FIRST(&m1->rcpts);
 	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m1->rcpts);
 
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
@@ -149,6 +569,8 @@ void fsm_02_test() {
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_EXPIRE, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R221, conn);
 	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_DONE);
 }
@@ -158,18 +580,18 @@ void fsm_03_test() {
 	CU_ASSERT(m != NULL);
 	if (m == NULL) return;
 
-	struct domain dom;
-	strcpy(dom.name, "mail.com");
-
-	struct mail_list ml;
-	TAILQ_INIT(&ml);
-	TAILQ_INSERT_TAIL(&ml, m, entry);
+	struct domain dom = {0};
+	name_domain(&dom, "mail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m);
 
-	struct mx_conn *conn = malloc(sizeof(*conn));
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
 	conn->state = SMTP_CLIENT_FSM_ST_INIT;
-	conn->m = m;
-	conn->r = TAILQ_FIRST(&m->rcpts);
 	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m->rcpts);
 
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
 	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
@@ -179,92 +601,1685 @@ void fsm_03_test() {
 	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_INVALID);
 }
 
+void fsm_04_test() {
+	struct mail *m1 = read_mail_file("testmailfsm2");
+	CU_ASSERT(m1 != NULL);
+	if (m1 == NULL) return;
 
-int init_maildir_suite() {
-	maildir_init();
-	re_init();
-	return 0;
-}
+	struct mail *m2 = read_mail_file("testmailfsm3");
+	CU_ASSERT(m2 != NULL);
+	if (m2 == NULL) return;
 
-int clean_maildir_suite() {
-	maildir_final();
-	re_final();
-	return 0;
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m1);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m1->rcpts);
+	TAILQ_INIT(&dom.conns);
+	TAILQ_INSERT_TAIL(&dom.conns, conn, dom_entry);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+
+	// Mail arrives while session is running
+	domain_enqueue_mail(&dom, m2);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_MAILFROM);
+	CU_ASSERT(conn->m == m2);
+	CU_ASSERT(m1->pending == 0 && m1->was_sent);
 }
 
-int init_regexp_suite() {
-	re_init();
-	return 0;
+
+// Registers both ends of socket pair, writes into one end and checks
+// that event is reported with data of the other end
+void fsm_05_test() {
+	struct mail *m = read_mail_file("testmailfsm1");
+	CU_ASSERT(m != NULL);
+	if (m == NULL) return;
+
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_EHLO);
+
+	conn->caps = SMTP_CAP_PIPELINING;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_ENVELOPE);
+	CU_ASSERT(conn->replies == 3);
+
+	// Recipients from other domains are not part of envelope
+	name_domain(&dom, "mail.com");
+	CU_ASSERT(send_envelope(conn) == 2);
+	name_domain(&dom, "gmail.com");
+	conn->replies = 3;
+
+	// 354 for DATA can't come before replies for MAIL FROM and RCPT TO
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_ENVELOPE);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_ENVELOPE);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_DATASTR);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_EXPIRE, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R221, conn);
+
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_DONE);
 }
 
-int clean_regexp_suite() {
-	re_final();
-	return 0;
+
+void fsm_06_test() {
+	struct mail *m = read_mail_file("testmailfsm1");
+	CU_ASSERT(m != NULL);
+	if (m == NULL) return;
+
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	conn->caps = SMTP_CAP_PIPELINING;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_INVALID);
 }
 
-int init_fsm_suite() {
-	maildir_init();
-	re_init();
-	return 0;
+
+void fsm_07_test() {
+	struct domain dom = {0};
+	name_domain(&dom, "mail.com");
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_EHLO;
+	conn->dom = &dom;
+
+	char *msg = "502 command not implemented\r\n";
+	parse_response(conn, msg, strlen(msg));
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_HELO);
+	CU_ASSERT(conn->caps == 0);
+	timer_cancel(&conn->timeout);
+	free(conn);
 }
 
-int clean_fsm_suite() {
-	maildir_final();
-	re_final();
-	return 0;
+
+void fsm_08_test() {
+	struct domain_set set;
+	TAILQ_INIT(&set);
+
+	struct domain *d = domain_add(&set, domain_id("mail.com", 8));
+	CU_ASSERT(d != NULL && domain_add(&set, domain_id("MAIL.com", 8)) == d);
+	if (d == NULL) return;
+
+	int per_session = opts_mails_per_session();
+	int expected = opts_min_sessions() > 2 ? opts_min_sessions() : 2;
+	if (expected > opts_max_sessions()) expected = opts_max_sessions();
+
+	d->queued = 0;
+	CU_ASSERT(domain_session_target(d) == opts_min_sessions());
+	d->queued = per_session + 1;
+	CU_ASSERT(domain_session_target(d) == expected);
+	d->queued = per_session * 100;
+	CU_ASSERT(domain_session_target(d) == opts_max_sessions());
+
+	// Domain whose MX refused extra sessions
+	d->max_conns = 1;
+	CU_ASSERT(domain_session_target(d) == 1);
+
+	// Structure of removed domain is reused by the next one
+	free_domain(&set, d);
+	CU_ASSERT(TAILQ_EMPTY(&set));
+
+	struct domain *next = domain_add(&set, domain_id("gmail.com", 9));
+	CU_ASSERT(next == d && next->id == domain_id("gmail.com", 9) && !strcmp(next->name, "gmail.com"));
+	CU_ASSERT(next->max_conns == opts_max_sessions() && next->queued == 0 && next->mx_count == 0);
+	free_domain(&set, next);
 }
 
-struct test maildir_tests[] = {
-	{maildir_01_test, "Correct mail file."},
-	{maildir_03_test, "Mail file with multiple recipients."},
-	{maildir_05_test, "Mail file with multiple senders."},
-	{maildir_02_test, "Mail file without recipients."},
-	{maildir_06_test, "Mail file without DATA."},
-	{maildir_04_test, "Mail file without dot."}
-};
 
-struct test regexp_tests[] = {
-	{regexp_01_test, "Correct R220."},
-	{regexp_03_test, "Correct MAIL FROM."},
-	{regexp_02_test, "Incorrect R354."},
-	{regexp_04_test, "Incorrect RCPT TO."},
-	{regexp_05_test, "Incorrect RCPT TO."},
-	{regexp_09_test, "Correct regexp, but incorrect param."},
-	{regexp_06_test, "Match any, should be r250."},
-	{regexp_07_test, "Match any, should be DATA."},
-	{regexp_08_test, "Match any, should be RCPT TO."},
-};
+void fsm_09_test() {
+	struct mail m1 = {0}, m2 = {0};
+	struct domain dom = {0};
+	TAILQ_INIT(&dom.queue);
+	TAILQ_INIT(&dom.conns);
 
-struct test fsm_tests[] = {
-	{fsm_01_test, "Correct minimal session."},
-	{fsm_02_test, "Correct session with 2 mails with multiple recipients."},
-	{fsm_03_test, "Incorrect session."},
-};
+	// Mail with two recipients of domain is queued once
+	domain_enqueue_mail(&dom, &m1);
+	domain_enqueue_mail(&dom, &m1);
+	domain_enqueue_mail(&dom, &m2);
+	CU_ASSERT(dom.queued == 2 && m1.pending == 1);
 
-int main(int argc, char **argv) {
-	opts_init();
+	CU_ASSERT(domain_next_mail(&dom) == &m1);
+	domain_requeue_mail(&dom, &m1);
+	CU_ASSERT(dom.queued == 2 && m1.pending == 1);
 
-	CU_pSuite maildir_suite = NULL;
-	CU_pSuite regexp_suite = NULL;
-	CU_pSuite fsm_suite = NULL;
+	CU_ASSERT(domain_next_mail(&dom) == &m1);
+	CU_ASSERT(domain_next_mail(&dom) == &m2);
+	CU_ASSERT(domain_next_mail(&dom) == NULL && dom.queued == 0);
+}
 
-	if (CU_initialize_registry() != CUE_SUCCESS) goto exit;
 
-	if (!(maildir_suite = CU_add_suite("Test maildir.", init_maildir_suite, clean_maildir_suite))) goto clean;
-	for (int i = 0; i < sizeof(maildir_tests) / sizeof(struct test); ++i) {
-		if (!CU_add_test(maildir_suite, maildir_tests[i].name, maildir_tests[i].func)) goto clean;
-	}
+void fsm_10_test() {
+	struct mail *m1 = read_mail_file("testmailfsm2");
+	CU_ASSERT(m1 != NULL);
+	if (m1 == NULL) return;
 
-	if (!(regexp_suite = CU_add_suite("Test regexp.", init_regexp_suite, clean_regexp_suite))) goto clean;
-	for (int i = 0; i < sizeof(regexp_tests) / sizeof(struct test); ++i) {
-		if (!CU_add_test(regexp_suite, regexp_tests[i].name, regexp_tests[i].func)) goto clean;
-	}
+	struct mail *m2 = read_mail_file("testmailfsm3");
+	CU_ASSERT(m2 != NULL);
+	if (m2 == NULL) return;
 
-	if (!(fsm_suite = CU_add_suite("Test FSM.", init_fsm_suite, clean_fsm_suite))) goto clean;
-	for (int i = 0; i < sizeof(fsm_tests) / sizeof(struct test); ++i) {
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	TAILQ_INIT(&dom.conns);
+	domain_enqueue_mail(&dom, m1);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m1->rcpts);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	CU_ASSERT(conn->m == NULL);
+
+	// Mail arrives after session became idle
+	domain_enqueue_mail(&dom, m2);
+	conn_wakeup(conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_RSET);
+	CU_ASSERT(conn->m == m2 && conn->reused);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_MAILFROM && !conn->reused);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	CU_ASSERT(m2->pending == 0 && m2->was_sent);
+	timer_cancel(&conn->timeout);
+}
+
+
+void fsm_12_test() {
+	struct mail *m = read_mail_file("testmailfsm1");
+	CU_ASSERT(m != NULL);
+	if (m == NULL) return;
+
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	conn->caps = SMTP_CAP_PIPELINING | SMTP_CAP_CHUNKING;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_BDAT);
+
+	// MAIL FROM, RCPT TO and BDAT LAST with whole body
+	CU_ASSERT(conn->replies == 3);
+
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_BDAT);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	CU_ASSERT(m->pending == 0 && m->was_sent);
+
+	// There is no DATA to reply to
+	conn->state = SMTP_CLIENT_FSM_ST_BDAT;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R354, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_INVALID);
+	free(conn);
+}
+
+
+void fsm_13_test() {
+	struct mail *m1 = read_mail_file("testmailfsm2");
+	CU_ASSERT(m1 != NULL);
+	if (m1 == NULL) return;
+
+	struct mail *m2 = read_mail_file("testmailfsm3");
+	CU_ASSERT(m2 != NULL);
+	if (m2 == NULL) return;
+
+	struct domain dom = {0};
+	name_domain(&dom, "gmail.com");
+	TAILQ_INIT(&dom.queue);
+	domain_enqueue_mail(&dom, m1);
+	domain_enqueue_mail(&dom, m2);
+
+	struct mx_conn *conn = calloc(1, sizeof(*conn));
+	conn->sock = -1;
+	TAILQ_INIT(&conn->out);
+	conn->state = SMTP_CLIENT_FSM_ST_INIT;
+	conn->dom = &dom;
+	conn->m = domain_next_mail(&dom);
+	conn->r = TAILQ_FIRST(&m1->rcpts);
+
+	// Without pipelining every command waits for its reply
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R220, conn);
+	conn->caps = SMTP_CAP_CHUNKING;
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_BDAT && conn->replies == 1);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_MAILFROM && conn->m == m2);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_BDAT);
+	conn->state = smtp_client_fsm_step(conn->state, SMTP_CLIENT_FSM_EV_R250, conn);
+	CU_ASSERT(conn->state == SMTP_CLIENT_FSM_ST_IDLE);
+	CU_ASSERT(m1->pending == 0 && m2->pending == 0);
+	free(conn);
+}
+
+
+// Writes mail file with recipient of given length
+static void write_long_rcpt(const char *name, int length) {
+	char path[100], rcpt[MAIL_LINE_SIZE];
+	sprintf(path, "../maildir/new/%s", name);
+	memset(rcpt, 'a', length - 8);
+	strcpy(rcpt + length - 8, "@mail.ru");
+
+	FILE *f = fopen(path, "w");
+	CU_ASSERT(f != NULL);
+	if (f == NULL) return;
+	fprintf(f, "MAIL FROM: <mail@mail.com>\r\nRCPT TO:<%s>\r\nDATA\r\nbody\r\n.\r\n", rcpt);
+	fclose(f);
+}
+
+void fsm_14_test() {
+	mail_status status;
+	write_long_rcpt("testmaillong", MAIL_NAME_SIZE + 40);
+	CU_ASSERT(parse_mail_file("testmaillong", &status) == 0 && status == MAIL_BROKEN);
+	unlink("../maildir/new/testmaillong");
+
+	// The longest recipient is sent whole by RCPT TO without pipelining
+	write_long_rcpt("testmaillong", MAIL_NAME_SIZE - 1);
+	struct mail *m = parse_mail_file("testmaillong", &status);
+	unlink("../maildir/new/testmaillong");
+	CU_ASSERT(m != NULL);
+	if (m == NULL) return;
+
+	int fd[2];
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	name_domain(&dom, "mail.ru");
+	conn.sock = fd[0];
+	conn.dom = &dom;
+	conn.m = m;
+	conn.r = TAILQ_FIRST(&m->rcpts);
+	TAILQ_INIT(&conn.out);
+
+	CU_ASSERT(send_rcptto(&conn) == 1 && conn.r == 0);
+
+	char buf[MAIL_LINE_SIZE], expected[MAIL_LINE_SIZE];
+	int length = sprintf(expected, "RCPT TO: <%s>\r\n", TAILQ_FIRST(&m->rcpts)->name);
+	CU_ASSERT(recv(fd[1], buf, sizeof(buf), MSG_DONTWAIT) == length && memcmp(buf, expected, length) == 0);
+
+	close(fd[0]);
+	close(fd[1]);
+	free_mail(m);
+}
+
+
+void event_backend_test(const char *backend) {
+	int fd[2];
+	int a = 1, b = 2;
+
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	CU_ASSERT(event_init(backend));
+
+	CU_ASSERT(event_add(fd[0], EVENT_READ, &a));
+	CU_ASSERT(event_add(fd[1], EVENT_READ, &b));
+
+	struct event evs[2];
+	CU_ASSERT(event_wait(evs, 2, 0) == 0);
+
+	send(fd[1], "x", 1, 0);
+	CU_ASSERT(event_wait(evs, 2, 1000) == 1);
+	CU_ASSERT(evs[0].data == &a && (evs[0].events & EVENT_READ));
+
+	CU_ASSERT(event_del(fd[0]));
+	CU_ASSERT(event_wait(evs, 2, 0) == 0);
+
+	CU_ASSERT(event_mod(fd[1], EVENT_WRITE, &b));
+	CU_ASSERT(event_wait(evs, 2, 0) == 1);
+	CU_ASSERT(evs[0].data == &b && (evs[0].events & EVENT_WRITE));
+
+	event_final();
+	close(fd[0]);
+	close(fd[1]);
+}
+
+void fsm_11_test() {
+	struct domain dom = {0};
+	struct dns_result res = {0};
+	name_domain(&dom, "example.com");
+	TAILQ_INIT(&dom.queue);
+	TAILQ_INIT(&dom.conns);
+
+	// Addresses of MX are cached, so domain is resolved at once
+	dns_cache_init(0);
+	res.status = DNS_OK;
+	res.count = 1;
+	res.ttl = 60;
+	res.addr[0].family = AF_INET;
+	res.addr[0].v4.s_addr = htonl(INADDR_LOOPBACK);
+	dns_cache_store("mx1.example.com", DNS_T_A, &res);
+	dns_cache_store("mx2.example.com", DNS_T_A, &res);
+	dns_cache_store("mx3.example.com", DNS_T_A, &res);
+
+	res.status = DNS_NODATA;
+	res.count = 0;
+	dns_cache_store("mx1.example.com", DNS_T_AAAA, &res);
+	dns_cache_store("mx2.example.com", DNS_T_AAAA, &res);
+	dns_cache_store("mx3.example.com", DNS_T_AAAA, &res);
+
+	res.status = DNS_OK;
+	res.count = 3;
+	res.mx[0].pref = 20;
+	strcpy(res.mx[0].host, "mx3.example.com");
+	res.mx[1].pref = 10;
+	strcpy(res.mx[1].host, "mx1.example.com");
+	res.mx[2].pref = 10;
+	strcpy(res.mx[2].host, "mx2.example.com");
+
+	dom.dns_state = DOMAIN_DNS_MX;
+	dom.dns_pending = 1;
+	domain_mx_resolved(&dom, dom.name, &res);
+
+	CU_ASSERT(dom.dns_state == DOMAIN_DNS_READY && dom.dns_pending == 0);
+	CU_ASSERT(dom.mx_count == 3 && domain_mx_alive(&dom) == 3);
+	CU_ASSERT(dom.mxs[0].pref == 10 && dom.mxs[1].pref == 10 && dom.mxs[2].pref == 20);
+	CU_ASSERT(!strcmp(dom.mxs[2].host, "mx3.example.com") && dom.mxs[2].addr_count == 1);
+
+	// Sessions are spread over MX with best preference
+	struct domain_mx *first = domain_pick_mx(&dom), *second = domain_pick_mx(&dom);
+	CU_ASSERT(first && second && first != second);
+	CU_ASSERT(first->pref == 10 && second->pref == 10);
+	CU_ASSERT(domain_pick_mx(&dom) == first);
+
+	// Failed MX is skipped, and next preference is used when all best fail
+	first->failed = 1;
+	CU_ASSERT(domain_pick_mx(&dom) == second && domain_pick_mx(&dom) == second);
+	second->failed = 1;
+	CU_ASSERT(domain_pick_mx(&dom) == domain_find_mx(&dom, "mx3.example.com"));
+	CU_ASSERT(domain_mx_alive(&dom) == 1);
+
+	domain_find_mx(&dom, "mx3.example.com")->failed = 1;
+	CU_ASSERT(domain_pick_mx(&dom) == NULL && domain_mx_alive(&dom) == 0);
+
+	dns_cache_final();
+}
+
+
+void event_01_test() {
+	event_backend_test("poll");
+	CU_ASSERT(event_current_backend() == EVENT_BACKEND_POLL);
+
+	// Descriptor, which was not added or is already removed, is rejected
+	// and does not spoil slots of others
+	int fd[2], a = 1;
+	struct event evs[2];
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	CU_ASSERT(event_init("poll"));
+	CU_ASSERT(event_add(fd[0], EVENT_READ, &a));
+	CU_ASSERT(!event_del(fd[1]) && !event_mod(fd[1], EVENT_WRITE, &a));
+
+	send(fd[1], "x", 1, 0);
+	CU_ASSERT(event_wait(evs, 2, 1000) == 1 && evs[0].data == &a);
+	CU_ASSERT(event_del(fd[0]) && !event_del(fd[0]));
+	CU_ASSERT(event_wait(evs, 2, 0) == 0);
+
+	event_final();
+	close(fd[0]);
+	close(fd[1]);
+}
+
+void event_02_test() {
+	event_backend_test("epoll");
+	CU_ASSERT(event_current_backend() == EVENT_BACKEND_EPOLL);
+}
+
+
+void event_03_test() {
+	int fd[2], size = 4096;
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	setsockopt(fd[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	CU_ASSERT(event_init("poll"));
+
+	conn.sock = fd[0];
+	conn.dom = &dom;
+	TAILQ_INIT(&conn.out);
+	CU_ASSERT(event_add(fd[0], EVENT_READ, &conn));
+
+	int length = 1 << 20;
+	char *data = calloc(1, length);
+	CU_ASSERT(conn_write(&conn, data, length, 0));
+	CU_ASSERT(!TAILQ_EMPTY(&conn.out) && conn.out_bytes > 0);
+	CU_ASSERT(conn_write(&conn, "QUIT\r\n", 6, 1));
+
+	struct event evs[1];
+	char buf[65536];
+	int got = 0, res;
+
+	while (got < length + 6) {
+		while ((res = recv(fd[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) got += res;
+		if (TAILQ_EMPTY(&conn.out)) continue;
+		if (event_wait(evs, 1, 1000) != 1) break;
+		CU_ASSERT(evs[0].events & EVENT_WRITE);
+		CU_ASSERT(conn_flush(&conn));
+	}
+
+	CU_ASSERT(got == length + 6 && conn.out_bytes == 0);
+	CU_ASSERT(event_wait(evs, 1, 0) == 0);
+
+	event_final();
+	free(data);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+
+void event_04_test() {
+	struct sockaddr_in sa = {0};
+	socklen_t len = sizeof(sa);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CU_ASSERT(bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+	CU_ASSERT(listen(lsock, 1) == 0);
+	getsockname(lsock, (struct sockaddr *)&sa, &len);
+
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+	conn.sock = -1;
+	conn.dom = &dom;
+	conn.port = ntohs(sa.sin_port);
+	conn.addrs[0].family = AF_INET;
+	conn.addrs[0].v4 = sa.sin_addr;
+	conn.addr_count = 1;
+	TAILQ_INIT(&conn.out);
+	conn_setup_timers(&conn);
+
+	CU_ASSERT(event_init("poll"));
+	CU_ASSERT(conn_connect_next(&conn));
+	CU_ASSERT(conn.connecting && conn.attempt_count == 1 && conn.sock == -1);
+
+	struct event evs[1];
+	CU_ASSERT(event_wait(evs, 1, 1000) == 1);
+	CU_ASSERT(evs[0].data == &conn && (evs[0].events & EVENT_WRITE));
+
+	conn_connected(&conn);
+	CU_ASSERT(!conn.connecting && conn.sock >= 0 && conn.attempt_count == 0);
+	CU_ASSERT(conn.state != SMTP_CLIENT_FSM_ST_INVALID);
+
+	// Nobody listens anymore, and there are no other addresses
+	event_del(conn.sock);
+	close(conn.sock);
+	close(lsock);
+	conn.sock = -1;
+	conn.addr_next = 0;
+
+	if (conn_connect_next(&conn)) {
+		CU_ASSERT(event_wait(evs, 1, 1000) == 1);
+		conn_connected(&conn);
+		CU_ASSERT(conn.state == SMTP_CLIENT_FSM_ST_INVALID);
+	}
+
+	CU_ASSERT(conn.addr_next == conn.addr_count && conn.sock == -1 && conn.attempt_count == 0);
+	timer_cancel(&conn.timeout);
+	event_final();
+}
+
+
+void event_05_test() {
+	struct sockaddr_in good = {0}, blackhole;
+	socklen_t len = sizeof(good);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	int bsock = socket(AF_INET, SOCK_STREAM, 0);
+	int filler = socket(AF_INET, SOCK_STREAM, 0);
+
+	good.sin_family = AF_INET;
+	good.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CU_ASSERT(bind(lsock, (struct sockaddr *)&good, sizeof(good)) == 0);
+	CU_ASSERT(listen(lsock, 1) == 0);
+	getsockname(lsock, (struct sockaddr *)&good, &len);
+
+	// Listener with full backlog on another loopback address drops SYNs
+	blackhole = good;
+	blackhole.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1);
+	CU_ASSERT(bind(bsock, (struct sockaddr *)&blackhole, sizeof(blackhole)) == 0);
+	CU_ASSERT(listen(bsock, 0) == 0);
+	CU_ASSERT(connect(filler, (struct sockaddr *)&blackhole, sizeof(blackhole)) == 0);
+
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+	conn.sock = -1;
+	conn.dom = &dom;
+	conn.port = ntohs(good.sin_port);
+	conn.addrs[0].family = AF_INET;
+	conn.addrs[0].v4 = blackhole.sin_addr;
+	conn.addrs[1].family = AF_INET;
+	conn.addrs[1].v4 = good.sin_addr;
+	conn.addr_count = 2;
+	TAILQ_INIT(&conn.out);
+	conn_setup_timers(&conn);
+
+	CU_ASSERT(event_init("poll"));
+
+	long start = time_ms();
+	CU_ASSERT(conn_connect_next(&conn));
+
+	// Loop of conn_loop(): second address is tried by timer, while the
+	// first one is still connecting
+	struct event evs[4];
+	while (conn.connecting && time_ms() - start < 3000) {
+		int left = timer_next_timeout(time_ms());
+
+		if (event_wait(evs, 4, left < 0 ? 1000 : left) > 0) {
+			conn_connected(&conn);
+		} else {
+			CU_ASSERT(conn.attempt_count == 1);
+			timer_run(time_ms());
+		}
+	}
+
+	long elapsed = time_ms() - start;
+	CU_ASSERT(!conn.connecting && conn.sock >= 0 && conn.attempt_count == 0);
+	CU_ASSERT(elapsed >= CONNECT_ATTEMPT_DELAY && elapsed < 2 * CONNECT_ATTEMPT_DELAY);
+
+	struct sockaddr_in peer;
+	len = sizeof(peer);
+	CU_ASSERT(getpeername(conn.sock, (struct sockaddr *)&peer, &len) == 0);
+	CU_ASSERT(peer.sin_addr.s_addr == good.sin_addr.s_addr);
+
+	timer_cancel(&conn.timeout);
+	event_del(conn.sock);
+	close(conn.sock);
+	event_final();
+	close(filler);
+	close(bsock);
+	close(lsock);
+}
+
+
+// Sends message body from mail file through output queue with specified
+// event backend
+static void send_file_test(const char *backend) {
+	maildir_init();
+	re_init();
+
+	struct mail *m = read_mail_file("testmail1");
+	CU_ASSERT(m != 0);
+	if (m == 0) return;
+
+	int fd[2];
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	CU_ASSERT(event_init(backend));
+
+	conn.sock = fd[0];
+	conn.dom = &dom;
+	TAILQ_INIT(&conn.out);
+	CU_ASSERT(event_add(conn.sock, event_async() ? 0 : EVENT_READ, &conn));
+
+	CU_ASSERT(conn_write(&conn, "DATA\r\n", 6, 0));
+	struct out_file *file = out_file_open(open_mail_data(m));
+	CU_ASSERT(file && file->fd >= 0);
+	CU_ASSERT(conn_write_file(&conn, file, m->data_offset, m->data_length));
+	out_file_release(file);
+	CU_ASSERT(conn_write(&conn, "QUIT\r\n", 6, 0));
+
+	struct event evs[1];
+	char buf[100];
+	int got = 0, res;
+
+	while (got < 23) {
+		while ((res = recv(fd[1], buf + got, sizeof(buf) - got, MSG_DONTWAIT)) > 0) got += res;
+		if (TAILQ_EMPTY(&conn.out)) continue;
+		if (event_wait(evs, 1, 1000) != 1) break;
+		if (evs[0].events & EVENT_WRITE) conn_flush(&conn);
+		if (evs[0].events & EVENT_SEND) conn_sent(&conn, evs[0].send_res);
+	}
+
+	CU_ASSERT(got == 23 && memcmp(buf, "DATA\r\nhello!\r\n.\r\nQUIT\r\n", 23) == 0);
+	CU_ASSERT(TAILQ_EMPTY(&conn.out) && conn.out_bytes == 0 && !conn.out_error);
+
+	event_del(conn.sock);
+	event_final();
+	close(fd[0]);
+	close(fd[1]);
+	free_mail(m);
+	maildir_final();
+	re_final();
+}
+
+
+void event_08_test() {
+	send_file_test("poll");
+	send_file_test("io_uring");
+}
+
+
+// Sends body with dot-stuffed lines by BDAT chunks and checks that server
+// gets body without added dots, split into chunks of BDAT_CHUNK_SIZE
+void event_09_test() {
+	maildir_init();
+	re_init();
+
+	const char *head = "MAIL FROM: <mail@mail.com>\r\nRCPT TO:<othermail@gmail.com>\r\nDATA\r\n";
+	int body_size = BDAT_CHUNK_SIZE + 1000;
+	char *body = malloc(body_size + 100), *stuffed = malloc(2 * body_size + 100);
+	int length = 0, stuffed_length = 0;
+
+	// Lines start with dots at chunk boundary and next to it
+	while (length < body_size) {
+		const char *line = length / 100 % 2 ? ".hidden line\r\n" : "plain text line\r\n";
+		if (length >= BDAT_CHUNK_SIZE - 20 && length <= BDAT_CHUNK_SIZE) line = ".\r\n";
+
+		if (line[0] == '.') stuffed[stuffed_length++] = '.';
+		strcpy(body + length, line);
+		strcpy(stuffed + stuffed_length, line);
+		length += strlen(line);
+		stuffed_length += strlen(line);
+	}
+
+	FILE *f = fopen("../maildir/new/testmailbdat", "w");
+	CU_ASSERT(f != NULL);
+	if (f == NULL) return;
+	fprintf(f, "%s%s.\r\n", head, stuffed);
+	fclose(f);
+
+	struct mail *m = read_mail_file("testmailbdat");
+	CU_ASSERT(m != 0);
+	if (m == 0) return;
+
+	int fd[2];
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	CU_ASSERT(event_init("poll"));
+
+	conn.sock = fd[0];
+	conn.dom = &dom;
+	conn.m = m;
+	conn.caps = SMTP_CAP_PIPELINING | SMTP_CAP_CHUNKING;
+	TAILQ_INIT(&conn.out);
+	CU_ASSERT(event_add(conn.sock, EVENT_READ, &conn));
+
+	CU_ASSERT(send_bdat(&conn) == 2);
+
+	// Pieces of body between stuffed dots share one descriptor of file
+	struct out_chunk *c;
+	struct out_file *file = 0;
+	int pieces = 0, shared = 1;
+	TAILQ_FOREACH(c, &conn.out, entry) {
+		if (!c->file) continue;
+		if (file && c->file != file) shared = 0;
+		file = c->file;
+		pieces++;
+	}
+	CU_ASSERT(pieces > 2 && shared && file->refs == pieces);
+
+	char *buf = malloc(body_size + 100);
+	struct event evs[1];
+	int expected = length + 40, got = 0, res;
+
+	while (got < expected) {
+		while ((res = recv(fd[1], buf + got, body_size + 100 - got, MSG_DONTWAIT)) > 0) got += res;
+		if (TAILQ_EMPTY(&conn.out)) break;
+		if (event_wait(evs, 1, 1000) != 1) break;
+		if (evs[0].events & EVENT_WRITE) conn_flush(&conn);
+	}
+
+	char first[32], last[32];
+	sprintf(first, "BDAT %d\r\n", BDAT_CHUNK_SIZE);
+	sprintf(last, "BDAT %d LAST\r\n", length - BDAT_CHUNK_SIZE);
+	int n1 = strlen(first), n2 = strlen(last);
+
+	CU_ASSERT(got == n1 + length + n2);
+	CU_ASSERT(memcmp(buf, first, n1) == 0);
+	CU_ASSERT(memcmp(buf + n1, body, BDAT_CHUNK_SIZE) == 0);
+	CU_ASSERT(memcmp(buf + n1 + BDAT_CHUNK_SIZE, last, n2) == 0);
+	CU_ASSERT(memcmp(buf + n1 + BDAT_CHUNK_SIZE + n2, body + BDAT_CHUNK_SIZE, length - BDAT_CHUNK_SIZE) == 0);
+	CU_ASSERT(TAILQ_EMPTY(&conn.out) && !conn.out_error);
+
+	event_del(conn.sock);
+	event_final();
+	close(fd[0]);
+	close(fd[1]);
+	unlink("../maildir/new/testmailbdat");
+	free_mail(m);
+	free(buf);
+	free(body);
+	free(stuffed);
+	maildir_final();
+	re_final();
+}
+
+
+void event_10_test() {
+	struct domain dom = {0};
+	struct mx_conn *conns[3];
+	int peers[3];
+
+	re_init();
+	CU_ASSERT(conn_init());
+	name_domain(&dom, "mail.com");
+	TAILQ_INIT(&dom.queue);
+	TAILQ_INIT(&dom.conns);
+
+	for (int i = 0; i < 3; ++i) {
+		int fd[2];
+		CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+		fcntl(fd[0], F_SETFL, O_NONBLOCK);
+		peers[i] = fd[1];
+
+		struct mx_conn *conn = conns[i] = calloc(1, sizeof(*conn));
+		conn->sock = fd[0];
+		conn->dom = &dom;
+		conn->state = SMTP_CLIENT_FSM_ST_INIT;
+		TAILQ_INIT(&conn->out);
+		conn_setup_timers(conn);
+		conn_attach(conn);
+
+		// With asynchronous I/O replies are received by operation in flight
+		if (event_async()) {
+			CU_ASSERT(event_add(conn->sock, 0, conn) && conn_recv(conn));
+		} else {
+			CU_ASSERT(event_add(conn->sock, EVENT_READ, conn));
+		}
+	}
+
+	// Greetings of all servers are ready, so one wakeup handles them all
+	for (int i = 0; i < 3; ++i) send(peers[i], "220 mx ready\r\n", 14, 0);
+
+	struct event_stats before = event_get_stats();
+	CU_ASSERT(wait_for_response() == 3);
+
+	struct event_stats after = event_get_stats();
+	CU_ASSERT(after.wakeups == before.wakeups + 1 && after.handled == before.handled + 3);
+	CU_ASSERT(after.events - before.events >= 3);
+
+	for (int i = 0; i < 3; ++i) {
+		CU_ASSERT(conns[i]->state == SMTP_CLIENT_FSM_ST_EHLO);
+	}
+
+	conn_final();
+
+	for (int i = 0; i < 3; ++i) {
+		close(peers[i]);
+		free(conns[i]);
+	}
+	re_final();
+}
+
+
+void event_06_test() {
+	event_backend_test("io_uring");
+
+	// Kernel without io_uring falls back to epoll
+	CU_ASSERT(event_current_backend() == EVENT_BACKEND_IO_URING
+			|| event_current_backend() == EVENT_BACKEND_EPOLL);
+}
+
+
+void event_07_test() {
+	int fd[2];
+	struct domain dom = {0};
+	struct mx_conn conn = {0};
+
+	CU_ASSERT(event_init("io_uring"));
+
+	if (!event_async()) {
+		event_final();
+		return;
+	}
+
+	CU_ASSERT(socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == 0);
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	conn.sock = fd[0];
+	conn.dom = &dom;
+	TAILQ_INIT(&conn.out);
+
+	CU_ASSERT(event_add(conn.sock, 0, &conn));
+	CU_ASSERT(conn_recv(&conn));
+
+	// All output is queued and sent by operations, one chunk at a time
+	int length = 1 << 20;
+	char *data = calloc(1, length);
+	CU_ASSERT(conn_write(&conn, data, length, 0));
+	CU_ASSERT(conn_write(&conn, "QUIT\r\n", 6, 1));
+	CU_ASSERT(conn.sending && conn.out_bytes == length + 6);
+
+	struct event evs[1];
+	char buf[65536];
+	int got = 0, res;
+
+	while (got < length + 6) {
+		while ((res = recv(fd[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0) got += res;
+		if (TAILQ_EMPTY(&conn.out)) continue;
+		if (event_wait(evs, 1, 1000) != 1) break;
+		CU_ASSERT(evs[0].data == &conn && evs[0].events == EVENT_SEND);
+		CU_ASSERT(conn_sent(&conn, evs[0].send_res));
+	}
+
+	CU_ASSERT(got == length + 6 && conn.out_bytes == 0 && !conn.sending);
+
+	// Reply is received into buffer of connection
+	send(fd[1], "220 ", 4, 0);
+	CU_ASSERT(event_wait(evs, 1, 1000) == 1);
+	CU_ASSERT(evs[0].events == EVENT_RECV && evs[0].recv_res == 4);
+	CU_ASSERT(conn_received(&conn, evs[0].recv_res) == 0 && conn.in.end == 4);
+
+	// Receiving in flight is cancelled, when socket is removed
+	CU_ASSERT(conn_recv(&conn));
+	CU_ASSERT(event_wait(evs, 1, 0) == 0);
+	CU_ASSERT(event_del(conn.sock));
+	send(fd[1], "250 ok\r\n", 8, 0);
+	CU_ASSERT(recv(fd[0], buf, sizeof(buf), 0) == 8);
+	CU_ASSERT(event_wait(evs, 1, 0) == 0 && conn.in.end == 4);
+
+	event_final();
+	free(data);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+
+// Builds reply to query: copies question and appends answer records with
+// name compressed to the question name
+static int dns_reply(unsigned char *buf, const unsigned char *query, int length, int flags, const unsigned char *answers, int answers_length, int count) {
+	memcpy(buf, query, length);
+	buf[2] = 0x81 | flags;	// QR, RD
+	buf[3] = 0x80;			// RA
+	buf[7] = count;
+	memcpy(buf + length, answers, answers_length);
+	return length + answers_length;
+}
+
+
+static struct dns_result dns_test_result;
+static int dns_test_calls;
+
+static void dns_test_callback(void *arg, const char *name, const struct dns_result *res) {
+	dns_test_result = *res;
+	dns_test_calls++;
+}
+
+
+void dns_01_test() {
+	unsigned char query[DNS_PACKET_SIZE], reply[DNS_PACKET_SIZE];
+	struct dns_result res;
+
+	int length = dns_build_query(query, 0x1234, "example.com", DNS_T_MX);
+	CU_ASSERT(length == 12 + 13 + 4);
+	CU_ASSERT(query[0] == 0x12 && query[1] == 0x34 && query[5] == 1);
+	CU_ASSERT(dns_build_query(query, 1, "bad..name", DNS_T_MX) == 0);
+
+	length = dns_build_query(query, 0x1234, "example.com.", DNS_T_MX);
+
+	// Two MX records: "mx2.example.com" and "mx1.example.com", which
+	// refers to the name of the first one
+	const unsigned char answers[] = {
+		0xc0, 12, 0, 15, 0, 1, 0, 0, 0x0e, 0x10, 0, 8, 0, 20, 3, 'm', 'x', '2', 0xc0, 12,
+		0xc0, 12, 0, 15, 0, 1, 0, 0, 0x01, 0x2c, 0, 8, 0, 10, 3, 'm', 'x', '1', 0xc0, 12
+	};
+	int reply_length = dns_reply(reply, query, length, 0, answers, sizeof(answers), 2);
+
+	CU_ASSERT(dns_parse_reply(reply, reply_length, DNS_T_MX, &res));
+	CU_ASSERT(res.status == DNS_OK && res.count == 2 && res.ttl == 300);
+	CU_ASSERT(res.mx[0].pref == 20 && !strcmp(res.mx[0].host, "mx2.example.com"));
+	CU_ASSERT(res.mx[1].pref == 10 && !strcmp(res.mx[1].host, "mx1.example.com"));
+
+	// Records of other types are skipped
+	CU_ASSERT(dns_parse_reply(reply, reply_length, DNS_T_A, &res));
+	CU_ASSERT(res.status == DNS_NODATA && res.count == 0);
+
+	// Truncated record
+	CU_ASSERT(!dns_parse_reply(reply, reply_length - 3, DNS_T_MX, &res));
+	CU_ASSERT(res.status == DNS_ERROR);
+
+	// Query instead of reply
+	CU_ASSERT(!dns_parse_reply(query, length, DNS_T_MX, &res));
+}
+
+
+void dns_02_test() {
+	unsigned char query[DNS_PACKET_SIZE], reply[DNS_PACKET_SIZE];
+	struct dns_result res;
+
+	int length = dns_build_query(query, 1, "nowhere.com", DNS_T_MX);
+
+	// Name of record points to itself
+	const unsigned char loop[] = {
+		0xc0, 29, 0, 15, 0, 1, 0, 0, 0, 60, 0, 4, 0, 10, 0xc0, 12
+	};
+	int reply_length = dns_reply(reply, query, length, 0, loop, sizeof(loop), 1);
+	CU_ASSERT(!dns_parse_reply(reply, reply_length, DNS_T_MX, &res));
+
+	// NXDOMAIN with SOA: TTL is minimum of SOA TTL and its MINIMUM field
+	const unsigned char soa[] = {
+		0xc0, 12, 0, 6, 0, 1, 0, 0, 0x0e, 0x10, 0, 32,
+		2, 'n', 's', 0xc0, 12, 4, 'h', 'o', 's', 't', 0xc0, 12,
+		0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 120
+	};
+	reply_length = dns_reply(reply, query, length, 0, soa, sizeof(soa), 0);
+	reply[3] |= 3;
+	reply[9] = 1;
+	CU_ASSERT(dns_parse_reply(reply, reply_length, DNS_T_MX, &res));
+	CU_ASSERT(res.status == DNS_NXDOMAIN && res.count == 0 && res.ttl == 120);
+}
+
+
+void dns_03_test() {
+	struct sockaddr_in sa = {0}, from;
+	socklen_t len = sizeof(sa), from_len = sizeof(from);
+	int server = socket(AF_INET, SOCK_DGRAM, 0);
+
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CU_ASSERT(bind(server, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+	getsockname(server, (struct sockaddr *)&sa, &len);
+
+	CU_ASSERT(event_init("poll"));
+	CU_ASSERT(dns_init("127.0.0.1", ntohs(sa.sin_port)));
+
+	dns_test_calls = 0;
+	CU_ASSERT(dns_resolve("mx.example.com", DNS_T_A, dns_test_callback, 0));
+	CU_ASSERT(dns_pending() == 1 && dns_next_timeout() > 0);
+
+	unsigned char query[DNS_PACKET_SIZE], reply[DNS_PACKET_SIZE];
+	int length = recvfrom(server, query, sizeof(query), 0, (struct sockaddr *)&from, &from_len);
+	CU_ASSERT(length == 12 + 16 + 4);
+
+	const unsigned char answers[] = {
+		0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 127, 0, 0, 1
+	};
+	int reply_length = dns_reply(reply, query, length, 0, answers, sizeof(answers), 1);
+
+	// Reply with another ID is ignored
+	reply[0] ^= 0xff;
+	sendto(server, reply, reply_length, 0, (struct sockaddr *)&from, from_len);
+	reply[0] ^= 0xff;
+	sendto(server, reply, reply_length, 0, (struct sockaddr *)&from, from_len);
+
+	struct event evs[1];
+	while (dns_test_calls == 0 && event_wait(evs, 1, 1000) == 1) {
+		CU_ASSERT(evs[0].data == dns_event_data());
+		dns_process();
+	}
+
+	CU_ASSERT(dns_test_calls == 1 && dns_pending() == 0);
+	CU_ASSERT(dns_test_result.status == DNS_OK && dns_test_result.count == 1);
+	CU_ASSERT(dns_test_result.addr[0].family == AF_INET);
+	CU_ASSERT(dns_test_result.addr[0].v4.s_addr == htonl(INADDR_LOOPBACK));
+
+	dns_final();
+	event_final();
+	close(server);
+}
+
+
+void dns_04_test() {
+	struct sockaddr_in sa = {0}, from;
+	socklen_t len = sizeof(sa), from_len = sizeof(from);
+	int server = socket(AF_INET, SOCK_DGRAM, 0);
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+	// TCP server listens on the same port as UDP one
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CU_ASSERT(bind(listener, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+	getsockname(listener, (struct sockaddr *)&sa, &len);
+	CU_ASSERT(listen(listener, 1) == 0);
+	CU_ASSERT(bind(server, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+
+	CU_ASSERT(event_init("poll"));
+	CU_ASSERT(dns_init("127.0.0.1", ntohs(sa.sin_port)));
+
+	dns_test_calls = 0;
+	CU_ASSERT(dns_resolve("example.com", DNS_T_MX, dns_test_callback, 0));
+
+	unsigned char query[DNS_PACKET_SIZE], reply[DNS_PACKET_SIZE + 2];
+	int length = recvfrom(server, query, sizeof(query), 0, (struct sockaddr *)&from, &from_len);
+	CU_ASSERT(length > 12);
+
+	// Truncated reply without records
+	int reply_length = dns_reply(reply, query, length, 0x02, 0, 0, 0);
+	sendto(server, reply, reply_length, 0, (struct sockaddr *)&from, from_len);
+
+	struct event evs[2];
+	CU_ASSERT(event_wait(evs, 2, 1000) == 1);
+	dns_process();
+	CU_ASSERT(dns_test_calls == 0 && dns_pending() == 1);
+
+	int client = accept(listener, 0, 0);
+	CU_ASSERT(client >= 0);
+
+	// Query is sent as soon as TCP socket becomes writable
+	unsigned char tcp_query[2 + DNS_PACKET_SIZE];
+	int got = 0;
+	for (int i = 0; i < 10 && got < 2 + length; ++i) {
+		int n = recv(client, tcp_query + got, sizeof(tcp_query) - got, MSG_DONTWAIT);
+		if (n > 0) got += n;
+		if (got < 2 + length && event_wait(evs, 2, 100) > 0) dns_process();
+	}
+	CU_ASSERT(got == 2 + length && tcp_query[1] == length);
+	CU_ASSERT(!memcmp(tcp_query + 2, query, length));
+
+	const unsigned char answers[] = {
+		0xc0, 12, 0, 15, 0, 1, 0, 0, 0, 60, 0, 7, 0, 5, 2, 'm', 'x', 0xc0, 12
+	};
+	reply_length = dns_reply(reply + 2, query, length, 0, answers, sizeof(answers), 1);
+	reply[0] = 0;
+	reply[1] = reply_length;
+	CU_ASSERT(send(client, reply, 2 + reply_length, 0) == 2 + reply_length);
+
+	while (dns_test_calls == 0 && event_wait(evs, 2, 1000) > 0) {
+		dns_process();
+	}
+
+	CU_ASSERT(dns_test_calls == 1 && dns_pending() == 0);
+	CU_ASSERT(dns_test_result.status == DNS_OK && dns_test_result.count == 1);
+	CU_ASSERT(dns_test_result.mx[0].pref == 5 && !strcmp(dns_test_result.mx[0].host, "mx.example.com"));
+
+	dns_final();
+	event_final();
+	close(client);
+	close(listener);
+	close(server);
+}
+
+
+void dns_05_test() {
+	struct dns_result res = {0}, cached;
+	const char *file = "/tmp/unittest-dns.cache";
+
+	dns_cache_final();
+	CU_ASSERT(dns_cache_init(0));
+
+	res.status = DNS_OK;
+	res.count = 2;
+	res.ttl = 300;
+	res.mx[0].pref = 10;
+	strcpy(res.mx[0].host, "mx1.example.com");
+	res.mx[1].pref = 20;
+	strcpy(res.mx[1].host, "mx2.example.com");
+	dns_cache_store("Example.COM.", DNS_T_MX, &res);
+
+	CU_ASSERT(!dns_cache_lookup("example.com", DNS_T_A, &cached));
+	CU_ASSERT(dns_cache_lookup("example.com", DNS_T_MX, &cached));
+	CU_ASSERT(cached.status == DNS_OK && cached.count == 2);
+	CU_ASSERT(cached.ttl > 0 && cached.ttl <= 300);
+	CU_ASSERT(!strcmp(cached.mx[1].host, "mx2.example.com"));
+
+	// Negative reply without SOA is cached for default time
+	memset(&res, 0, sizeof(res));
+	res.status = DNS_NXDOMAIN;
+	dns_cache_store("nowhere.com", DNS_T_MX, &res);
+	CU_ASSERT(dns_cache_lookup("nowhere.com", DNS_T_MX, &cached));
+	CU_ASSERT(cached.status == DNS_NXDOMAIN && cached.ttl <= DNS_CACHE_NEGATIVE_TTL);
+
+	// Errors and zero TTL are not cached
+	res.status = DNS_TIMEOUT;
+	dns_cache_store("slow.com", DNS_T_MX, &res);
+	CU_ASSERT(!dns_cache_lookup("slow.com", DNS_T_MX, &cached));
+
+	res.status = DNS_OK;
+	res.count = 1;
+	res.ttl = 0;
+	res.addr[0].family = AF_INET;
+	res.addr[0].v4.s_addr = htonl(INADDR_LOOPBACK);
+	dns_cache_store("volatile.com", DNS_T_A, &res);
+	CU_ASSERT(!dns_cache_lookup("volatile.com", DNS_T_A, &cached));
+
+	res.ttl = 60;
+	dns_cache_store("mx1.example.com", DNS_T_A, &res);
+
+	struct dns_cache_stats st = dns_cache_get_stats();
+	CU_ASSERT(st.entries == 3 && st.hits == 2 && st.negative_hits == 1 && st.misses == 3);
+
+	// Cache survives restart through file
+	remove(file);
+	CU_ASSERT(dns_cache_save(file));
+	dns_cache_final();
+
+	CU_ASSERT(dns_cache_init(file));
+	CU_ASSERT(dns_cache_get_stats().entries == 3);
+	CU_ASSERT(dns_cache_lookup("example.com", DNS_T_MX, &cached));
+	CU_ASSERT(cached.count == 2 && cached.mx[0].pref == 10 && !strcmp(cached.mx[0].host, "mx1.example.com"));
+	CU_ASSERT(dns_cache_lookup("nowhere.com", DNS_T_MX, &cached) && cached.status == DNS_NXDOMAIN);
+	CU_ASSERT(dns_cache_lookup("mx1.example.com", DNS_T_A, &cached));
+	CU_ASSERT(cached.count == 1 && cached.addr[0].v4.s_addr == htonl(INADDR_LOOPBACK));
+
+	dns_cache_final();
+	remove(file);
+}
+
+
+void dns_06_test() {
+	struct dns_result res = {0};
+
+	dns_cache_final();
+	CU_ASSERT(dns_cache_init(0));
+
+	res.status = DNS_OK;
+	res.count = 1;
+	res.ttl = 60;
+	res.addr[0].family = AF_INET;
+	res.addr[0].v4.s_addr = htonl(INADDR_LOOPBACK);
+	dns_cache_store("cached.example.com", DNS_T_A, &res);
+
+	// Cached name is resolved without any server
+	dns_test_calls = 0;
+	CU_ASSERT(dns_resolve("cached.example.com", DNS_T_A, dns_test_callback, 0));
+	CU_ASSERT(dns_test_calls == 1 && dns_pending() == 0);
+	CU_ASSERT(dns_test_result.status == DNS_OK && dns_test_result.addr[0].v4.s_addr == htonl(INADDR_LOOPBACK));
+
+	CU_ASSERT(!dns_resolve("other.example.com", DNS_T_A, dns_test_callback, 0));
+	CU_ASSERT(dns_test_calls == 2 && dns_test_result.status == DNS_ERROR);
+
+	dns_cache_final();
+}
+
+
+static int timer_test_fired[4];
+static long timer_test_now;
+
+static void timer_test_callback(struct timer *t, void *arg) {
+	int *fired = arg;
+	*fired = timer_test_now;
+}
+
+
+void arena_01_test() {
+	struct arena a;
+	struct arena_stats before = arena_get_stats();
+
+	arena_init(&a, 256);
+
+	// Memory is aligned and zeroed, small allocations share blocks
+	char *p = arena_alloc(&a, 1), *q = arena_alloc(&a, 3);
+	CU_ASSERT(p && q && (unsigned long)p % ARENA_ALIGN == 0 && (unsigned long)q % ARENA_ALIGN == 0);
+	CU_ASSERT(q == p + ARENA_ALIGN && *p == 0 && *q == 0);
+	CU_ASSERT(a.block_count == 1);
+
+	// Allocation, which does not fit into block, gets its own
+	char *big = arena_alloc(&a, 1000);
+	CU_ASSERT(big && big[999] == 0 && a.block_count == 2);
+
+	char *s = arena_strdup(&a, "mail.com");
+	CU_ASSERT(s && strcmp(s, "mail.com") == 0 && a.block_count == 3);
+
+	// Strings are not aligned
+	char *t = arena_strndup(&a, "gmail.com", 5);
+	CU_ASSERT(t == s + 9 && strcmp(t, "gmail") == 0);
+
+	unsigned long allocs = a.allocs, blocks = a.block_count;
+	arena_release(&a);
+
+	struct arena_stats after = arena_get_stats();
+	CU_ASSERT(a.blocks == 0 && after.arenas == before.arenas + 1);
+	CU_ASSERT(after.allocs == before.allocs + allocs && allocs == 5);
+	CU_ASSERT(after.blocks == before.blocks + blocks);
+
+	// Mail lives in its own arena with its file name, sender and
+	// recipients with their names
+	struct mail *m = read_mail_file("testmail3");
+	CU_ASSERT(m != 0);
+	if (m == 0) return;
+
+	CU_ASSERT(m->arena.block_count == 1 && m->arena.allocs == 9);
+	free_mail(m);
+	CU_ASSERT(arena_get_stats().arenas == before.arenas + 2);
+}
+
+void timer_01_test() {
+	struct timer t[4];
+
+	timer_init(1000);
+	for (int i = 0; i < 4; ++i) {
+		timer_test_fired[i] = 0;
+		timer_setup(&t[i], timer_test_callback, &timer_test_fired[i]);
+	}
+
+	CU_ASSERT(timer_next_timeout(1000) == -1);
+
+	timer_set(&t[0], 1010);
+	timer_set(&t[1], 1005);
+	timer_set(&t[2], 1000 + 300000);	// upper level of wheel
+	CU_ASSERT(timer_count() == 3);
+	CU_ASSERT(timer_next_timeout(1000) == 5);
+
+	// Every timer fires in its millisecond, not earlier
+	for (timer_test_now = 1000; timer_test_now <= 1010; ++timer_test_now) {
+		timer_run(timer_test_now);
+	}
+	CU_ASSERT(timer_test_fired[1] == 1005 && timer_test_fired[0] == 1010);
+	CU_ASSERT(timer_count() == 1);
+
+	// Rearming replaces previous expiration
+	timer_set(&t[3], 1100);
+	timer_set(&t[3], 1050);
+	CU_ASSERT(timer_count() == 2);
+	CU_ASSERT(timer_next_timeout(1011) == 39);
+
+	timer_cancel(&t[3]);
+	timer_cancel(&t[3]);
+	CU_ASSERT(timer_count() == 1);
+
+	// Timer of upper level is moved down in time and fires exactly
+	long step = 0;
+	for (timer_test_now = 1011; !timer_test_fired[2] && timer_test_now < 1000 + 400000; timer_test_now += step) {
+		int left = timer_next_timeout(timer_test_now);
+		CU_ASSERT(left >= 0);
+		if (left < 0) break;
+
+		step = left ? left : 1;
+		timer_run(timer_test_now);
+	}
+	CU_ASSERT(timer_test_fired[2] == 1000 + 300000);
+	CU_ASSERT(timer_count() == 0 && timer_next_timeout(timer_test_now) == -1);
+}
+
+
+void timer_02_test() {
+	struct timer t[100];
+	int fired[100] = {0};
+
+	timer_init(5);
+
+	// Expirations in random order, some of them in the past
+	for (int i = 0; i < 100; ++i) {
+		timer_setup(&t[i], timer_test_callback, &fired[i]);
+		timer_set(&t[i], (i * 7919) % 5000);
+	}
+
+	for (timer_test_now = 5; timer_test_now <= 5000; timer_test_now += 3) {
+		timer_run(timer_test_now);
+	}
+
+	int exact = 1;
+	for (int i = 0; i < 100; ++i) {
+		long expires = (i * 7919) % 5000;
+		if (expires < 5) expires = 5;
+
+		// Run is called every 3 ms, so timer fires at the first run after it
+		if (fired[i] < expires || fired[i] > expires + 2) exact = 0;
+	}
+
+	CU_ASSERT(exact);
+	CU_ASSERT(timer_count() == 0);
+}
+
+
+// Queue keeps order of mails and holds not more than its size
+void worker_01_test() {
+	static struct mail_ring r;
+	struct mail mails[3];
+
+	CU_ASSERT(mail_ring_pop(&r) == 0);
+
+	// Indexes wrap around many times
+	int ordered = 1;
+	for (int i = 0; i < 3 * WORKER_RING_SIZE; ++i) {
+		mail_ring_push(&r, &mails[i % 3]);
+		if (mail_ring_pop(&r) != &mails[i % 3]) ordered = 0;
+	}
+	CU_ASSERT(ordered);
+
+	int pushed = 0;
+	while (mail_ring_push(&r, &mails[0])) pushed++;
+	CU_ASSERT(pushed == WORKER_RING_SIZE);
+
+	int popped = 0;
+	while (mail_ring_pop(&r)) popped++;
+	CU_ASSERT(popped == WORKER_RING_SIZE);
+}
+
+
+static struct mail_ring worker_test_ring;
+static struct mail worker_test_mails[64];
+
+static void* worker_test_writer(void *arg) {
+	for (int i = 0; i < 100000; ++i) {
+		while (!mail_ring_push(&worker_test_ring, &worker_test_mails[i % 64]));
+	}
+
+	return 0;
+}
+
+// Mails written by one thread are read by another one in the same order
+void worker_02_test() {
+	pthread_t writer;
+	CU_ASSERT(pthread_create(&writer, 0, worker_test_writer, 0) == 0);
+
+	int ordered = 1;
+	for (int i = 0; i < 100000; ++i) {
+		struct mail *m;
+		while (!(m = mail_ring_pop(&worker_test_ring)));
+		if (m != &worker_test_mails[i % 64]) ordered = 0;
+	}
+
+	pthread_join(writer, 0);
+	CU_ASSERT(ordered);
+	CU_ASSERT(mail_ring_pop(&worker_test_ring) == 0);
+}
+
+// Domains are spread over workers, every domain always goes to one worker
+void worker_03_test() {
+	CU_ASSERT(worker_of_domain("gmail.com") == 0);
+	CU_ASSERT(worker_owns_domain("gmail.com"));
+
+	// Count, which divides multipliers of simple hashes
+	CU_ASSERT(workers_start(3));
+	CU_ASSERT(workers_count() == 3);
+
+	int used[3] = {0}, stable = 1;
+	for (int i = 0; i < 1000; ++i) {
+		char name[32];
+		sprintf(name, "domain%d.com", i);
+
+		int id = worker_of_domain(name);
+		if (id < 0 || id >= 3) {
+			stable = 0;
+			continue;
+		}
+
+		used[id]++;
+		if (worker_of_domain(name) != id) stable = 0;
+	}
+
+	CU_ASSERT(stable);
+	for (int i = 0; i < 3; ++i) {
+		CU_ASSERT(used[i] > 250);
+	}
+
+	CU_ASSERT(worker_of_domain("GMail.Com") == worker_of_domain("gmail.com"));
+
+	// Main thread is not a worker
+	CU_ASSERT(worker_self() == 0);
+	CU_ASSERT(workers_done_fd() >= 0);
+
+	workers_stop();
+	CU_ASSERT(workers_count() == 0 && workers_done_fd() == -1);
+}
+
+
+int init_maildir_suite() {
+	maildir_init();
+	re_init();
+	return 0;
+}
+
+int clean_maildir_suite() {
+	maildir_final();
+	re_final();
+	return 0;
+}
+
+int init_regexp_suite() {
+	re_init();
+	return 0;
+}
+
+int clean_regexp_suite() {
+	re_final();
+	return 0;
+}
+
+int init_dns_suite() {
+	dns_cache_init(0);
+	return 0;
+}
+
+int clean_dns_suite() {
+	dns_cache_final();
+	return 0;
+}
+
+int init_fsm_suite() {
+	maildir_init();
+	re_init();
+	return 0;
+}
+
+int clean_fsm_suite() {
+	maildir_final();
+	re_final();
+	return 0;
+}
+
+struct test maildir_tests[] = {
+	{maildir_01_test, "Correct mail file."},
+	{maildir_03_test, "Mail file with multiple recipients."},
+	{maildir_05_test, "Mail file with multiple senders."},
+	{maildir_02_test, "Mail file without recipients."},
+	{maildir_06_test, "Mail file without DATA."},
+	{maildir_04_test, "Mail file without dot."},
+	{maildir_07_test, "New mail is picked up by watcher."},
+	{maildir_08_test, "Scanner counts every mail file once."},
+	{maildir_09_test, "Batch of operations with mail files."},
+	{maildir_10_test, "Large mail file is mapped."},
+	{maildir_11_test, "Mail files are parsed by parser threads in order."},
+	{maildir_12_test, "Domains of recipients are interned."}
+};
+
+struct test regexp_tests[] = {
+	{regexp_01_test, "Correct R220."},
+	{regexp_03_test, "Correct MAIL FROM."},
+	{regexp_02_test, "Incorrect R354."},
+	{regexp_04_test, "Incorrect RCPT TO."},
+	{regexp_05_test, "Incorrect RCPT TO."},
+	{regexp_09_test, "Correct regexp, but incorrect param."},
+	{regexp_06_test, "Match any, should be r250."},
+	{regexp_07_test, "Match any, should be DATA."},
+	{regexp_08_test, "Match any, should be RCPT TO."},
+};
+
+struct test envelope_tests[] = {
+	{envelope_01_test, "Envelope lines are recognized by all scanners."},
+	{envelope_02_test, "Envelope scanners agree with regexps."}
+};
+
+struct test reply_tests[] = {
+	{reply_01_test, "Two coalesced replies."},
+	{reply_02_test, "Incomplete reply."},
+	{reply_03_test, "Multiline reply."},
+	{reply_04_test, "Code of multiline reply is taken from last line."},
+	{reply_05_test, "Capabilities in EHLO reply."},
+};
+
+struct test event_tests[] = {
+	{event_01_test, "poll() backend."},
+	{event_02_test, "epoll() backend."},
+	{event_03_test, "Output is queued until socket is writable."},
+	{event_04_test, "Non-blocking connect."},
+	{event_05_test, "Unreachable address is raced by next one."},
+	{event_06_test, "io_uring backend."},
+	{event_07_test, "Asynchronous sending and receiving with io_uring."},
+	{event_08_test, "Message body is sent from mail file."},
+	{event_09_test, "Message body is sent by BDAT chunks."},
+	{event_10_test, "Ready sessions are handled in one wakeup."},
+};
+
+struct test dns_tests[] = {
+	{ dns_01_test, "Query and MX reply with compressed names." },
+	{ dns_02_test, "Malformed and negative replies." },
+	{ dns_03_test, "Query over UDP." },
+	{ dns_04_test, "Truncated reply is repeated over TCP." },
+	{ dns_05_test, "Cache of replies." },
+	{ dns_06_test, "Cached name is resolved at once." }
+};
+
+struct test arena_tests[] = {
+	{ arena_01_test, "Arena allocates aligned memory and counts it." }
+};
+
+struct test timer_tests[] = {
+	{ timer_01_test, "Timers fire in their millisecond." },
+	{ timer_02_test, "Many timers." }
+};
+
+struct test worker_tests[] = {
+	{ worker_01_test, "Queue of mail." },
+	{ worker_02_test, "Queue of mail between two threads." },
+	{ worker_03_test, "Domains are sharded over workers." }
+};
+
+struct test fsm_tests[] = {
+	{fsm_01_test, "Correct minimal session."},
+	{fsm_02_test, "Correct session with 2 mails with multiple recipients."},
+	{fsm_03_test, "Incorrect session."},
+	{fsm_04_test, "Mail enqueued during session is sent by it."},
+	{fsm_05_test, "Correct pipelined session."},
+	{fsm_06_test, "Pipelined session with early 354."},
+	{fsm_07_test, "Rejected EHLO falls back to HELO."},
+	{fsm_08_test, "Count of sessions for domain."},
+	{fsm_09_test, "Mail of refused session is returned to queue."},
+	{fsm_10_test, "Idle session is reused for new mail."},
+	{fsm_11_test, "Sessions are spread over MX and fail over to next ones."},
+	{fsm_12_test, "Pipelined session with BDAT."},
+	{fsm_13_test, "Session with BDAT without pipelining."},
+	{fsm_14_test, "Recipient is limited in length and sent whole."},
+};
+
+int main(int argc, char **argv) {
+	opts_init();
+	timer_init(time_ms());
+
+	CU_pSuite maildir_suite = NULL;
+	CU_pSuite regexp_suite = NULL;
+	CU_pSuite fsm_suite = NULL;
+	CU_pSuite event_suite = NULL;
+	CU_pSuite envelope_suite = NULL;
+	CU_pSuite reply_suite = NULL;
+	CU_pSuite dns_suite = NULL;
+	CU_pSuite timer_suite = NULL;
+	CU_pSuite arena_suite = NULL;
+	CU_pSuite worker_suite = NULL;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) goto exit;
+
+	if (!(maildir_suite = CU_add_suite("Test maildir.", init_maildir_suite, clean_maildir_suite))) goto clean;
+	for (int i = 0; i < sizeof(maildir_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(maildir_suite, maildir_tests[i].name, maildir_tests[i].func)) goto clean;
+	}
+
+	if (!(regexp_suite = CU_add_suite("Test regexp.", init_regexp_suite, clean_regexp_suite))) goto clean;
+	for (int i = 0; i < sizeof(regexp_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(regexp_suite, regexp_tests[i].name, regexp_tests[i].func)) goto clean;
+	}
+
+	if (!(envelope_suite = CU_add_suite("Test envelope.", init_regexp_suite, clean_regexp_suite))) goto clean;
+	for (int i = 0; i < sizeof(envelope_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(envelope_suite, envelope_tests[i].name, envelope_tests[i].func)) goto clean;
+	}
+
+	if (!(reply_suite = CU_add_suite("Test replies.", init_regexp_suite, clean_regexp_suite))) goto clean;
+	for (int i = 0; i < sizeof(reply_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(reply_suite, reply_tests[i].name, reply_tests[i].func)) goto clean;
+	}
+
+	if (!(fsm_suite = CU_add_suite("Test FSM.", init_fsm_suite, clean_fsm_suite))) goto clean;
+	for (int i = 0; i < sizeof(fsm_tests) / sizeof(struct test); ++i) {
 		if (!CU_add_test(fsm_suite, fsm_tests[i].name, fsm_tests[i].func)) goto clean;
 	}
 
+	if (!(event_suite = CU_add_suite("Test events.", 0, 0))) goto clean;
+	for (int i = 0; i < sizeof(event_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(event_suite, event_tests[i].name, event_tests[i].func)) goto clean;
+	}
+
+	if (!(arena_suite = CU_add_suite("Test arenas.", init_maildir_suite, clean_maildir_suite))) goto clean;
+	for (int i = 0; i < sizeof(arena_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(arena_suite, arena_tests[i].name, arena_tests[i].func)) goto clean;
+	}
+
+	if (!(timer_suite = CU_add_suite("Test timers.", 0, 0))) goto clean;
+	for (int i = 0; i < sizeof(timer_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(timer_suite, timer_tests[i].name, timer_tests[i].func)) goto clean;
+	}
+
+	if (!(dns_suite = CU_add_suite("Test DNS.", init_dns_suite, clean_dns_suite))) goto clean;
+	for (int i = 0; i < sizeof(dns_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(dns_suite, dns_tests[i].name, dns_tests[i].func)) goto clean;
+	}
+
+	if (!(worker_suite = CU_add_suite("Test workers.", 0, 0))) goto clean;
+	for (int i = 0; i < sizeof(worker_tests) / sizeof(struct test); ++i) {
+		if (!CU_add_test(worker_suite, worker_tests[i].name, worker_tests[i].func)) goto clean;
+	}
+
 	CU_basic_set_mode(CU_BRM_VERBOSE);
 	CU_basic_run_tests();
 